@@ -37,6 +37,9 @@ public class WhisperFullParams extends Structure {
     /** Audio duration to process in milliseconds. (default = 0) */
     public int duration_ms;
 
+    /** Time budget for the processing in milliseconds, decoding is degraded to meet it. (default = 0 - no limit) */
+    public int deadline_ms;
+
     /** Translate flag. (default = false) */
     public CBool translate;
 
@@ -318,7 +321,7 @@ public class WhisperFullParams extends Structure {
 
     @Override
     protected List<String> getFieldOrder() {
-        return Arrays.asList("strategy", "n_threads", "n_max_text_ctx", "offset_ms", "duration_ms", "translate",
+        return Arrays.asList("strategy", "n_threads", "n_max_text_ctx", "offset_ms", "duration_ms", "deadline_ms", "translate",
                 "no_context", "single_segment", "no_timestamps",
                 "print_special", "print_progress", "print_realtime", "print_timestamps",  "token_timestamps",
                 "thold_pt", "thold_ptsum", "max_len", "split_on_word", "max_tokens", "speed_up", "audio_ctx",
@@ -0,0 +1,436 @@
+#include "ggml.h"
+#include "whisper.h"
+
+#include "common.h"
+#include "json.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+using json = nlohmann::ordered_json;
+
+// command-line parameters
+struct whisper_params {
+    std::vector<std::string> models;    // one per quantization type to compare
+    std::vector<std::string> fname_inp;
+
+    std::vector<int> durations_ms = { 0 }; // 0 - the whole sample, longer durations repeat the sample
+    std::vector<int> threads      = { std::min(4, (int32_t) std::thread::hardware_concurrency()) };
+    std::vector<int> beam_sizes   = { 1, 5 }; // 1 - greedy
+    std::vector<int> timestamps   = { 1, 0 };
+
+    int32_t n_repeat = 1; // the fastest of the repetitions is reported
+
+    float tolerance = 0.10f; // relative slowdown over the baseline reported as a regression
+
+    std::string language = "en";
+    std::string fname_out;      // empty - stdout
+    std::string fname_baseline; // empty - no comparison
+
+    bool use_gpu = true;
+};
+
+void whisper_print_usage(int argc, char ** argv, const whisper_params & params);
+
+bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            whisper_print_usage(argc, argv, params);
+            exit(0);
+        }
+        else if (arg == "-m"   || arg == "--model")       { params.models.emplace_back(argv[++i]); }
+        else if (arg == "-f"   || arg == "--file")        { params.fname_inp.emplace_back(argv[++i]); }
+        else if (arg == "-d"   || arg == "--duration")    { params.durations_ms   = parse_int_list(argv[++i]); }
+        else if (arg == "-t"   || arg == "--threads")     { params.threads        = parse_int_list(argv[++i]); }
+        else if (arg == "-bs"  || arg == "--beam-size")   { params.beam_sizes     = parse_int_list(argv[++i]); }
+        else if (arg == "-ts"  || arg == "--timestamps")  { params.timestamps     = parse_int_list(argv[++i]); }
+        else if (arg == "-r"   || arg == "--repeat")      { params.n_repeat       = std::stoi(argv[++i]); }
+        else if (arg == "-l"   || arg == "--language")    { params.language       = argv[++i]; }
+        else if (arg == "-o"   || arg == "--output")      { params.fname_out      = argv[++i]; }
+        else if (arg == "-b"   || arg == "--baseline")    { params.fname_baseline = argv[++i]; }
+        else if (arg == "-tol" || arg == "--tolerance")   { params.tolerance      = std::stof(argv[++i]); }
+        else if (arg == "-ng"  || arg == "--no-gpu")      { params.use_gpu        = false; }
+        else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            whisper_print_usage(argc, argv, params);
+            exit(0);
+        }
+    }
+
+    if (params.models.empty()) {
+        params.models.emplace_back("models/ggml-base.en.bin");
+    }
+    if (params.fname_inp.empty()) {
+        params.fname_inp.emplace_back("samples/jfk.wav");
+    }
+
+    return true;
+}
+
+void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & params) {
+    fprintf(stderr, "\n");
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "runs whisper_full on every combination of the options and reports the timings as JSON\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h,         --help             [default] show this help message and exit\n");
+    fprintf(stderr, "  -m FNAME,   --model FNAME      [%-7s] model path, can be repeated (e.g. one per quantization type)\n", "base.en");
+    fprintf(stderr, "  -f FNAME,   --file FNAME       [%-7s] input WAV file path, can be repeated\n", "jfk.wav");
+    fprintf(stderr, "  -d N,...,   --duration N,...   [%-7s] audio durations in ms (0 - whole file, longer repeats the file)\n", list_to_str(params.durations_ms).c_str());
+    fprintf(stderr, "  -t N,...,   --threads N,...    [%-7s] numbers of threads\n", list_to_str(params.threads).c_str());
+    fprintf(stderr, "  -bs N,...,  --beam-size N,...  [%-7s] beam sizes (1 - greedy)\n", list_to_str(params.beam_sizes).c_str());
+    fprintf(stderr, "  -ts N,...,  --timestamps N,... [%-7s] timestamps enabled (1) or disabled (0)\n", list_to_str(params.timestamps).c_str());
+    fprintf(stderr, "  -r N,       --repeat N         [%-7d] repetitions of each run, the fastest is reported\n", params.n_repeat);
+    fprintf(stderr, "  -l LANG,    --language LANG    [%-7s] spoken language\n", params.language.c_str());
+    fprintf(stderr, "  -o FNAME,   --output FNAME     [%-7s] output JSON file path (default - stdout)\n", params.fname_out.c_str());
+    fprintf(stderr, "  -b FNAME,   --baseline FNAME   [%-7s] JSON of a previous run to compare against\n", params.fname_baseline.c_str());
+    fprintf(stderr, "  -tol N,     --tolerance N      [%-7.2f] relative slowdown over the baseline reported as a regression\n", params.tolerance);
+    fprintf(stderr, "  -ng,        --no-gpu           [%-7s] disable GPU\n", params.use_gpu ? "false" : "true");
+    fprintf(stderr, "\n");
+}
+
+static std::string basename(const std::string & path) {
+    return path.substr(path.find_last_of("/\\") + 1);
+}
+
+// peak resident set size of the process in MB - it never decreases, so it includes the models benchmarked earlier
+static double peak_rss_mb_process() {
+#if defined(__linux__) || defined(__APPLE__)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#if defined(__APPLE__)
+        return usage.ru_maxrss/1024.0/1024.0; // bytes
+#else
+        return usage.ru_maxrss/1024.0;        // KB
+#endif
+    }
+#endif
+    return 0.0;
+}
+
+// resets the peak resident set size to the current one, so that the peak of each run can be measured - only on Linux
+static bool peak_rss_reset() {
+#if defined(__linux__)
+    FILE * f = fopen("/proc/self/clear_refs", "w");
+    if (f == nullptr) {
+        return false;
+    }
+
+    const bool ok = fputs("5", f) >= 0;
+
+    return fclose(f) == 0 && ok;
+#else
+    return false;
+#endif
+}
+
+// peak resident set size in MB since the last peak_rss_reset
+static double peak_rss_mb() {
+    std::ifstream fin("/proc/self/status");
+
+    std::string line;
+    while (std::getline(fin, line)) {
+        if (line.rfind("VmHWM:", 0) == 0) {
+            return std::stod(line.substr(6))/1024.0; // KB
+        }
+    }
+
+    return 0.0;
+}
+
+// the first n_samples of the audio, repeated if it is shorter
+static std::vector<float> audio_crop(const std::vector<float> & pcmf32, int duration_ms) {
+    if (duration_ms <= 0 || pcmf32.empty()) {
+        return pcmf32;
+    }
+
+    const size_t n_samples = (size_t) duration_ms*WHISPER_SAMPLE_RATE/1000;
+
+    std::vector<float> res(n_samples);
+    for (size_t i = 0; i < n_samples; ++i) {
+        res[i] = pcmf32[i % pcmf32.size()];
+    }
+
+    return res;
+}
+
+struct bench_run {
+    std::string model;
+    std::string audio;
+
+    int duration_ms;
+    int n_threads;
+    int beam_size;
+    int timestamps;
+};
+
+static std::string run_name(const bench_run & run, double duration_s) {
+    char buf[512];
+    snprintf(buf, sizeof(buf), "%s|%s|%.1fs|t%d|bs%d|ts%d",
+            basename(run.model).c_str(), basename(run.audio).c_str(), duration_s, run.n_threads, run.beam_size, run.timestamps);
+    return buf;
+}
+
+static bool run_full(whisper_context * ctx, const whisper_params & params, const bench_run & run, const std::vector<float> & pcmf32, int64_t & t_total_us, whisper_timings & timings) {
+    whisper_full_params wparams = whisper_full_default_params(run.beam_size > 1 ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY);
+
+    wparams.print_realtime   = false;
+    wparams.print_progress   = false;
+    wparams.print_timestamps = false;
+    wparams.print_special    = false;
+    wparams.no_timestamps    = run.timestamps == 0;
+    wparams.language         = params.language.c_str();
+    wparams.n_threads        = run.n_threads;
+
+    if (run.beam_size > 1) {
+        wparams.beam_search.beam_size = run.beam_size;
+    }
+
+    whisper_reset_timings(ctx);
+
+    const int64_t t_start_us = ggml_time_us();
+
+    if (whisper_full(ctx, wparams, pcmf32.data(), pcmf32.size()) != 0) {
+        return false;
+    }
+
+    t_total_us = ggml_time_us() - t_start_us;
+    timings    = whisper_get_timings(ctx);
+
+    return true;
+}
+
+// peak_rss_mb < 0 - not measured for the run
+static json run_to_json(whisper_context * ctx, const bench_run & run, double duration_s, int64_t t_total_us, const whisper_timings & t, double peak_rss_mb) {
+    const double total_s = 1e-6*t_total_us;
+
+    json res;
+    res["name"]        = run_name(run, duration_s);
+    res["model"]       = basename(run.model);
+    res["model_type"]  = whisper_model_type_readable(ctx);
+    res["ftype"]       = ggml_type_name(ggml_ftype_to_ggml_type((ggml_ftype) whisper_model_ftype(ctx)));
+    res["audio"]       = basename(run.audio);
+    res["duration_s"]  = duration_s;
+    res["n_threads"]   = run.n_threads;
+    res["beam_size"]   = run.beam_size;
+    res["timestamps"]  = run.timestamps != 0;
+    res["total_ms"]    = 1e-3*t_total_us;
+    res["rtf"]         = duration_s > 0.0 ? total_s/duration_s : 0.0;
+    res["tokens"]      = t.n_tokens;
+    res["tokens_per_s"] = total_s > 0.0 ? t.n_tokens/total_s : 0.0;
+    res["windows"]     = t.n_windows;
+    res["stages_ms"] = {
+        { "mel",     1e-3*t.t_mel_us    },
+        { "encode",  1e-3*t.t_encode_us },
+        { "prompt",  1e-3*t.t_prompt_us },
+        { "batchd",  1e-3*t.t_batchd_us },
+        { "decode",  1e-3*t.t_decode_us },
+        { "sample",  1e-3*t.t_sample_us },
+        { "graph",   1e-3*t.t_graph_us  },
+        { "compute", 1e-3*t.t_compute_us },
+    };
+    res["runs"] = {
+        { "encode", t.n_encode },
+        { "prompt", t.n_prompt },
+        { "batchd", t.n_batchd },
+        { "decode", t.n_decode },
+        { "sample", t.n_sample },
+    };
+    res["fallbacks"]   = t.n_windows - t.n_temp[0];
+    res["compute_mb"]  = t.mem_compute/1024.0/1024.0;
+    if (peak_rss_mb >= 0.0) {
+        res["peak_rss_mb"] = peak_rss_mb;
+    }
+
+    return res;
+}
+
+// compares the total time of the runs with the same name, returns the number of regressions
+static int compare_baseline(const json & runs, const json & baseline, float tolerance) {
+    std::map<std::string, double> base;
+    for (const auto & run : baseline.at("runs")) {
+        base[run.at("name").get<std::string>()] = run.at("total_ms").get<double>();
+    }
+
+    int n_regressions = 0;
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%-56s %12s %12s %8s\n", "run", "baseline ms", "current ms", "change");
+    for (const auto & run : runs) {
+        const std::string name = run.at("name").get<std::string>();
+        const double cur = run.at("total_ms").get<double>();
+
+        const auto it = base.find(name);
+        if (it == base.end()) {
+            fprintf(stderr, "%-56s %12s %12.1f %8s\n", name.c_str(), "-", cur, "new");
+            continue;
+        }
+
+        const double change = it->second > 0.0 ? cur/it->second - 1.0 : 0.0;
+        const bool regression = change > tolerance;
+
+        fprintf(stderr, "%-56s %12.1f %12.1f %+7.1f%%%s\n", name.c_str(), it->second, cur, 100.0*change, regression ? "  REGRESSION" : "");
+
+        n_regressions += regression;
+    }
+    fprintf(stderr, "\n");
+
+    return n_regressions;
+}
+
+int main(int argc, char ** argv) {
+    whisper_params params;
+
+    if (whisper_params_parse(argc, argv, params) == false) {
+        whisper_print_usage(argc, argv, params);
+        return 1;
+    }
+
+    std::map<std::string, std::vector<float>> audio;
+    for (const auto & fname : params.fname_inp) {
+        std::vector<float> pcmf32;
+        std::vector<std::vector<float>> pcmf32s;
+
+        if (!::read_wav(fname, pcmf32, pcmf32s, false)) {
+            fprintf(stderr, "error: failed to read WAV file '%s'\n", fname.c_str());
+            return 2;
+        }
+
+        audio[fname] = std::move(pcmf32);
+    }
+
+    json baseline;
+    if (!params.fname_baseline.empty()) {
+        std::ifstream fin(params.fname_baseline);
+        if (!fin) {
+            fprintf(stderr, "error: failed to open baseline '%s'\n", params.fname_baseline.c_str());
+            return 2;
+        }
+        try {
+            baseline = json::parse(fin);
+        } catch (const std::exception & e) {
+            fprintf(stderr, "error: failed to parse baseline '%s': %s\n", params.fname_baseline.c_str(), e.what());
+            return 2;
+        }
+    }
+
+    json runs = json::array();
+
+    // the peak RSS of each run, if the peak can be reset - otherwise only the peak of the process is reported
+    // the reset also lowers the peak of getrusage, so the peak of the process is tracked over the resets
+    double rss_peak_mb = peak_rss_mb();
+
+    const bool rss_per_run = peak_rss_reset();
+
+    for (const auto & model : params.models) {
+        struct whisper_context_params cparams = whisper_context_default_params();
+        cparams.use_gpu = params.use_gpu;
+
+        struct whisper_context * ctx = whisper_init_from_file_with_params(model.c_str(), cparams);
+        if (ctx == nullptr) {
+            fprintf(stderr, "error: failed to initialize whisper context from '%s'\n", model.c_str());
+            return 3;
+        }
+
+        // heat up - the first run pays for the page faults of the weights and the compute buffers
+        {
+            const bench_run run = { model, params.fname_inp[0], 0, params.threads[0], 1, 1 };
+
+            int64_t t_total_us;
+            whisper_timings timings;
+            if (!run_full(ctx, params, run, audio_crop(audio[run.audio], 3000), t_total_us, timings)) {
+                fprintf(stderr, "error: failed to process audio\n");
+                return 4;
+            }
+        }
+
+        for (const auto & fname : params.fname_inp) {
+            for (const int duration_ms : params.durations_ms) {
+                const std::vector<float> pcmf32 = audio_crop(audio[fname], duration_ms);
+                const double duration_s = double(pcmf32.size())/WHISPER_SAMPLE_RATE;
+
+                for (const int n_threads : params.threads) {
+                    for (const int beam_size : params.beam_sizes) {
+                        for (const int timestamps : params.timestamps) {
+                            const bench_run run = { model, fname, duration_ms, n_threads, beam_size, timestamps };
+
+                            int64_t t_best_us = -1;
+                            whisper_timings timings_best = {};
+
+                            // includes the weights that are resident at the start of the run
+                            if (rss_per_run) {
+                                rss_peak_mb = std::max(rss_peak_mb, peak_rss_mb());
+                                peak_rss_reset();
+                            }
+
+                            for (int i = 0; i < params.n_repeat; ++i) {
+                                int64_t t_total_us;
+                                whisper_timings timings;
+                                if (!run_full(ctx, params, run, pcmf32, t_total_us, timings)) {
+                                    fprintf(stderr, "error: failed to process audio\n");
+                                    return 4;
+                                }
+
+                                if (t_best_us < 0 || t_total_us < t_best_us) {
+                                    t_best_us    = t_total_us;
+                                    timings_best = timings;
+                                }
+                            }
+
+                            const double rss_run_mb = rss_per_run ? peak_rss_mb() : -1.0;
+                            rss_peak_mb = std::max(rss_peak_mb, rss_run_mb);
+
+                            runs.push_back(run_to_json(ctx, run, duration_s, t_best_us, timings_best, rss_run_mb));
+
+                            fprintf(stderr, "%s: %-56s %10.1f ms, rtf = %.3f\n", __func__, run_name(run, duration_s).c_str(),
+                                    1e-3*t_best_us, runs.back()["rtf"].get<double>());
+                        }
+                    }
+                }
+            }
+        }
+
+        whisper_free(ctx);
+    }
+
+    json res;
+    res["system_info"]  = whisper_print_system_info();
+    res["n_hw_threads"] = std::thread::hardware_concurrency();
+    res["peak_rss_mb"]  = rss_per_run ? std::max(rss_peak_mb, peak_rss_mb()) : peak_rss_mb_process();
+    res["runs"]         = runs;
+
+    if (params.fname_out.empty()) {
+        printf("%s\n", res.dump(2).c_str());
+    } else {
+        std::ofstream fout(params.fname_out);
+        if (!fout) {
+            fprintf(stderr, "error: failed to open '%s' for writing\n", params.fname_out.c_str());
+            return 5;
+        }
+        fout << res.dump(2) << "\n";
+        fprintf(stderr, "%s: saving results to '%s'\n", __func__, params.fname_out.c_str());
+    }
+
+    if (!baseline.is_null()) {
+        const int n_regressions = compare_baseline(runs, baseline, params.tolerance);
+        if (n_regressions > 0) {
+            fprintf(stderr, "%s: %d run(s) slower than the baseline by more than %.0f%%\n", __func__, n_regressions, 100.0f*params.tolerance);
+            return 1;
+        }
+    }
+
+    return 0;
+}
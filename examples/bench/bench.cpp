@@ -1,16 +1,43 @@
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
 #include "whisper.h"
 
+#include "common.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <cstdio>
 #include <cstring>
+#include <functional>
+#include <random>
 #include <string>
 #include <thread>
+#include <vector>
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
 
 // command-line parameters
 struct whisper_params {
     int32_t n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
-    int32_t what = 0; // what to benchmark: 0 - whisper encoder, 1 - memcpy, 2 - ggml_mul_mat
+    int32_t what = 0; // what to benchmark: 0 - whisper encoder, 1 - memcpy, 2 - ggml_mul_mat, 3 - concurrent states, 4 - ggml ops
+
+    // concurrent states
+    std::vector<int> threads  = { n_threads }; // threads per state
+    std::vector<int> n_states = { 1, 2, 4 };
+
+    int32_t n_requests  = 4; // requests processed by each state
+    int32_t duration_ms = 0; // 0 - the whole file
+
+    // ggml ops
+    std::string model_size = "base";
+    std::string types      = ""; // comma-separated weight types to benchmark, empty - all
 
     std::string model = "models/ggml-base.en.bin";
+    std::string fname_inp = "samples/jfk.wav";
 
     bool use_gpu = true;
 };
@@ -25,10 +52,16 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
             whisper_print_usage(argc, argv, params);
             exit(0);
         }
-        else if (arg == "-t"  || arg == "--threads") { params.n_threads = std::stoi(argv[++i]); }
-        else if (arg == "-m"  || arg == "--model")   { params.model     = argv[++i]; }
-        else if (arg == "-w"  || arg == "--what")    { params.what      = atoi(argv[++i]); }
-        else if (arg == "-ng" || arg == "--no-gpu")  { params.use_gpu   = false; }
+        else if (arg == "-t"  || arg == "--threads")  { params.threads     = parse_int_list(argv[++i]); params.n_threads = params.threads[0]; }
+        else if (arg == "-m"  || arg == "--model")    { params.model       = argv[++i]; }
+        else if (arg == "-w"  || arg == "--what")     { params.what        = atoi(argv[++i]); }
+        else if (arg == "-ng" || arg == "--no-gpu")   { params.use_gpu     = false; }
+        else if (arg == "-f"  || arg == "--file")     { params.fname_inp   = argv[++i]; }
+        else if (arg == "-ns" || arg == "--states")   { params.n_states    = parse_int_list(argv[++i]); }
+        else if (arg == "-nr" || arg == "--requests") { params.n_requests  = std::stoi(argv[++i]); }
+        else if (arg == "-d"  || arg == "--duration") { params.duration_ms = std::stoi(argv[++i]); }
+        else if (arg == "-ms" || arg == "--model-size") { params.model_size = argv[++i]; }
+        else if (arg == "-ty" || arg == "--types")    { params.types       = argv[++i]; }
         else {
             fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
             whisper_print_usage(argc, argv, params);
@@ -36,6 +69,11 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
         }
     }
 
+    if (params.n_requests < 1) {
+        fprintf(stderr, "error: the number of requests must be at least 1\n");
+        return false;
+    }
+
     return true;
 }
 
@@ -45,13 +83,25 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "\n");
     fprintf(stderr, "options:\n");
     fprintf(stderr, "  -h,       --help        [default] show this help message and exit\n");
-    fprintf(stderr, "  -t N,     --threads N   [%-7d] number of threads to use during computation\n", params.n_threads);
+    fprintf(stderr, "  -t N,     --threads N   [%-7s] number of threads to use during computation (per state for -w 3, can be a list)\n", list_to_str(params.threads).c_str());
     fprintf(stderr, "  -m FNAME, --model FNAME [%-7s] model path\n",                                  params.model.c_str());
     fprintf(stderr, "  -w N,     --what N      [%-7d] what to benchmark:\n",                          params.what);
     fprintf(stderr, "  -ng,      --no-gpu      [%-7s] disable GPU\n",                                 params.use_gpu ? "false" : "true");
     fprintf(stderr, "                           %-7s  0 - whisper\n",                                 "");
     fprintf(stderr, "                           %-7s  1 - memcpy\n",                                  "");
     fprintf(stderr, "                           %-7s  2 - ggml_mul_mat\n",                            "");
+    fprintf(stderr, "                           %-7s  3 - concurrent whisper_full on multiple states\n", "");
+    fprintf(stderr, "                           %-7s  4 - ggml ops at the shapes of a whisper model\n", "");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options for -w 3:\n");
+    fprintf(stderr, "  -f FNAME, --file FNAME  [%-7s] input WAV file path\n",                         params.fname_inp.c_str());
+    fprintf(stderr, "  -ns N,    --states N    [%-7s] numbers of concurrent states (can be a list)\n", list_to_str(params.n_states).c_str());
+    fprintf(stderr, "  -nr N,    --requests N  [%-7d] number of requests processed by each state\n",  params.n_requests);
+    fprintf(stderr, "  -d N,     --duration N  [%-7d] duration of the audio of a request in ms (0 - whole file)\n", params.duration_ms);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options for -w 4:\n");
+    fprintf(stderr, "  -ms SIZE, --model-size  [%-7s] model size: tiny, base, small, medium or large\n", params.model_size.c_str());
+    fprintf(stderr, "  -ty T,..  --types T,... [%-7s] weight types to benchmark, e.g. f16,q5_0 (default - all)\n", params.types.c_str());
     fprintf(stderr, "\n");
 }
 
@@ -150,6 +200,538 @@ int whisper_bench_full(const whisper_params & params) {
     return 0;
 }
 
+// user + system CPU time of the process
+static double cpu_time_s() {
+#if defined(__linux__) || defined(__APPLE__)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + 1e-6*(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+    }
+#endif
+    return 0.0;
+}
+
+static double percentile(std::vector<double> v, double p) {
+    if (v.empty()) {
+        return 0.0;
+    }
+
+    std::sort(v.begin(), v.end());
+    const size_t i = std::min(v.size() - 1, (size_t) (p*v.size()));
+    return v[i];
+}
+
+// runs n_requests whisper_full calls on each of n_states states of one context concurrently
+// reports the throughput in seconds of audio per second, the latency percentiles of the requests and the CPU time
+// per second of audio - a CPU time that grows with the number of states points to spinning or oversubscription
+int whisper_bench_states(const whisper_params & params) {
+    std::vector<float> pcmf32;
+    std::vector<std::vector<float>> pcmf32s;
+
+    if (!::read_wav(params.fname_inp, pcmf32, pcmf32s, false)) {
+        fprintf(stderr, "error: failed to read WAV file '%s'\n", params.fname_inp.c_str());
+        return 2;
+    }
+
+    // the first duration_ms of the audio, repeated if it is shorter
+    if (params.duration_ms > 0) {
+        std::vector<float> pcm(params.duration_ms*(WHISPER_SAMPLE_RATE/1000));
+        for (size_t i = 0; i < pcm.size(); ++i) {
+            pcm[i] = pcmf32[i % pcmf32.size()];
+        }
+        pcmf32 = std::move(pcm);
+    }
+
+    const double audio_s = double(pcmf32.size())/WHISPER_SAMPLE_RATE;
+
+    struct whisper_context_params cparams = whisper_context_default_params();
+    cparams.use_gpu = params.use_gpu;
+
+    struct whisper_context * ctx = whisper_init_from_file_with_params_no_state(params.model.c_str(), cparams);
+    if (ctx == nullptr) {
+        fprintf(stderr, "error: failed to initialize whisper context\n");
+        return 2;
+    }
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "system_info: n_threads = %s / %d | %s\n", list_to_str(params.threads).c_str(), std::thread::hardware_concurrency(), whisper_print_system_info());
+    fprintf(stderr, "\n");
+
+    // state creation - the first state measures the compute graphs, the next ones reuse the measured buffer sizes
+    {
+        std::vector<double> init_ms;
+        for (int i = 0; i < 5; ++i) {
+            const int64_t t_start_us = ggml_time_us();
+
+            whisper_state * state = whisper_init_state(ctx);
+            if (state == nullptr) {
+                fprintf(stderr, "error: failed to initialize whisper state\n");
+                whisper_free(ctx);
+                return 3;
+            }
+
+            init_ms.push_back(1e-3*(ggml_time_us() - t_start_us));
+
+            whisper_free_state(state);
+        }
+
+        fprintf(stderr, "\n");
+        fprintf(stderr, "whisper_init_state: first %.2f ms, next %.2f ms\n", init_ms[0], *std::min_element(init_ms.begin() + 1, init_ms.end()));
+        fprintf(stderr, "\n");
+    }
+
+    printf("| %6s | %7s | %8s | %13s | %10s | %10s | %10s | %11s |\n", "states", "threads", "requests", "audio s / s", "p50 ms", "p95 ms", "p99 ms", "cpu s / s");
+    printf("| %6s | %7s | %8s | %13s | %10s | %10s | %10s | %11s |\n", "---", "---", "---", "---", "---", "---", "---", "---");
+
+    for (const int n_states : params.n_states) {
+        for (const int n_threads : params.threads) {
+            std::vector<whisper_state *> states;
+            for (int i = 0; i < n_states; ++i) {
+                whisper_state * state = whisper_init_state(ctx);
+                if (state == nullptr) {
+                    fprintf(stderr, "error: failed to initialize whisper state\n");
+                    for (auto * state : states) {
+                        whisper_free_state(state);
+                    }
+                    whisper_free(ctx);
+                    return 3;
+                }
+                states.push_back(state);
+            }
+
+            whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+            wparams.print_realtime   = false;
+            wparams.print_progress   = false;
+            wparams.print_timestamps = false;
+            wparams.print_special    = false;
+            wparams.n_threads        = n_threads;
+
+            std::vector<std::vector<double>> latency_ms(n_states);
+
+            std::atomic<bool> ok(true);
+
+            auto worker = [&](int i, int n_requests) {
+                for (int j = 0; j < n_requests; ++j) {
+                    const int64_t t_start_us = ggml_time_us();
+
+                    if (whisper_full_with_state(ctx, states[i], wparams, pcmf32.data(), pcmf32.size()) != 0) {
+                        ok = false;
+                        return;
+                    }
+
+                    latency_ms[i].push_back(1e-3*(ggml_time_us() - t_start_us));
+                }
+            };
+
+            auto run = [&](int n_requests) {
+                std::vector<std::thread> workers;
+                for (int i = 0; i < n_states; ++i) {
+                    workers.emplace_back(worker, i, n_requests);
+                }
+                for (auto & w : workers) {
+                    w.join();
+                }
+            };
+
+            // heat up - the first request of each state pays for the page faults of its compute buffers
+            run(1);
+
+            for (auto & l : latency_ms) {
+                l.clear();
+            }
+
+            const double  cpu_start_s = cpu_time_s();
+            const int64_t t_start_us  = ggml_time_us();
+
+            run(params.n_requests);
+
+            const double wall_s = 1e-6*(ggml_time_us() - t_start_us);
+            const double cpu_s  = cpu_time_s() - cpu_start_s;
+
+            for (auto * state : states) {
+                whisper_free_state(state);
+            }
+
+            if (!ok) {
+                fprintf(stderr, "error: failed to process audio\n");
+                whisper_free(ctx);
+                return 4;
+            }
+
+            std::vector<double> latency_all;
+            for (const auto & l : latency_ms) {
+                latency_all.insert(latency_all.end(), l.begin(), l.end());
+            }
+
+            const double audio_total_s = audio_s*n_states*params.n_requests;
+
+            printf("| %6d | %7d | %8d | %13.2f | %10.1f | %10.1f | %10.1f | %11.3f |\n",
+                    n_states, n_threads, n_states*params.n_requests,
+                    audio_total_s/wall_s,
+                    percentile(latency_all, 0.50), percentile(latency_all, 0.95), percentile(latency_all, 0.99),
+                    cpu_s/audio_total_s);
+            fflush(stdout);
+        }
+    }
+
+    whisper_free(ctx);
+
+    return 0;
+}
+
+// the dimensions of a model that determine the shapes of the ops
+struct bench_hparams {
+    const char * name;
+
+    int n_state;
+    int n_head;
+};
+
+static const bench_hparams k_bench_hparams[] = {
+    { "tiny",   384,  6 },
+    { "base",   512,  8 },
+    { "small",  768, 12 },
+    { "medium", 1024, 16 },
+    { "large",  1280, 20 },
+};
+
+struct bench_op {
+    std::string name;
+    bool typed; // the first input is a weight of the benchmarked type
+
+    // builds the op in ctx with weights of type wtype, returns the output
+    std::function<ggml_tensor * (ggml_context * ctx, ggml_type wtype)> build;
+
+    // number of floating point operations, 0 - not meaningful (memory-bound ops)
+    std::function<double (const ggml_tensor * out)> flops;
+
+    // bytes moved, if not all of the inputs are read - by default the inputs plus the output
+    std::function<double (const ggml_tensor * out)> bytes;
+};
+
+struct bench_op_result {
+    std::string name;
+    std::string type;
+    std::string shape;
+
+    double t_us;
+    double flops;
+    double bytes;
+};
+
+// fills a tensor with random data of the right format - quantized types are quantized from a few random rows that
+// are repeated, because quantizing large tensors to some of the types takes very long
+static void bench_fill(ggml_tensor * t, const ggml_cgraph * gf, std::mt19937 & rng) {
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    // the row ids of a get_rows - valid rows of the source it selects from
+    if (t->type == GGML_TYPE_I32) {
+        int64_t n_rows = 1;
+        for (int i = 0; i < gf->n_nodes; ++i) {
+            if (gf->nodes[i]->op == GGML_OP_GET_ROWS && gf->nodes[i]->src[1] == t) {
+                n_rows = gf->nodes[i]->src[0]->ne[1];
+            }
+        }
+
+        for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+            ((int32_t *) t->data)[i] = rng() % n_rows;
+        }
+        return;
+    }
+
+    const int64_t n_per_row = t->ne[0];
+    const int64_t nrows     = ggml_nrows(t);
+    const int64_t nrows_src = std::min<int64_t>(nrows, 64);
+
+    std::vector<float> src(n_per_row*nrows_src);
+    for (auto & v : src) {
+        v = dist(rng);
+    }
+
+    const size_t row_size = ggml_row_size(t->type, n_per_row);
+
+    if (t->type == GGML_TYPE_F32) {
+        memcpy(t->data, src.data(), row_size*nrows_src);
+    } else if (t->type == GGML_TYPE_F16) {
+        ggml_fp32_to_fp16_row(src.data(), (ggml_fp16_t *) t->data, src.size());
+    } else {
+        const std::vector<float> imatrix(n_per_row, 1.0f);
+        ggml_quantize_chunk(t->type, src.data(), t->data, 0, nrows_src, n_per_row,
+                ggml_quantize_requires_imatrix(t->type) ? imatrix.data() : nullptr);
+    }
+
+    for (int64_t i = nrows_src; i < nrows; ++i) {
+        memcpy((char *) t->data + i*row_size, (char *) t->data + (i % nrows_src)*row_size, row_size);
+    }
+}
+
+static std::string bench_shape(const ggml_tensor * t) {
+    std::string res = std::to_string(t->ne[0]);
+    for (int i = 1; i < GGML_MAX_DIMS && t->ne[i] > 1; ++i) {
+        res += "x" + std::to_string(t->ne[i]);
+    }
+    return res;
+}
+
+// memory bandwidth in GB/s, read + write, of a multi-threaded copy of a buffer larger than the caches
+static double bench_bandwidth(int n_threads) {
+    const size_t size = 256u*1024*1024;
+
+    std::vector<uint8_t> src(size, 1);
+    std::vector<uint8_t> dst(size, 2);
+
+    double t_best_us = -1.0;
+    for (int k = 0; k < 4; ++k) {
+        const int64_t t_start_us = ggml_time_us();
+
+        std::vector<std::thread> workers;
+        for (int i = 0; i < n_threads; ++i) {
+            workers.emplace_back([&, i]() {
+                const size_t chunk = size/n_threads;
+                memcpy(dst.data() + i*chunk, src.data() + i*chunk, chunk);
+            });
+        }
+        for (auto & w : workers) {
+            w.join();
+        }
+
+        const double t_us = ggml_time_us() - t_start_us;
+        if (k > 0 && (t_best_us < 0.0 || t_us < t_best_us)) {
+            t_best_us = t_us;
+        }
+    }
+
+    return 2.0*size/t_best_us*1e-3;
+}
+
+// benchmarks the individual ggml ops of the encoder and the decoder at the shapes of the given model size, for each
+// weight type, and compares them with a roofline estimate:
+//
+//   attainable GFLOPS = min(peak GFLOPS, arithmetic intensity x memory bandwidth)
+//
+// the bandwidth is measured with a multi-threaded memcpy and the peak is the best GFLOPS measured among the ops
+// note: the small decoder weights fit in the caches, so they can exceed the DRAM roofline
+int whisper_bench_ops(const whisper_params & params) {
+    const bench_hparams * hp = nullptr;
+    for (const auto & h : k_bench_hparams) {
+        if (params.model_size == h.name) {
+            hp = &h;
+        }
+    }
+    if (hp == nullptr) {
+        fprintf(stderr, "error: unknown model size '%s'\n", params.model_size.c_str());
+        return 2;
+    }
+
+    const int n_state   = hp->n_state;
+    const int n_head    = hp->n_head;
+    const int n_ctx     = 1500;  // encoder positions
+    const int n_mels    = 80;
+    const int n_vocab   = 51865;
+
+    ggml_time_init();
+
+    std::vector<ggml_type> types;
+    for (int t = 0; t < GGML_TYPE_COUNT; ++t) {
+        const ggml_type type = (ggml_type) t;
+        const auto traits = ggml_internal_get_type_traits(type);
+
+        // only the types of weights that can be multiplied - q8_1 and q8_K are used only for the activations
+        if (ggml_type_size(type) == 0 || traits.vec_dot == nullptr || type == GGML_TYPE_Q8_1 || type == GGML_TYPE_Q8_K) {
+            continue;
+        }
+        if (!params.types.empty() && ("," + params.types + ",").find("," + std::string(ggml_type_name(type)) + ",") == std::string::npos) {
+            continue;
+        }
+
+        types.push_back(type);
+    }
+
+    auto mul_mat = [](int k, int m, int n) {
+        return [k, m, n](ggml_context * ctx, ggml_type wtype) {
+            ggml_tensor * w = ggml_new_tensor_2d(ctx, wtype,         k, m);
+            ggml_tensor * x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, k, n);
+            return ggml_mul_mat(ctx, w, x);
+        };
+    };
+
+    auto flops_mul_mat = [](const ggml_tensor * out) {
+        return 2.0*out->src[0]->ne[0]*ggml_nelements(out);
+    };
+
+    // conv_1d_ph is an im2col followed by a mul_mat with K = kernel size x input channels, the output is a reshape of it
+    auto flops_conv = [](const ggml_tensor * out) {
+        return 2.0*out->src[0]->src[0]->ne[0]*ggml_nelements(out);
+    };
+
+    auto flops_none = [](const ggml_tensor * /*out*/) {
+        return 0.0;
+    };
+
+    const std::vector<bench_op> ops = {
+        // encoder
+        { "enc.conv1 (conv_1d_ph)", false, [&](ggml_context * ctx, ggml_type) {
+            ggml_tensor * w = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, 3, n_mels, n_state);
+            ggml_tensor * x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 2*n_ctx, n_mels);
+            return ggml_conv_1d_ph(ctx, w, x, 1, 1);
+        }, flops_conv, nullptr },
+        { "enc.conv2 (conv_1d_ph)", false, [&](ggml_context * ctx, ggml_type) {
+            ggml_tensor * w = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, 3, n_state, n_state);
+            ggml_tensor * x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 2*n_ctx, n_state);
+            return ggml_conv_1d_ph(ctx, w, x, 2, 1);
+        }, flops_conv, nullptr },
+        { "enc.attn.qkvo (mul_mat)", true, mul_mat(n_state,   n_state,   n_ctx), flops_mul_mat, nullptr },
+        { "enc.ffn.up (mul_mat)",    true, mul_mat(n_state,   4*n_state, n_ctx), flops_mul_mat, nullptr },
+        { "enc.ffn.down (mul_mat)",  true, mul_mat(4*n_state, n_state,   n_ctx), flops_mul_mat, nullptr },
+        { "enc.norm", false, [&](ggml_context * ctx, ggml_type) {
+            return ggml_norm(ctx, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_state, n_ctx), 1e-5f);
+        }, flops_none, nullptr },
+        { "enc.soft_max", false, [&](ggml_context * ctx, ggml_type) {
+            return ggml_soft_max(ctx, ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_ctx, n_ctx, n_head));
+        }, flops_none, nullptr },
+        { "enc.gelu", false, [&](ggml_context * ctx, ggml_type) {
+            return ggml_gelu(ctx, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 4*n_state, n_ctx));
+        }, flops_none, nullptr },
+
+        // decoder - a single token, so the mul_mats are matrix-vector products
+        { "dec.get_rows (embd)", true, [&](ggml_context * ctx, ggml_type wtype) {
+            ggml_tensor * w   = ggml_new_tensor_2d(ctx, wtype, n_state, n_vocab);
+            ggml_tensor * ids = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 1);
+            return ggml_get_rows(ctx, w, ids);
+        }, flops_none, [](const ggml_tensor * out) {
+            // only the selected rows are read
+            return (double) ggml_row_size(out->src[0]->type, out->ne[0]) + ggml_nbytes(out);
+        } },
+        { "dec.attn.qkvo (mul_mat)", true, mul_mat(n_state,   n_state,   1), flops_mul_mat, nullptr },
+        { "dec.ffn.up (mul_mat)",    true, mul_mat(n_state,   4*n_state, 1), flops_mul_mat, nullptr },
+        { "dec.ffn.down (mul_mat)",  true, mul_mat(4*n_state, n_state,   1), flops_mul_mat, nullptr },
+        { "dec.logits (mul_mat)",    true, mul_mat(n_state,   n_vocab,   1), flops_mul_mat, nullptr },
+    };
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "system_info: n_threads = %d / %d | %s\n", params.n_threads, std::thread::hardware_concurrency(), whisper_print_system_info());
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s: model size = %s, n_state = %d, n_head = %d\n", __func__, hp->name, n_state, n_head);
+
+    const double bandwidth = bench_bandwidth(params.n_threads);
+
+    fprintf(stderr, "%s: memory bandwidth = %.1f GB/s\n", __func__, bandwidth);
+
+    std::mt19937 rng(42);
+    std::vector<uint8_t> work;
+    std::vector<bench_op_result> results;
+
+    for (const auto & op : ops) {
+        const std::vector<ggml_type> op_types = op.typed ? types : std::vector<ggml_type>{ GGML_TYPE_F32 };
+
+        for (const auto wtype : op_types) {
+            struct ggml_init_params gparams = {
+                /*.mem_size   =*/ 16*ggml_tensor_overhead() + ggml_graph_overhead(),
+                /*.mem_buffer =*/ nullptr,
+                /*.no_alloc   =*/ true,
+            };
+
+            ggml_context * ctx = ggml_init(gparams);
+
+            ggml_tensor * out = op.build(ctx, wtype);
+
+            ggml_cgraph * gf = ggml_new_graph(ctx);
+            ggml_build_forward_expand(gf, out);
+
+            // e.g. the k-quants need rows that are a multiple of 256
+            if (gf->leafs[0]->ne[0] % ggml_blck_size(gf->leafs[0]->type) != 0) {
+                fprintf(stderr, "%s: %-24s %-8s skipped, the rows are not a multiple of the block size\n", __func__, op.name.c_str(), ggml_type_name(wtype));
+                ggml_free(ctx);
+                continue;
+            }
+
+            ggml_backend_buffer_t buffer = ggml_backend_alloc_ctx_tensors_from_buft(ctx, ggml_backend_cpu_buffer_type());
+            if (buffer == nullptr) {
+                fprintf(stderr, "error: failed to allocate the tensors of '%s'\n", op.name.c_str());
+                ggml_free(ctx);
+                return 3;
+            }
+
+            // the inputs are the leafs
+            double bytes = ggml_nbytes(out);
+            std::string shape;
+            for (int i = 0; i < gf->n_leafs; ++i) {
+                bench_fill(gf->leafs[i], gf, rng);
+                bytes += ggml_nbytes(gf->leafs[i]);
+                shape += (i > 0 ? " * " : "") + bench_shape(gf->leafs[i]);
+            }
+            if (op.bytes) {
+                bytes = op.bytes(out);
+            }
+
+            struct ggml_cplan plan = ggml_graph_plan(gf, params.n_threads);
+            if (plan.work_size > 0) {
+                work.resize(plan.work_size);
+                plan.work_data = work.data();
+            }
+
+            // heat up, then run for at least 0.5 s or 64 times
+            ggml_graph_compute(gf, &plan);
+
+            int n_runs = 0;
+            const int64_t t_start_us = ggml_time_us();
+            while (n_runs < 64 && ggml_time_us() - t_start_us < 500000) {
+                ggml_graph_compute(gf, &plan);
+                n_runs++;
+            }
+            const double t_us = double(ggml_time_us() - t_start_us)/n_runs;
+
+            bench_op_result res;
+            res.name  = op.name;
+            res.type  = ggml_type_name(gf->leafs[0]->type);
+            res.shape = shape;
+            res.t_us  = t_us;
+            res.flops = op.flops(out);
+            res.bytes = bytes;
+
+            results.push_back(res);
+
+            fprintf(stderr, "%s: %-24s %-8s %10.1f us\n", __func__, res.name.c_str(), res.type.c_str(), res.t_us);
+
+            ggml_backend_buffer_free(buffer);
+            ggml_free(ctx);
+        }
+    }
+
+    double peak_gflops = 0.0;
+    for (const auto & r : results) {
+        peak_gflops = std::max(peak_gflops, r.flops/r.t_us*1e-3);
+    }
+
+    fprintf(stderr, "%s: peak = %.1f GFLOPS (best measured)\n", __func__, peak_gflops);
+    fprintf(stderr, "\n");
+
+    printf("| %-24s | %-8s | %-28s | %10s | %8s | %8s | %8s | %10s |\n", "op", "type", "shape", "time us", "GFLOPS", "GB/s", "FLOP/B", "% roofline");
+    printf("| %-24s | %-8s | %-28s | %10s | %8s | %8s | %8s | %10s |\n", "---", "---", "---", "---", "---", "---", "---", "---");
+
+    for (const auto & r : results) {
+        const double gflops = r.flops/r.t_us*1e-3;
+        const double gbs    = r.bytes/r.t_us*1e-3;
+        const double ai     = r.flops/r.bytes;
+
+        // the memory-bound ops are compared with the bandwidth alone
+        const double roofline = r.flops > 0.0 ? 100.0*gflops/std::min(peak_gflops, ai*bandwidth) : 100.0*gbs/bandwidth;
+
+        if (r.flops > 0.0) {
+            printf("| %-24s | %-8s | %-28s | %10.1f | %8.1f | %8.1f | %8.2f | %9.1f%% |\n",
+                    r.name.c_str(), r.type.c_str(), r.shape.c_str(), r.t_us, gflops, gbs, ai, roofline);
+        } else {
+            printf("| %-24s | %-8s | %-28s | %10.1f | %8s | %8.1f | %8s | %9.1f%% |\n",
+                    r.name.c_str(), r.type.c_str(), r.shape.c_str(), r.t_us, "-", gbs, "-", roofline);
+        }
+    }
+
+    ggml_quantize_free();
+
+    return 0;
+}
+
 int main(int argc, char ** argv) {
     whisper_params params;
 
@@ -163,6 +745,8 @@ int main(int argc, char ** argv) {
         case 0: ret = whisper_bench_full(params);                break;
         case 1: ret = whisper_bench_memcpy(params.n_threads);       break;
         case 2: ret = whisper_bench_ggml_mul_mat(params.n_threads); break;
+        case 3: ret = whisper_bench_states(params);                break;
+        case 4: ret = whisper_bench_ops(params);                   break;
         default: fprintf(stderr, "error: unknown benchmark: %d\n", params.what); break;
     }
 
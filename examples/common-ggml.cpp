@@ -1,5 +1,6 @@
 #include "common-ggml.h"
 
+#include <cstring>
 #include <regex>
 #include <map>
 
@@ -14,6 +15,15 @@ static const std::map<std::string, enum ggml_ftype> GGML_FTYPE_MAP = {
     {"q4_k", GGML_FTYPE_MOSTLY_Q4_K},
     {"q5_k", GGML_FTYPE_MOSTLY_Q5_K},
     {"q6_k", GGML_FTYPE_MOSTLY_Q6_K},
+    {"iq2_xxs", GGML_FTYPE_MOSTLY_IQ2_XXS},
+    {"iq2_xs",  GGML_FTYPE_MOSTLY_IQ2_XS},
+    {"iq2_s",   GGML_FTYPE_MOSTLY_IQ2_S},
+    {"iq3_xxs", GGML_FTYPE_MOSTLY_IQ3_XXS},
+    {"iq3_s",   GGML_FTYPE_MOSTLY_IQ3_S},
+    {"iq1_s",   GGML_FTYPE_MOSTLY_IQ1_S},
+    {"iq1_m",   GGML_FTYPE_MOSTLY_IQ1_M},
+    {"iq4_nl",  GGML_FTYPE_MOSTLY_IQ4_NL},
+    {"iq4_xs",  GGML_FTYPE_MOSTLY_IQ4_XS},
 };
 
 void ggml_print_ftypes(FILE * fp) {
@@ -24,7 +34,7 @@ void ggml_print_ftypes(FILE * fp) {
 
 enum ggml_ftype ggml_parse_ftype(const char * str) {
     enum ggml_ftype ftype;
-    if (str[0] == 'q') {
+    if (str[0] == 'q' || str[0] == 'i') {
         const auto it = GGML_FTYPE_MAP.find(str);
         if (it == GGML_FTYPE_MAP.end()) {
             fprintf(stderr, "%s: unknown ftype '%s'\n", __func__, str);
@@ -38,12 +48,50 @@ enum ggml_ftype ggml_parse_ftype(const char * str) {
     return ftype;
 }
 
+enum ggml_type ggml_parse_qtype(const char * str) {
+    if (strcmp(str, "f32") == 0) {
+        return GGML_TYPE_F32;
+    }
+    if (strcmp(str, "f16") == 0) {
+        return GGML_TYPE_F16;
+    }
+
+    const auto it = GGML_FTYPE_MAP.find(str);
+    if (it == GGML_FTYPE_MAP.end()) {
+        fprintf(stderr, "%s: unknown type '%s'\n", __func__, str);
+        return GGML_TYPE_COUNT;
+    }
+
+    return ggml_ftype_to_ggml_type(it->second);
+}
+
+ggml_type ggml_quantize_fallback_type(ggml_type type) {
+    switch (type) {
+        case GGML_TYPE_Q2_K:
+        case GGML_TYPE_Q3_K:
+        case GGML_TYPE_IQ1_S:
+        case GGML_TYPE_IQ1_M:
+        case GGML_TYPE_IQ2_XXS:
+        case GGML_TYPE_IQ2_XS:
+        case GGML_TYPE_IQ2_S:
+        case GGML_TYPE_IQ3_XXS:
+        case GGML_TYPE_IQ3_S:  return GGML_TYPE_Q4_0;
+        case GGML_TYPE_IQ4_XS:
+        case GGML_TYPE_Q4_K:   return GGML_TYPE_IQ4_NL;
+        case GGML_TYPE_Q5_K:   return GGML_TYPE_Q5_0;
+        case GGML_TYPE_Q6_K:   return GGML_TYPE_Q8_0;
+        default:               return GGML_TYPE_F16;
+    }
+}
+
 bool ggml_common_quantize_0(
         std::ifstream & finp,
         std::ofstream & fout,
         const ggml_ftype ftype,
         const std::vector<std::string> & to_quant,
-        const std::vector<std::string> & to_skip) {
+        const std::vector<std::string> & to_skip,
+        const ggml_imatrix & imatrix,
+        const ggml_quantize_policy & policy) {
 
     ggml_type qtype = GGML_TYPE_F32;
 
@@ -58,19 +106,19 @@ bool ggml_common_quantize_0(
         case GGML_FTYPE_MOSTLY_Q4_K: qtype = GGML_TYPE_Q4_K; break;
         case GGML_FTYPE_MOSTLY_Q5_K: qtype = GGML_TYPE_Q5_K; break;
         case GGML_FTYPE_MOSTLY_Q6_K: qtype = GGML_TYPE_Q6_K; break;
+        case GGML_FTYPE_MOSTLY_IQ2_XXS: qtype = GGML_TYPE_IQ2_XXS; break;
+        case GGML_FTYPE_MOSTLY_IQ2_XS:  qtype = GGML_TYPE_IQ2_XS;  break;
+        case GGML_FTYPE_MOSTLY_IQ2_S:   qtype = GGML_TYPE_IQ2_S;   break;
+        case GGML_FTYPE_MOSTLY_IQ3_XXS: qtype = GGML_TYPE_IQ3_XXS; break;
+        case GGML_FTYPE_MOSTLY_IQ3_S:   qtype = GGML_TYPE_IQ3_S;   break;
+        case GGML_FTYPE_MOSTLY_IQ1_S:   qtype = GGML_TYPE_IQ1_S;   break;
+        case GGML_FTYPE_MOSTLY_IQ1_M:   qtype = GGML_TYPE_IQ1_M;   break;
+        case GGML_FTYPE_MOSTLY_IQ4_NL:  qtype = GGML_TYPE_IQ4_NL;  break;
+        case GGML_FTYPE_MOSTLY_IQ4_XS:  qtype = GGML_TYPE_IQ4_XS;  break;
         case GGML_FTYPE_UNKNOWN:
         case GGML_FTYPE_ALL_F32:
         case GGML_FTYPE_MOSTLY_F16:
         case GGML_FTYPE_MOSTLY_Q4_1_SOME_F16:
-        case GGML_FTYPE_MOSTLY_IQ2_XXS:
-        case GGML_FTYPE_MOSTLY_IQ2_XS:
-        case GGML_FTYPE_MOSTLY_IQ2_S:
-        case GGML_FTYPE_MOSTLY_IQ3_XXS:
-        case GGML_FTYPE_MOSTLY_IQ3_S:
-        case GGML_FTYPE_MOSTLY_IQ1_S:
-        case GGML_FTYPE_MOSTLY_IQ4_NL:
-        case GGML_FTYPE_MOSTLY_IQ4_XS:
-        case GGML_FTYPE_MOSTLY_IQ1_M:
                 {
                     fprintf(stderr, "%s: invalid model type %d\n", __func__, ftype);
                     return false;
@@ -85,6 +133,9 @@ bool ggml_common_quantize_0(
     size_t total_size_org = 0;
     size_t total_size_new = 0;
 
+    // number of tensors and size of each output type
+    std::map<ggml_type, std::pair<int, size_t>> type_stats;
+
     std::vector<float> work;
 
     std::vector<uint8_t>     data_u8;
@@ -137,6 +188,29 @@ bool ggml_common_quantize_0(
         // quantize only 2D tensors
         quantize &= (n_dims == 2);
 
+        ggml_type ttype_new = qtype;
+
+        if (quantize && policy) {
+            ttype_new = policy(name, qtype);
+            quantize = ttype_new != GGML_TYPE_COUNT && ttype_new != (ggml_type) ttype;
+        }
+
+        // the fallback can be larger than the requested type, the log shows the bits per weight of both
+        std::string fallback;
+
+        if (quantize && ne[0] % ggml_blck_size(ttype_new) != 0) {
+            const ggml_type ttype_req = ttype_new;
+
+            while (ne[0] % ggml_blck_size(ttype_new) != 0) {
+                ttype_new = ggml_quantize_fallback_type(ttype_new);
+            }
+
+            char buf[128];
+            snprintf(buf, sizeof(buf), " (fallback from %s, %.2f -> %.2f bpw)", ggml_type_name(ttype_req),
+                    8.0*ggml_type_size(ttype_req)/ggml_blck_size(ttype_req), 8.0*ggml_type_size(ttype_new)/ggml_blck_size(ttype_new));
+            fallback = buf;
+        }
+
         if (quantize) {
             if (ttype != GGML_TYPE_F32 && ttype != GGML_TYPE_F16) {
                 fprintf(stderr, "%s: unsupported ttype %d (%s) for integer quantization\n", __func__, ttype, ggml_type_name((ggml_type) ttype));
@@ -155,7 +229,7 @@ bool ggml_common_quantize_0(
                 finp.read(reinterpret_cast<char *>(data_f32.data()), nelements * sizeof(float));
             }
 
-            ttype = qtype;
+            ttype = ttype_new;
         } else {
             const int bpe = (ttype == 0) ? sizeof(float) : sizeof(uint16_t);
 
@@ -174,6 +248,24 @@ bool ggml_common_quantize_0(
         if (quantize) {
             work.resize(nelements); // for quantization
 
+            // the importance of the columns, if the weight was seen by the calibration
+            const float * imatrix_data = nullptr;
+            {
+                const auto it = imatrix.find(name);
+                if (it != imatrix.end()) {
+                    if ((int) it->second.size() != ne[0]) {
+                        fprintf(stderr, "%s: imatrix of '%s' has %d values, expected %d\n", __func__, name.c_str(), (int) it->second.size(), ne[0]);
+                        return false;
+                    }
+                    imatrix_data = it->second.data();
+                }
+            }
+
+            if (imatrix_data == nullptr && ggml_quantize_requires_imatrix((ggml_type) ttype)) {
+                fprintf(stderr, "%s: type %s requires an imatrix, and there is none for '%s'\n", __func__, ggml_type_name((ggml_type) ttype), name.c_str());
+                return false;
+            }
+
             size_t cur_size = 0;
             switch ((ggml_type) ttype) {
                 case GGML_TYPE_Q4_0:
@@ -186,11 +278,28 @@ bool ggml_common_quantize_0(
                 case GGML_TYPE_Q4_K:
                 case GGML_TYPE_Q5_K:
                 case GGML_TYPE_Q6_K:
+                case GGML_TYPE_IQ2_XXS:
+                case GGML_TYPE_IQ2_XS:
+                case GGML_TYPE_IQ2_S:
+                case GGML_TYPE_IQ3_XXS:
+                case GGML_TYPE_IQ3_S:
+                case GGML_TYPE_IQ1_S:
+                case GGML_TYPE_IQ4_NL:
+                case GGML_TYPE_IQ4_XS:
+                case GGML_TYPE_IQ1_M:
                     {
-                        cur_size = ggml_quantize_chunk((ggml_type) ttype, data_f32.data(), work.data(), 0, nelements/ne[0], ne[0], nullptr);
+                        cur_size = ggml_quantize_chunk((ggml_type) ttype, data_f32.data(), work.data(), 0, nelements/ne[0], ne[0], imatrix_data);
                     } break;
                 case GGML_TYPE_F32:
+                    {
+                        memcpy(work.data(), data_f32.data(), nelements*sizeof(float));
+                        cur_size = nelements*sizeof(float);
+                    } break;
                 case GGML_TYPE_F16:
+                    {
+                        ggml_fp32_to_fp16_row(data_f32.data(), (ggml_fp16_t *) work.data(), nelements);
+                        cur_size = nelements*sizeof(ggml_fp16_t);
+                    } break;
                 case GGML_TYPE_I8:
                 case GGML_TYPE_I16:
                 case GGML_TYPE_I32:
@@ -198,15 +307,6 @@ bool ggml_common_quantize_0(
                 case GGML_TYPE_F64:
                 case GGML_TYPE_Q8_1:
                 case GGML_TYPE_Q8_K:
-                case GGML_TYPE_IQ2_XXS:
-                case GGML_TYPE_IQ2_XS:
-                case GGML_TYPE_IQ2_S:
-                case GGML_TYPE_IQ3_XXS:
-                case GGML_TYPE_IQ3_S:
-                case GGML_TYPE_IQ1_S:
-                case GGML_TYPE_IQ4_NL:
-                case GGML_TYPE_IQ4_XS:
-                case GGML_TYPE_IQ1_M:
                 case GGML_TYPE_COUNT:
                     {
                         fprintf(stderr, "%s: unsupported quantization type %d (%s)\n", __func__, ttype, ggml_type_name((ggml_type) ttype));
@@ -217,11 +317,18 @@ bool ggml_common_quantize_0(
             fout.write(reinterpret_cast<char *>(work.data()), cur_size);
             total_size_new += cur_size;
 
-            printf("size = %8.2f MB -> %8.2f MB\n", nelements * sizeof(float)/1024.0/1024.0, cur_size/1024.0/1024.0);
+            printf("size = %8.2f MB -> %8.2f MB, %s%s%s\n", nelements * sizeof(float)/1024.0/1024.0, cur_size/1024.0/1024.0, ggml_type_name((ggml_type) ttype),
+                    imatrix_data ? " (imatrix)" : "", fallback.c_str());
+
+            type_stats[(ggml_type) ttype].first  += 1;
+            type_stats[(ggml_type) ttype].second += cur_size;
         } else {
             printf("size = %8.3f MB\n", data_u8.size()/1024.0/1024.0);
             fout.write(reinterpret_cast<char *>(data_u8.data()), data_u8.size());
             total_size_new += data_u8.size();
+
+            type_stats[(ggml_type) ttype].first  += 1;
+            type_stats[(ggml_type) ttype].second += data_u8.size();
         }
 
         total_size_org += nelements * sizeof(float);
@@ -230,5 +337,77 @@ bool ggml_common_quantize_0(
     printf("%s: model size  = %8.2f MB\n", __func__, total_size_org/1024.0/1024.0);
     printf("%s: quant size  = %8.2f MB | ftype = %d (%s)\n", __func__, total_size_new/1024.0/1024.0, ftype, ggml_type_name(qtype));
 
+    for (const auto & it : type_stats) {
+        printf("%s: %8s - %4d tensors, %8.2f MB\n", __func__, ggml_type_name(it.first), it.second.first, it.second.second/1024.0/1024.0);
+    }
+
+    return true;
+}
+
+// file format, little-endian:
+//   int32 n_entries
+//   for each entry: int32 name length, name, int32 number of calibration inputs, int32 n_values, float values[n_values]
+bool ggml_imatrix_save(const std::string & fname, const ggml_imatrix & imatrix, int n_inputs) {
+    std::ofstream fout(fname, std::ios::binary);
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname.c_str());
+        return false;
+    }
+
+    const int32_t n_entries = imatrix.size();
+    fout.write((const char *) &n_entries, sizeof(n_entries));
+
+    for (const auto & e : imatrix) {
+        const int32_t len      = e.first.size();
+        const int32_t n_values = e.second.size();
+
+        fout.write((const char *) &len,      sizeof(len));
+        fout.write(e.first.data(), len);
+        fout.write((const char *) &n_inputs, sizeof(n_inputs));
+        fout.write((const char *) &n_values, sizeof(n_values));
+        fout.write((const char *) e.second.data(), n_values*sizeof(float));
+    }
+
+    return fout.good();
+}
+
+bool ggml_imatrix_load(const std::string & fname, ggml_imatrix & imatrix) {
+    std::ifstream finp(fname, std::ios::binary);
+    if (!finp) {
+        fprintf(stderr, "%s: failed to open '%s' for reading\n", __func__, fname.c_str());
+        return false;
+    }
+
+    int32_t n_entries = 0;
+    finp.read((char *) &n_entries, sizeof(n_entries));
+
+    for (int i = 0; i < n_entries && finp; ++i) {
+        int32_t len = 0;
+        finp.read((char *) &len, sizeof(len));
+        if (len <= 0 || len > 1024) {
+            break;
+        }
+
+        std::string name(len, 0);
+        finp.read(&name[0], len);
+
+        int32_t n_inputs = 0;
+        int32_t n_values = 0;
+        finp.read((char *) &n_inputs, sizeof(n_inputs));
+        finp.read((char *) &n_values, sizeof(n_values));
+        if (n_values <= 0 || n_values > (1 << 20)) {
+            break;
+        }
+
+        auto & values = imatrix[name];
+        values.resize(n_values);
+        finp.read((char *) values.data(), n_values*sizeof(float));
+    }
+
+    if (!finp || (int) imatrix.size() != n_entries) {
+        fprintf(stderr, "%s: invalid imatrix file '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
     return true;
 }
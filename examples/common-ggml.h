@@ -3,16 +3,39 @@
 #include "ggml.h"
 
 #include <fstream>
+#include <functional>
+#include <map>
 #include <vector>
 #include <string>
 
 enum ggml_ftype ggml_parse_ftype(const char * str);
 
+// the tensor type of a name of ggml_print_ftypes, "f16" or "f32" - GGML_TYPE_COUNT if unknown
+enum ggml_type ggml_parse_qtype(const char * str);
+
 void ggml_print_ftypes(FILE * fp = stderr);
 
+// importance matrix - for each weight, the mean of the squared activations that multiply each of its columns
+// the low-bit types weigh the quantization error of each column with it
+typedef std::map<std::string, std::vector<float>> ggml_imatrix;
+
+bool ggml_imatrix_save(const std::string & fname, const ggml_imatrix & imatrix, int n_inputs);
+bool ggml_imatrix_load(const std::string & fname,       ggml_imatrix & imatrix);
+
+// the type of a tensor selected for quantization, e.g. more bits for the sensitive tensors of a model
+// qtype is the type of the ftype - return GGML_TYPE_COUNT to keep the tensor as it is in the input
+typedef std::function<ggml_type(const std::string & name, ggml_type qtype)> ggml_quantize_policy;
+
+// a type with a smaller block, for the tensors with rows that are not a multiple of the block size of type (e.g. the
+// 384 columns of Whisper tiny for the K-quants) - the closest in size, but the types under 4.5 bits per weight have no
+// such type and fall back to Q4_0, which is larger
+ggml_type ggml_quantize_fallback_type(ggml_type type);
+
 bool ggml_common_quantize_0(
         std::ifstream & finp,
         std::ofstream & fout,
         const ggml_ftype ftype,
         const std::vector<std::string> & to_quant,
-        const std::vector<std::string> & to_skip);
+        const std::vector<std::string> & to_skip,
+        const ggml_imatrix & imatrix = {},
+        const ggml_quantize_policy & policy = nullptr);
@@ -163,6 +163,26 @@ std::string replace(const std::string & s, const std::string & from, const std::
     return result;
 }
 
+std::vector<int> parse_int_list(const std::string & str) {
+    std::vector<int> res;
+
+    std::stringstream ss(str);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        res.push_back(std::stoi(item));
+    }
+
+    return res;
+}
+
+std::string list_to_str(const std::vector<int> & list) {
+    std::string res;
+    for (size_t i = 0; i < list.size(); ++i) {
+        res += (i > 0 ? "," : "") + std::to_string(list[i]);
+    }
+    return res;
+}
+
 void gpt_vocab::add_special_token(const std::string & token) {
     special_tokens.push_back(token);
 }
@@ -674,8 +694,8 @@ bool read_wav(const std::string & fname, std::vector<float>& pcmf32, std::vector
         return false;
     }
 
-    if (wav.channels != 1 && wav.channels != 2) {
-        fprintf(stderr, "%s: WAV file '%s' must be mono or stereo\n", __func__, fname.c_str());
+    if (wav.channels < 1) {
+        fprintf(stderr, "%s: WAV file '%s' has no audio channels\n", __func__, fname.c_str());
         drwav_uninit(&wav);
         return false;
     }
@@ -686,52 +706,190 @@ bool read_wav(const std::string & fname, std::vector<float>& pcmf32, std::vector
         return false;
     }
 
-    if (wav.sampleRate != COMMON_SAMPLE_RATE) {
-        fprintf(stderr, "%s: WAV file '%s' must be %i kHz\n", __func__, fname.c_str(), COMMON_SAMPLE_RATE/1000);
+    if (wav.sampleRate == 0) {
+        fprintf(stderr, "%s: WAV file '%s' has an invalid sample rate\n", __func__, fname.c_str());
         drwav_uninit(&wav);
         return false;
     }
 
-    if (wav.bitsPerSample != 16) {
-        fprintf(stderr, "%s: WAV file '%s' must be 16-bit\n", __func__, fname.c_str());
-        drwav_uninit(&wav);
-        return false;
+    const int n_channels  = wav.channels;
+    const int sample_rate = wav.sampleRate;
+
+    // the frame count in the header is not reliable when reading from a pipe
+    uint64_t n_max = wav.totalPCMFrameCount;
+    if (!wav_data.empty() && wav.bitsPerSample > 0) {
+        n_max = 8*wav_data.size()/(wav.channels*wav.bitsPerSample);
     }
 
-    const uint64_t n = wav_data.empty() ? wav.totalPCMFrameCount : wav_data.size()/(wav.channels*wav.bitsPerSample/8);
+    // dr_wav converts any sample format to float
 
-    std::vector<int16_t> pcm16;
-    pcm16.resize(n*wav.channels);
-    drwav_read_pcm_frames_s16(&wav, n, pcm16.data());
+    std::vector<float> pcm;
+    pcm.resize(n_max*n_channels);
+    const uint64_t n = drwav_read_pcm_frames_f32(&wav, n_max, pcm.data());
     drwav_uninit(&wav);
 
-    // convert to mono, float
+    // convert to mono
     pcmf32.resize(n);
-    if (wav.channels == 1) {
-        for (uint64_t i = 0; i < n; i++) {
-            pcmf32[i] = float(pcm16[i])/32768.0f;
-        }
-    } else {
-        for (uint64_t i = 0; i < n; i++) {
-            pcmf32[i] = float(pcm16[2*i] + pcm16[2*i + 1])/65536.0f;
+    for (uint64_t i = 0; i < n; i++) {
+        float sum = 0.0f;
+        for (int c = 0; c < n_channels; c++) {
+            sum += pcm[i*n_channels + c];
         }
+        pcmf32[i] = sum/n_channels;
     }
 
     if (stereo) {
-        // convert to stereo, float
+        // convert to stereo
         pcmf32s.resize(2);
 
         pcmf32s[0].resize(n);
         pcmf32s[1].resize(n);
         for (uint64_t i = 0; i < n; i++) {
-            pcmf32s[0][i] = float(pcm16[2*i])/32768.0f;
-            pcmf32s[1][i] = float(pcm16[2*i + 1])/32768.0f;
+            pcmf32s[0][i] = pcm[2*i];
+            pcmf32s[1][i] = pcm[2*i + 1];
+        }
+    }
+
+    if (sample_rate != COMMON_SAMPLE_RATE) {
+        fprintf(stderr, "%s: resampling from %d Hz to %d Hz\n", __func__, sample_rate, COMMON_SAMPLE_RATE);
+
+        pcmf32 = resample_pcm(pcmf32, sample_rate, COMMON_SAMPLE_RATE);
+        for (auto & pcm_channel : pcmf32s) {
+            pcm_channel = resample_pcm(pcm_channel, sample_rate, COMMON_SAMPLE_RATE);
         }
     }
 
     return true;
 }
 
+// zeroth order modified Bessel function of the first kind, used for the Kaiser window
+static double bessel_i0(double x) {
+    double sum  = 1.0;
+    double term = 1.0;
+
+    for (int k = 1; k < 64; k++) {
+        term *= (x/(2.0*k))*(x/(2.0*k));
+        sum  += term;
+        if (term < 1e-12*sum) {
+            break;
+        }
+    }
+
+    return sum;
+}
+
+static int gcd(int a, int b) {
+    while (b != 0) {
+        const int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+audio_resampler::audio_resampler(int rate_in, int rate_out, int n_taps_out) {
+    const int g = gcd(rate_in, rate_out);
+
+    up   = rate_out/g;
+    down = rate_in/g;
+
+    // when decimating, the pass band is down/up times narrower than the input band, so the filter needs down/up times
+    // more input samples for the same transition band
+    n_taps = (int) std::ceil(n_taps_out*std::max(1.0, (double) down/up));
+
+    // Kaiser-windowed sinc low-pass filter in the interpolated domain (rate_in*up), with the stop band starting at the
+    // lower of the two Nyquist frequencies. the filter is scaled by up to make up for the zero-stuffing of the
+    // interpolation. odd length so that the delay is a whole number of samples, the last tap of the last phase is zero
+    const int    n_filter = up*n_taps - 1;
+    const double beta     = 8.6;                                   // ~ 87 dB stop-band attenuation
+    const double atten    = beta/0.1102 + 8.7;                     // inverse of the Kaiser formula for beta
+    const double width    = (atten - 8.0)/(2.285*(n_filter - 1))/(2.0*M_PI); // transition band, relative to the interpolated rate
+    const double cutoff   = 0.5/std::max(up, down) - 0.5*width;    // relative to the interpolated rate
+    const double center   = 0.5*(n_filter - 1);
+
+    delay = (int64_t) center;
+
+    filter.assign(up*n_taps, 0.0f);
+    for (int i = 0; i < n_filter; i++) {
+        const double t = i - center;
+        const double x = 2.0*M_PI*cutoff*t;
+        const double r = t/(center + 1.0);
+
+        const double sinc   = t == 0.0 ? 1.0 : sin(x)/x;
+        const double window = bessel_i0(beta*sqrt(std::max(0.0, 1.0 - r*r)))/bessel_i0(beta);
+
+        // polyphase layout: the taps of phase p are h[p], h[p + up], h[p + 2*up], ...
+        filter[(i % up)*n_taps + i/up] = up*2.0*cutoff*sinc*window;
+    }
+
+    history.assign(n_taps - 1, 0.0f);
+}
+
+void audio_resampler::process(const float * samples, size_t n_samples, std::vector<float> & out) {
+    // the input extended with the history: x[i] is the input sample n_in - (n_taps - 1) + i
+    std::vector<float> x(history);
+    x.insert(x.end(), samples, samples + n_samples);
+
+    const int64_t n_in_end = n_in + n_samples;
+    const int64_t i0       = n_in - (n_taps - 1);
+
+    while (true) {
+        // position of the next output sample in the interpolated domain, shifted by the filter delay
+        const int64_t u = n_out*down + delay;
+        const int64_t n = u/up;
+        const int     p = u % up;
+
+        if (n >= n_in_end) {
+            break;
+        }
+
+        const float * h = filter.data() + p*n_taps;
+
+        float sum = 0.0f;
+        for (int j = 0; j < n_taps; j++) {
+            const int64_t k = n - j - i0;
+            if (k < 0) {
+                break;
+            }
+            sum += h[j]*x[k];
+        }
+
+        out.push_back(sum);
+        n_out++;
+    }
+
+    n_in = n_in_end;
+
+    history.assign(x.end() - (n_taps - 1), x.end());
+}
+
+void audio_resampler::flush(std::vector<float> & out) {
+    // the expected number of output samples for the input consumed so far
+    const int64_t n_out_end = (n_in*up + down - 1)/down;
+
+    const int64_t n_out_prev = n_out;
+
+    // push zeros through the filter to get the output that is delayed by it
+    const std::vector<float> zeros(delay/up + 1, 0.0f);
+
+    std::vector<float> tail;
+    process(zeros.data(), zeros.size(), tail);
+
+    const int64_t n_keep = std::max<int64_t>(0, std::min<int64_t>(tail.size(), n_out_end - n_out_prev));
+    out.insert(out.end(), tail.begin(), tail.begin() + n_keep);
+}
+
+std::vector<float> resample_pcm(const std::vector<float> & pcm, int rate_in, int rate_out) {
+    std::vector<float> out;
+    out.reserve((uint64_t) pcm.size()*rate_out/rate_in + 1);
+
+    audio_resampler resampler(rate_in, rate_out);
+    resampler.process(pcm.data(), pcm.size(), out);
+    resampler.flush(out);
+
+    return out;
+}
+
 void high_pass_filter(std::vector<float> & data, float cutoff, float sample_rate) {
     const float rc = 1.0f / (2.0f * M_PI * cutoff);
     const float dt = 1.0f / sample_rate;
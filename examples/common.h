@@ -59,6 +59,11 @@ std::string replace(
         const std::string & from,
         const std::string & to);
 
+// comma-separated list of integers, e.g. "1,2,4"
+std::vector<int> parse_int_list(const std::string & str);
+
+std::string list_to_str(const std::vector<int> & list);
+
 struct gpt_vocab {
     using id    = int32_t;
     using token = std::string;
@@ -140,7 +145,7 @@ bool is_wav_buffer(const std::string buf);
 
 // Read WAV audio file and store the PCM data into pcmf32
 // fname can be a buffer of WAV data instead of a filename
-// The sample rate of the audio must be equal to COMMON_SAMPLE_RATE
+// Any sample format supported by dr_wav is accepted and the audio is resampled to COMMON_SAMPLE_RATE if needed
 // If stereo flag is set and the audio has 2 channels, the pcmf32s will contain 2 channel PCM
 bool read_wav(
         const std::string & fname,
@@ -148,6 +153,37 @@ bool read_wav(
         std::vector<std::vector<float>> & pcmf32s,
         bool stereo);
 
+// Polyphase windowed-sinc resampler for the rational ratio rate_out/rate_in
+// The input can be processed in chunks - the filter state is kept between the calls
+// n_taps_out is the length of the filter in output samples (or input samples when upsampling), so the transition band
+// is the same fraction of the output rate for any decimation ratio
+class audio_resampler {
+public:
+    audio_resampler(int rate_in, int rate_out, int n_taps_out = 64);
+
+    // resample the next chunk of input and append the result to out
+    void process(const float * samples, size_t n_samples, std::vector<float> & out);
+
+    // append the remaining output at the end of the input - no more input can be processed after this
+    void flush(std::vector<float> & out);
+
+private:
+    int up;     // interpolation factor
+    int down;   // decimation factor
+    int n_taps; // taps per phase
+
+    int64_t delay; // group delay of the filter in the interpolated domain
+
+    std::vector<float> filter;  // [up][n_taps] - the polyphase decomposition of the low-pass filter
+    std::vector<float> history; // the last n_taps - 1 input samples
+
+    int64_t n_in  = 0; // input samples consumed so far
+    int64_t n_out = 0; // output samples produced so far
+};
+
+// Resample PCM data from rate_in to rate_out
+std::vector<float> resample_pcm(const std::vector<float> & pcm, int rate_in, int rate_out);
+
 // Write PCM data into WAV audio file
 class wav_writer {
 private:
@@ -0,0 +1,223 @@
+#include "ggml.h"
+#include "ggml-backend.h"
+#include "whisper.h"
+
+#include "common.h"
+#include "common-ggml.h"
+
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+// command-line parameters
+struct whisper_params {
+    std::vector<std::string> fname_inp;
+
+    int32_t n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
+
+    std::string model     = "models/ggml-base.en.bin";
+    std::string language  = "en";
+    std::string fname_out = "imatrix.dat";
+
+    bool use_gpu = true;
+};
+
+void whisper_print_usage(int argc, char ** argv, const whisper_params & params);
+
+bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            whisper_print_usage(argc, argv, params);
+            exit(0);
+        }
+        else if (arg == "-m"  || arg == "--model")    { params.model     = argv[++i]; }
+        else if (arg == "-f"  || arg == "--file")     { params.fname_inp.emplace_back(argv[++i]); }
+        else if (arg == "-t"  || arg == "--threads")  { params.n_threads = std::stoi(argv[++i]); }
+        else if (arg == "-l"  || arg == "--language") { params.language  = argv[++i]; }
+        else if (arg == "-o"  || arg == "--output")   { params.fname_out = argv[++i]; }
+        else if (arg == "-ng" || arg == "--no-gpu")   { params.use_gpu   = false; }
+        else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            whisper_print_usage(argc, argv, params);
+            exit(0);
+        }
+    }
+
+    if (params.fname_inp.empty()) {
+        params.fname_inp.emplace_back("samples/jfk.wav");
+    }
+
+    return true;
+}
+
+void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & params) {
+    fprintf(stderr, "\n");
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "transcribes calibration audio and saves the activation statistics of the weights for quantize --imatrix\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h,       --help           [default] show this help message and exit\n");
+    fprintf(stderr, "  -m FNAME, --model FNAME    [%-7s] F16 or F32 model path\n", params.model.c_str());
+    fprintf(stderr, "  -f FNAME, --file FNAME     [%-7s] calibration WAV file path, can be repeated\n", "jfk.wav");
+    fprintf(stderr, "  -t N,     --threads N      [%-7d] number of threads\n", params.n_threads);
+    fprintf(stderr, "  -l LANG,  --language LANG  [%-7s] spoken language\n", params.language.c_str());
+    fprintf(stderr, "  -o FNAME, --output FNAME   [%-7s] output imatrix file path\n", params.fname_out.c_str());
+    fprintf(stderr, "  -ng,      --no-gpu         [%-7s] disable GPU\n", params.use_gpu ? "false" : "true");
+    fprintf(stderr, "\n");
+}
+
+// the activations that multiply a weight, accumulated over all its matrix multiplications
+struct imatrix_stats {
+    std::vector<double> sum; // sum of the squares of each column
+    int64_t n_rows = 0;
+};
+
+struct imatrix_collector {
+    std::map<std::string, imatrix_stats> stats;
+
+    std::vector<uint8_t> buf; // copy of the activations if they are not in host memory
+};
+
+static bool ends_with(const char * str, const char * suffix) {
+    const size_t n = strlen(str);
+    const size_t m = strlen(suffix);
+
+    return n >= m && strcmp(str + n - m, suffix) == 0;
+}
+
+// the matrix multiplications of a model weight, e.g. not the attention products or the convolutions
+static bool imatrix_is_weight_mul_mat(const ggml_tensor * t) {
+    if (t->op != GGML_OP_MUL_MAT) {
+        return false;
+    }
+
+    const ggml_tensor * src0 = t->src[0];
+    const ggml_tensor * src1 = t->src[1];
+
+    return src0->op == GGML_OP_NONE && ends_with(src0->name, ".weight") &&
+           src1->type == GGML_TYPE_F32 && src1->nb[0] == sizeof(float);
+}
+
+static bool imatrix_collect(ggml_tensor * t, bool ask, void * user_data) {
+    if (ask) {
+        return imatrix_is_weight_mul_mat(t);
+    }
+
+    auto & collector = *(imatrix_collector *) user_data;
+
+    const ggml_tensor * src0 = t->src[0];
+    const ggml_tensor * src1 = t->src[1];
+
+    const char * data = (const char *) src1->data;
+    if (!ggml_backend_buffer_is_host(src1->buffer)) {
+        collector.buf.resize(ggml_nbytes(src1));
+        ggml_backend_tensor_get(src1, collector.buf.data(), 0, collector.buf.size());
+        data = (const char *) collector.buf.data();
+    }
+
+    auto & stats = collector.stats[src0->name];
+    stats.sum.resize(src1->ne[0]);
+
+    for (int64_t i3 = 0; i3 < src1->ne[3]; ++i3) {
+        for (int64_t i2 = 0; i2 < src1->ne[2]; ++i2) {
+            for (int64_t i1 = 0; i1 < src1->ne[1]; ++i1) {
+                const float * x = (const float *) (data + i1*src1->nb[1] + i2*src1->nb[2] + i3*src1->nb[3]);
+
+                for (int64_t i0 = 0; i0 < src1->ne[0]; ++i0) {
+                    stats.sum[i0] += (double) x[i0]*x[i0];
+                }
+            }
+        }
+    }
+
+    stats.n_rows += ggml_nrows(src1);
+
+    return true;
+}
+
+int main(int argc, char ** argv) {
+    whisper_params params;
+
+    if (whisper_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    imatrix_collector collector;
+
+    struct whisper_context_params cparams = whisper_context_default_params();
+
+    cparams.use_gpu           = params.use_gpu;
+    cparams.cb_eval           = imatrix_collect;
+    cparams.cb_eval_user_data = &collector;
+
+    struct whisper_context * ctx = whisper_init_from_file_with_params(params.model.c_str(), cparams);
+    if (ctx == nullptr) {
+        fprintf(stderr, "error: failed to initialize whisper context\n");
+        return 2;
+    }
+
+    if (whisper_model_ftype(ctx) != GGML_FTYPE_ALL_F32 && whisper_model_ftype(ctx) != GGML_FTYPE_MOSTLY_F16) {
+        fprintf(stderr, "warning: the model is quantized, the statistics will include its quantization error\n");
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    int n_inputs = 0;
+
+    for (const auto & fname : params.fname_inp) {
+        std::vector<float> pcmf32;
+        std::vector<std::vector<float>> pcmf32s;
+
+        if (!::read_wav(fname, pcmf32, pcmf32s, false)) {
+            fprintf(stderr, "error: failed to read WAV file '%s'\n", fname.c_str());
+            return 3;
+        }
+
+        whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+        wparams.print_realtime   = false;
+        wparams.print_progress   = false;
+        wparams.print_timestamps = false;
+        wparams.print_special    = false;
+        wparams.language         = params.language.c_str();
+        wparams.n_threads        = params.n_threads;
+
+        if (whisper_full(ctx, wparams, pcmf32.data(), pcmf32.size()) != 0) {
+            fprintf(stderr, "error: failed to process '%s'\n", fname.c_str());
+            return 4;
+        }
+
+        n_inputs++;
+
+        fprintf(stderr, "%s: [%d/%d] %s - %.1f s of audio, %d segments\n", __func__,
+                n_inputs, (int) params.fname_inp.size(), fname.c_str(), float(pcmf32.size())/WHISPER_SAMPLE_RATE, whisper_full_n_segments(ctx));
+    }
+
+    whisper_free(ctx);
+
+    // the mean of the squares - only the relative importance of the columns of a weight matters to the quantization
+    ggml_imatrix imatrix;
+    for (const auto & it : collector.stats) {
+        auto & values = imatrix[it.first];
+
+        values.resize(it.second.sum.size());
+        for (size_t i = 0; i < values.size(); ++i) {
+            values[i] = it.second.sum[i]/it.second.n_rows;
+        }
+    }
+
+    if (!ggml_imatrix_save(params.fname_out, imatrix, n_inputs)) {
+        return 5;
+    }
+
+    fprintf(stderr, "%s: saved the imatrix of %d tensors to '%s' in %.2f s\n", __func__,
+            (int) imatrix.size(), params.fname_out.c_str(), 1e-6*(ggml_time_us() - t_start_us));
+
+    return 0;
+}
@@ -4,6 +4,7 @@
 #include "common-ggml.h"
 
 #include <cassert>
+#include <climits>
 #include <cmath>
 #include <cstdio>
 #include <cstring>
@@ -35,8 +36,134 @@ struct whisper_filters {
     std::vector<float> data;
 };
 
+// the type of the tensors with a name that matches pattern, in the blocks [il0, il1] of the encoder or decoder
+struct whisper_quant_rule {
+    std::string pattern;
+
+    bool has_layers = false;
+
+    int il0 = 0;
+    int il1 = INT_MAX;
+
+    ggml_type type = GGML_TYPE_COUNT; // GGML_TYPE_COUNT - keep the tensor as it is
+};
+
+// a base type and the rules for the tensors that are sensitive to its quantization error
+struct whisper_quant_preset {
+    const char * name;
+    const char * desc;
+
+    ggml_ftype ftype;
+
+    std::vector<std::string> rules;
+};
+
+// the token embedding is both the input of the decoder and its output head, and the cross-attention K/V are computed
+// once per segment and used by all tokens - they cost little memory and most of the quality of the low-bit types
+// the convolutions are 3D and never quantized
+static const std::vector<whisper_quant_preset> whisper_quant_presets = {
+    { "q4_mix",  "q4_0, token embedding and cross-attention K/V in q8_0",  GGML_FTYPE_MOSTLY_Q4_0,
+      { "decoder.token_embedding.weight=q8_0", "decoder.blocks.*.cross_attn.(key|value).weight=q8_0" } },
+    { "q5_mix",  "q5_0, token embedding and cross-attention K/V in q8_0",  GGML_FTYPE_MOSTLY_Q5_0,
+      { "decoder.token_embedding.weight=q8_0", "decoder.blocks.*.cross_attn.(key|value).weight=q8_0" } },
+    { "k4_mix",  "q4_K, token embedding and cross-attention K/V in q6_K",  GGML_FTYPE_MOSTLY_Q4_K,
+      { "decoder.token_embedding.weight=q6_k", "decoder.blocks.*.cross_attn.(key|value).weight=q6_k" } },
+    { "iq4_mix", "iq4_nl, token embedding and cross-attention K/V in q8_0, first decoder block in q5_0", GGML_FTYPE_MOSTLY_IQ4_NL,
+      { "decoder.token_embedding.weight=q8_0", "decoder.blocks.*.cross_attn.(key|value).weight=q8_0", "decoder.blocks.*@0=q5_0" } },
+};
+
+// PATTERN[@LAYERS]=TYPE - LAYERS is N, N-M or N-, TYPE is a quantization type, f16, f32 or keep
+static bool whisper_quant_rule_parse(const std::string & str, whisper_quant_rule & rule) {
+    const size_t pos_type = str.rfind('=');
+    if (pos_type == std::string::npos || pos_type == 0) {
+        fprintf(stderr, "%s: invalid rule '%s', expected PATTERN[@LAYERS]=TYPE\n", __func__, str.c_str());
+        return false;
+    }
+
+    std::string type = str.substr(pos_type + 1);
+    for (auto & c : type) {
+        c = tolower(c);
+    }
+
+    if (type == "keep") {
+        rule.type = GGML_TYPE_COUNT;
+    } else {
+        rule.type = ggml_parse_qtype(type.c_str());
+        if (rule.type == GGML_TYPE_COUNT) {
+            fprintf(stderr, "%s: invalid type in rule '%s'\n", __func__, str.c_str());
+            return false;
+        }
+    }
+
+    rule.pattern = str.substr(0, pos_type);
+
+    const size_t pos_layers = rule.pattern.rfind('@');
+    if (pos_layers != std::string::npos) {
+        const std::string layers = rule.pattern.substr(pos_layers + 1);
+        rule.pattern = rule.pattern.substr(0, pos_layers);
+
+        rule.has_layers = true;
+
+        const size_t pos_dash = layers.find('-');
+        try {
+            rule.il0 = std::stoi(layers.substr(0, pos_dash));
+            if (pos_dash == std::string::npos) {
+                rule.il1 = rule.il0;
+            } else if (pos_dash + 1 < layers.size()) {
+                rule.il1 = std::stoi(layers.substr(pos_dash + 1));
+            }
+        } catch (const std::exception &) {
+            fprintf(stderr, "%s: invalid layers in rule '%s'\n", __func__, str.c_str());
+            return false;
+        }
+    }
+
+    try {
+        std::regex check(rule.pattern);
+    } catch (const std::regex_error &) {
+        fprintf(stderr, "%s: invalid pattern in rule '%s'\n", __func__, str.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// the index of the encoder or decoder block of a tensor, -1 if not in a block
+static int whisper_tensor_layer(const std::string & name) {
+    const size_t pos = name.find("blocks.");
+    if (pos == std::string::npos) {
+        return -1;
+    }
+
+    return atoi(name.c_str() + pos + strlen("blocks."));
+}
+
+// the first rule that matches a tensor selects its type, or the type of the ftype if none does
+static ggml_quantize_policy whisper_quant_policy(const std::vector<whisper_quant_rule> & rules) {
+    std::vector<std::pair<std::regex, whisper_quant_rule>> compiled;
+    for (const auto & rule : rules) {
+        compiled.emplace_back(std::regex(rule.pattern), rule);
+    }
+
+    return [compiled](const std::string & name, ggml_type qtype) {
+        const int il = whisper_tensor_layer(name);
+
+        for (const auto & it : compiled) {
+            const auto & rule = it.second;
+            if (rule.has_layers && (il < rule.il0 || il > rule.il1)) {
+                continue;
+            }
+            if (std::regex_match(name, it.first)) {
+                return rule.type;
+            }
+        }
+
+        return qtype;
+    };
+}
+
 // quantize a model
-bool whisper_model_quantize(const std::string & fname_inp, const std::string & fname_out, ggml_ftype ftype) {
+bool whisper_model_quantize(const std::string & fname_inp, const std::string & fname_out, ggml_ftype ftype, const ggml_imatrix & imatrix, const ggml_quantize_policy & policy) {
     gpt_vocab vocab;
 
     printf("%s: loading model from '%s'\n", __func__, fname_inp.c_str());
@@ -164,7 +291,7 @@ bool whisper_model_quantize(const std::string & fname_inp, const std::string & f
         "decoder.positional_embedding",
     };
 
-    if (!ggml_common_quantize_0(finp, fout, ftype, { ".*" }, to_skip)) {
+    if (!ggml_common_quantize_0(finp, fout, ftype, { ".*" }, to_skip, imatrix, policy)) {
         fprintf(stderr, "%s: failed to quantize model '%s'\n", __func__, fname_inp.c_str());
         return false;
     }
@@ -175,13 +302,73 @@ bool whisper_model_quantize(const std::string & fname_inp, const std::string & f
     return true;
 }
 
+static void whisper_print_usage(char ** argv) {
+    fprintf(stderr, "usage: %s [--imatrix imatrix.dat] [--preset NAME] [--rule PATTERN[@LAYERS]=TYPE ...] model-f32.bin model-quant.bin [type]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  the first rule with a regex PATTERN that matches the name of a tensor selects its TYPE (a type below, f16, f32\n");
+    fprintf(stderr, "  or keep), LAYERS is N, N-M or N- and limits the rule to these encoder or decoder blocks, the rules of a preset\n");
+    fprintf(stderr, "  apply after the --rule ones, type is required without a preset and replaces its base type\n");
+    fprintf(stderr, "\n");
+    for (const auto & preset : whisper_quant_presets) {
+        fprintf(stderr, "  preset = \"%s\": %s\n", preset.name, preset.desc);
+    }
+    fprintf(stderr, "\n");
+    ggml_print_ftypes(stderr);
+}
+
 int main(int argc, char ** argv) {
-    if (argc != 4) {
-        fprintf(stderr, "usage: %s model-f32.bin model-quant.bin type\n", argv[0]);
-        ggml_print_ftypes(stderr);
+    std::string fname_imatrix;
+
+    const whisper_quant_preset * preset = nullptr;
+
+    std::vector<whisper_quant_rule> rules;
+
+    // options before the positional arguments
+    int iarg = 1;
+    for (; iarg < argc && argv[iarg][0] == '-'; ++iarg) {
+        const std::string arg = argv[iarg];
+        if (arg == "--imatrix" && iarg + 1 < argc) {
+            fname_imatrix = argv[++iarg];
+        } else if (arg == "--preset" && iarg + 1 < argc) {
+            const std::string name = argv[++iarg];
+            for (const auto & it : whisper_quant_presets) {
+                if (name == it.name) {
+                    preset = &it;
+                }
+            }
+            if (preset == nullptr) {
+                fprintf(stderr, "error: unknown preset: %s\n", name.c_str());
+                whisper_print_usage(argv);
+                return 1;
+            }
+        } else if (arg == "--rule" && iarg + 1 < argc) {
+            whisper_quant_rule rule;
+            if (!whisper_quant_rule_parse(argv[++iarg], rule)) {
+                return 1;
+            }
+            rules.push_back(rule);
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            whisper_print_usage(argv);
+            return 1;
+        }
+    }
+
+    if (argc - iarg != 3 && (argc - iarg != 2 || preset == nullptr)) {
+        whisper_print_usage(argv);
         return 1;
     }
 
+    if (preset) {
+        for (const auto & str : preset->rules) {
+            whisper_quant_rule rule;
+            if (!whisper_quant_rule_parse(str, rule)) {
+                return 1;
+            }
+            rules.push_back(rule);
+        }
+    }
+
     // needed to initialize f16 tables
     {
         struct ggml_init_params params = { 0, NULL, false };
@@ -189,10 +376,24 @@ int main(int argc, char ** argv) {
         ggml_free(ctx);
     }
 
-    const std::string fname_inp = argv[1];
-    const std::string fname_out = argv[2];
+    const std::string fname_inp = argv[iarg + 0];
+    const std::string fname_out = argv[iarg + 1];
 
-    const ggml_ftype ftype = ggml_parse_ftype(argv[3]);
+    const ggml_ftype ftype = argc - iarg == 3 ? ggml_parse_ftype(argv[iarg + 2]) : preset->ftype;
+
+    if (preset) {
+        printf("%s: preset '%s' - %s\n", __func__, preset->name, preset->desc);
+    }
+
+    // activation statistics from examples/imatrix
+    ggml_imatrix imatrix;
+    if (!fname_imatrix.empty()) {
+        if (!ggml_imatrix_load(fname_imatrix, imatrix)) {
+            return 1;
+        }
+
+        printf("%s: loaded the imatrix of %d tensors from '%s'\n", __func__, (int) imatrix.size(), fname_imatrix.c_str());
+    }
 
     const int64_t t_main_start_us = ggml_time_us();
 
@@ -202,7 +403,7 @@ int main(int argc, char ** argv) {
     {
         const int64_t t_start_us = ggml_time_us();
 
-        if (!whisper_model_quantize(fname_inp, fname_out, ggml_ftype(ftype))) {
+        if (!whisper_model_quantize(fname_inp, fname_out, ggml_ftype(ftype), imatrix, rules.empty() ? nullptr : whisper_quant_policy(rules))) {
             fprintf(stderr, "%s: failed to quantize model from '%s'\n", __func__, fname_inp.c_str());
             return 1;
         }
@@ -12,6 +12,17 @@
 #include <vector>
 #include <cstring>
 #include <sstream>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <list>
+#include <random>
+#include <unordered_map>
 
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
@@ -38,6 +49,18 @@ struct server_params
     int32_t port          = 8080;
     int32_t read_timeout  = 600;
     int32_t write_timeout = 600;
+    int32_t n_parallel    = 1;
+    int32_t models_mem_mb = 0; // memory budget for the resident models (0 - no limit)
+    int32_t cache_size    = 64; // max number of cached results (0 - disabled)
+
+    int32_t stream_timeout = 60; // seconds without audio after which a stream session is dropped
+
+    std::string cache_dir = ""; // directory to persist the cached results to
+
+    std::string model_dir = ""; // directory of the models that the requests can select by file name
+
+    std::string trace_dir  = "";   // directory to write the chrome traces of the sampled requests to
+    float       trace_rate = 1.0f; // fraction of the requests to trace
 
     bool ffmpeg_converter = false;
 };
@@ -48,6 +71,7 @@ struct whisper_params {
     int32_t offset_t_ms   = 0;
     int32_t offset_n      = 0;
     int32_t duration_ms   = 0;
+    int32_t deadline_ms   = 0;
     int32_t progress_step = 5;
     int32_t max_context   = -1;
     int32_t max_len       = 0;
@@ -55,6 +79,14 @@ struct whisper_params {
     int32_t beam_size     = -1;
     int32_t audio_ctx     = 0;
 
+    // stream sessions
+    int32_t step_ms       = 3000;
+    int32_t length_ms     = 10000;
+    int32_t keep_ms       = 200;
+
+    float vad_thold       =  0.60f;
+    float freq_thold      = 100.0f;
+
     float word_thold      =  0.01f;
     float entropy_thold   =  2.40f;
     float logprob_thold   = -1.00f;
@@ -75,6 +107,8 @@ struct whisper_params {
     bool print_progress  = false;
     bool no_timestamps   = false;
     bool use_gpu         = true;
+    bool use_mmap        = true;
+    bool stream          = false;
 
     std::string language        = "en";
     std::string prompt          = "";
@@ -95,11 +129,12 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "\n");
     fprintf(stderr, "options:\n");
     fprintf(stderr, "  -h,        --help              [default] show this help message and exit\n");
-    fprintf(stderr, "  -t N,      --threads N         [%-7d] number of threads to use during computation\n",    params.n_threads);
+    fprintf(stderr, "  -t N,      --threads N         [%-7d] number of threads to use per request\n",           params.n_threads);
     fprintf(stderr, "  -p N,      --processors N      [%-7d] number of processors to use during computation\n", params.n_processors);
     fprintf(stderr, "  -ot N,     --offset-t N        [%-7d] time offset in milliseconds\n",                    params.offset_t_ms);
     fprintf(stderr, "  -on N,     --offset-n N        [%-7d] segment index offset\n",                           params.offset_n);
     fprintf(stderr, "  -d  N,     --duration N        [%-7d] duration of audio to process in milliseconds\n",   params.duration_ms);
+    fprintf(stderr, "  -dlm N,    --deadline-ms N     [%-7d] time budget per request in milliseconds (0 - no limit)\n", params.deadline_ms);
     fprintf(stderr, "  -mc N,     --max-context N     [%-7d] maximum number of text context tokens to store\n", params.max_context);
     fprintf(stderr, "  -ml N,     --max-len N         [%-7d] maximum segment length in characters\n",           params.max_len);
     fprintf(stderr, "  -sow,      --split-on-word     [%-7s] split on word rather than on token\n",             params.split_on_word ? "true" : "false");
@@ -124,13 +159,27 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -dl,       --detect-language   [%-7s] exit after automatically detecting language\n",    params.detect_language ? "true" : "false");
     fprintf(stderr, "             --prompt PROMPT     [%-7s] initial prompt\n",                                 params.prompt.c_str());
     fprintf(stderr, "  -m FNAME,  --model FNAME       [%-7s] model path\n",                                     params.model.c_str());
+    fprintf(stderr, "  -nmm,      --no-mmap           [%-7s] read the models instead of mapping them in memory\n", params.use_mmap ? "false" : "true");
+    fprintf(stderr, "             --step N            [%-7d] stream sessions: audio step size in milliseconds (0 - use VAD)\n", params.step_ms);
+    fprintf(stderr, "             --length N          [%-7d] stream sessions: audio length in milliseconds\n",  params.length_ms);
+    fprintf(stderr, "             --keep N            [%-7d] stream sessions: audio to keep from previous step in ms\n", params.keep_ms);
+    fprintf(stderr, "  -vth N,    --vad-thold N       [%-7.2f] stream sessions: voice activity detection threshold\n", params.vad_thold);
+    fprintf(stderr, "  -fth N,    --freq-thold N      [%-7.2f] stream sessions: high-pass frequency cutoff\n",  params.freq_thold);
     fprintf(stderr, "  -oved D,   --ov-e-device DNAME [%-7s] the OpenVINO device used for encode inference\n",  params.openvino_encode_device.c_str());
     // server params
     fprintf(stderr, "  --host HOST,                   [%-7s] Hostname/ip-adress for the server\n", sparams.hostname.c_str());
     fprintf(stderr, "  --port PORT,                   [%-7d] Port number for the server\n", sparams.port);
     fprintf(stderr, "  --public PATH,                 [%-7s] Path to the public folder\n", sparams.public_path.c_str());
     fprintf(stderr, "  --request-path PATH,           [%-7s] Request path for all requests\n", sparams.request_path.c_str());
-    fprintf(stderr, "  --convert,                     [%-7s] Convert audio to WAV, requires ffmpeg on the server", sparams.ffmpeg_converter ? "true" : "false");
+    fprintf(stderr, "  -np N,     --parallel N        [%-7d] Number of requests to process in parallel per model\n", sparams.n_parallel);
+    fprintf(stderr, "  --model-dir DIR,               [%-7s] Directory of the models that requests can select by file name with 'model'\n", sparams.model_dir.c_str());
+    fprintf(stderr, "  --models-mem MB,               [%-7d] Memory budget in MB for resident models and their states, least recently used are evicted (0 - no limit)\n", sparams.models_mem_mb);
+    fprintf(stderr, "  --cache-size N,                [%-7d] Number of results to cache for repeated requests (0 - disabled)\n", sparams.cache_size);
+    fprintf(stderr, "  --cache-dir DIR,               [%-7s] Directory to persist the cached results to\n", sparams.cache_dir.c_str());
+    fprintf(stderr, "  --stream-timeout N,            [%-7d] Seconds without audio after which a stream session is dropped\n", sparams.stream_timeout);
+    fprintf(stderr, "  --trace-dir DIR,               [%-7s] Directory to write a chrome trace of the processing of the sampled requests to\n", sparams.trace_dir.c_str());
+    fprintf(stderr, "  --trace-rate F,                [%-7.2f] Fraction of the requests to trace\n", sparams.trace_rate);
+    fprintf(stderr, "  --convert,                     [%-7s] Decode non-WAV audio with ffmpeg, requires ffmpeg on the server\n", sparams.ffmpeg_converter ? "true" : "false");
     fprintf(stderr, "\n");
 }
 
@@ -147,6 +196,7 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params, serve
         else if (arg == "-ot"   || arg == "--offset-t")        { params.offset_t_ms     = std::stoi(argv[++i]); }
         else if (arg == "-on"   || arg == "--offset-n")        { params.offset_n        = std::stoi(argv[++i]); }
         else if (arg == "-d"    || arg == "--duration")        { params.duration_ms     = std::stoi(argv[++i]); }
+        else if (arg == "-dlm"  || arg == "--deadline-ms")     { params.deadline_ms     = std::stoi(argv[++i]); }
         else if (arg == "-mc"   || arg == "--max-context")     { params.max_context     = std::stoi(argv[++i]); }
         else if (arg == "-ml"   || arg == "--max-len")         { params.max_len         = std::stoi(argv[++i]); }
         else if (arg == "-bo"   || arg == "--best-of")         { params.best_of         = std::stoi(argv[++i]); }
@@ -172,14 +222,28 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params, serve
         else if (arg == "-dl"   || arg == "--detect-language") { params.detect_language = true; }
         else if (                  arg == "--prompt")          { params.prompt          = argv[++i]; }
         else if (arg == "-m"    || arg == "--model")           { params.model           = argv[++i]; }
+        else if (                  arg == "--step")            { params.step_ms         = std::stoi(argv[++i]); }
+        else if (                  arg == "--length")          { params.length_ms       = std::stoi(argv[++i]); }
+        else if (                  arg == "--keep")            { params.keep_ms         = std::stoi(argv[++i]); }
+        else if (arg == "-vth"  || arg == "--vad-thold")       { params.vad_thold       = std::stof(argv[++i]); }
+        else if (arg == "-fth"  || arg == "--freq-thold")      { params.freq_thold      = std::stof(argv[++i]); }
         else if (arg == "-oved" || arg == "--ov-e-device")     { params.openvino_encode_device = argv[++i]; }
         else if (arg == "-ng"   || arg == "--no-gpu")          { params.use_gpu         = false; }
+        else if (arg == "-nmm"  || arg == "--no-mmap")         { params.use_mmap        = false; }
         // server params
         else if (                  arg == "--port")            { sparams.port        = std::stoi(argv[++i]); }
         else if (                  arg == "--host")            { sparams.hostname    = argv[++i]; }
         else if (                  arg == "--public")          { sparams.public_path = argv[++i]; }
         else if (                  arg == "--request-path")    { sparams.request_path = argv[++i]; }
         else if (                  arg == "--convert")         { sparams.ffmpeg_converter     = true; }
+        else if (arg == "-np"   || arg == "--parallel")        { sparams.n_parallel  = std::stoi(argv[++i]); }
+        else if (                  arg == "--model-dir")       { sparams.model_dir   = argv[++i]; }
+        else if (                  arg == "--models-mem")      { sparams.models_mem_mb = std::stoi(argv[++i]); }
+        else if (                  arg == "--cache-size")      { sparams.cache_size  = std::stoi(argv[++i]); }
+        else if (                  arg == "--cache-dir")       { sparams.cache_dir   = argv[++i]; }
+        else if (                  arg == "--stream-timeout")  { sparams.stream_timeout = std::stoi(argv[++i]); }
+        else if (                  arg == "--trace-dir")       { sparams.trace_dir   = argv[++i]; }
+        else if (                  arg == "--trace-rate")      { sparams.trace_rate  = std::stof(argv[++i]); }
         else {
             fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
             whisper_print_usage(argc, argv, params, sparams);
@@ -197,6 +261,333 @@ struct whisper_print_user_data {
     int progress_prev;
 };
 
+// pool of whisper_states sharing the model of a single whisper_context
+// each request runs on its own state, so up to states.size() requests are processed in parallel
+struct server_state_pool {
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    std::vector<whisper_state *> states; // all states of the pool
+    std::vector<whisper_state *> idle;   // states that are not used by a request
+
+    int32_t n_queued    = 0; // number of requests waiting for a free state
+    int32_t n_in_flight = 0; // number of requests being processed
+
+    int64_t n_requests    = 0; // number of requests that got a state so far
+    int64_t t_wait_us     = 0; // total time requests spent waiting for a free state
+    int64_t t_wait_max_us = 0; // longest time a request spent waiting for a free state
+};
+
+bool state_pool_init(server_state_pool & pool, whisper_context * ctx, int n_states, const whisper_params & params) {
+    for (int i = 0; i < n_states; ++i) {
+        whisper_state * state = whisper_init_state(ctx);
+        if (state == nullptr) {
+            fprintf(stderr, "error: failed to initialize whisper state %d\n", i);
+            return false;
+        }
+
+        // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
+        whisper_ctx_init_openvino_encoder_with_state(ctx, state, nullptr, params.openvino_encode_device.c_str(), nullptr);
+
+        pool.states.push_back(state);
+    }
+
+    pool.idle = pool.states;
+
+    return true;
+}
+
+// must be called when no state is in use
+void state_pool_free(server_state_pool & pool) {
+    for (auto * state : pool.states) {
+        whisper_free_state(state);
+    }
+    pool.states.clear();
+    pool.idle.clear();
+}
+
+// blocks until a state is available and returns it together with the time spent waiting for it
+whisper_state * state_pool_acquire(server_state_pool & pool, int64_t & t_wait_us) {
+    const int64_t t_start_us = ggml_time_us();
+
+    std::unique_lock<std::mutex> lock(pool.mutex);
+
+    pool.n_queued++;
+    pool.cv.wait(lock, [&pool] { return !pool.idle.empty(); });
+    pool.n_queued--;
+
+    whisper_state * state = pool.idle.back();
+    pool.idle.pop_back();
+
+    t_wait_us = ggml_time_us() - t_start_us;
+
+    pool.n_in_flight++;
+    pool.n_requests++;
+    pool.t_wait_us    += t_wait_us;
+    pool.t_wait_max_us = std::max(pool.t_wait_max_us, t_wait_us);
+
+    return state;
+}
+
+void state_pool_release(server_state_pool & pool, whisper_state * state) {
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+
+        pool.idle.push_back(state);
+        pool.n_in_flight--;
+    }
+
+    pool.cv.notify_all();
+}
+
+// releases the acquired state when the request handler returns
+struct state_pool_guard {
+    server_state_pool & pool;
+    whisper_state * state;
+
+    ~state_pool_guard() {
+        state_pool_release(pool, state);
+    }
+};
+
+// 64-bit hash of the raw bytes, processed 8 bytes at a time
+uint64_t hash_bytes(const void * data, size_t n, uint64_t seed) {
+    const uint8_t * src = (const uint8_t *) data;
+
+    auto mix = [](uint64_t h) {
+        h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    };
+
+    uint64_t h = seed ^ (n*0x9e3779b97f4a7c15ULL);
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t v;
+        memcpy(&v, src + i, 8);
+        h = (h ^ mix(v))*0x87c37b91114253d5ULL;
+        h = (h << 31) | (h >> 33);
+    }
+
+    uint64_t v = 0;
+    memcpy(&v, src + i, n - i);
+
+    return mix(h ^ mix(v));
+}
+
+std::string to_hex(uint64_t v) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long) v);
+    return buf;
+}
+
+// a resident model with its own pool of states
+// requests hold a shared_ptr to the model, so a model that is replaced or evicted is freed when its last request is done
+struct server_model {
+    std::string path;
+    std::string id; // identity of the content of the model file, see model_fingerprint()
+
+    whisper_context * ctx = nullptr;
+    server_state_pool pool;
+
+    size_t  mem_model  = 0; // estimated memory usage of the weights - the size of the model file
+    size_t  mem_states = 0; // KV caches and compute buffers of the states of the pool
+    size_t  mem_size   = 0; // mem_model + mem_states
+    int64_t t_used_us  = 0; // last time the model was used, for LRU eviction
+
+    ~server_model() {
+        state_pool_free(pool);
+        whisper_free(ctx);
+    }
+};
+
+// the models that are currently resident, by path
+struct server_model_registry {
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    std::map<std::string, std::shared_ptr<server_model>> models;
+    std::set<std::string> loading; // models being loaded by a request
+
+    std::string path_default; // model used by requests that do not specify one
+    size_t mem_budget = 0;    // 0 - no limit
+};
+
+// identity of the content of a model file: its size and a hash of its first MB (hparams, mel filters, vocab) and of
+// 64 blocks spread over the weights - a file replaced by another model gets another identity, "" on error
+std::string model_fingerprint(const std::string & path) {
+    std::ifstream fin(path, std::ios::binary | std::ios::ate);
+    if (!fin) {
+        return "";
+    }
+
+    const size_t size = fin.tellg();
+
+    const size_t n_head   = 1024*1024;
+    const size_t n_block  = 64*1024;
+    const int    n_blocks = 64;
+
+    std::vector<char> buf(n_head);
+
+    fin.seekg(0);
+    fin.read(buf.data(), std::min(size, n_head));
+    uint64_t h = hash_bytes(buf.data(), fin.gcount(), size);
+
+    for (int i = 0; i < n_blocks && size > n_head + n_block; ++i) {
+        fin.seekg(n_head + (size - n_head - n_block)/(n_blocks - 1)*i);
+        fin.read(buf.data(), n_block);
+        h = hash_bytes(buf.data(), fin.gcount(), h);
+    }
+
+    return to_hex(h) + ":" + std::to_string(size);
+}
+
+std::shared_ptr<server_model> model_load(
+        const std::string & path,
+        const whisper_context_params & cparams,
+        const whisper_params & params,
+        int n_parallel) {
+    auto model = std::make_shared<server_model>();
+    model->path = path;
+
+    model->ctx = whisper_init_from_file_with_params_no_state(path.c_str(), cparams);
+    if (model->ctx == nullptr) {
+        fprintf(stderr, "error: failed to initialize whisper context from '%s'\n", path.c_str());
+        return nullptr;
+    }
+
+    if (!state_pool_init(model->pool, model->ctx, n_parallel, params)) {
+        fprintf(stderr, "error: failed to initialize whisper states for '%s'\n", path.c_str());
+        return nullptr;
+    }
+
+    std::ifstream fin(path, std::ios::binary | std::ios::ate);
+    model->mem_model = fin ? (size_t) fin.tellg() : 0;
+
+    for (auto * state : model->pool.states) {
+        const whisper_timings timings = whisper_get_timings_from_state(state);
+        model->mem_states += timings.mem_kv + timings.mem_compute;
+    }
+
+    model->mem_size  = model->mem_model + model->mem_states;
+    model->id        = model_fingerprint(path);
+    model->t_used_us = ggml_time_us();
+
+    return model;
+}
+
+// evicts the least recently used models until the resident models fit in the budget
+// the default model and keep are never evicted - must be called with the registry locked
+void model_registry_evict(server_model_registry & registry, const std::string & keep) {
+    if (registry.mem_budget == 0) {
+        return;
+    }
+
+    while (true) {
+        size_t mem_total = 0;
+        for (const auto & kv : registry.models) {
+            mem_total += kv.second->mem_size;
+        }
+
+        if (mem_total <= registry.mem_budget) {
+            break;
+        }
+
+        auto it_lru = registry.models.end();
+        for (auto it = registry.models.begin(); it != registry.models.end(); ++it) {
+            if (it->first == registry.path_default || it->first == keep) {
+                continue;
+            }
+            if (it_lru == registry.models.end() || it->second->t_used_us < it_lru->second->t_used_us) {
+                it_lru = it;
+            }
+        }
+
+        if (it_lru == registry.models.end()) {
+            fprintf(stderr, "warning: resident models use %zu MB, over the budget of %zu MB\n", mem_total >> 20, registry.mem_budget >> 20);
+            break;
+        }
+
+        fprintf(stderr, "%s: evicting model '%s'\n", __func__, it_lru->first.c_str());
+        registry.models.erase(it_lru);
+    }
+}
+
+// atomically makes a loaded model resident, replacing the previous instance of it
+void model_registry_add(server_model_registry & registry, std::shared_ptr<server_model> model, bool make_default) {
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    registry.models[model->path] = model;
+    if (make_default) {
+        registry.path_default = model->path;
+    }
+
+    model_registry_evict(registry, model->path);
+}
+
+// the path of a model selected by a request - only the files of --model-dir can be selected, by their name, so that
+// clients cannot make the server open other files. returns "" if the model is not allowed or does not exist
+std::string model_resolve(const server_params & sparams, const std::string & name) {
+    if (sparams.model_dir.empty() || name.empty() || name == "." || name == ".." ||
+        name.find_first_of(std::string("/\\\0", 3)) != std::string::npos) {
+        return "";
+    }
+
+    const std::string path = sparams.model_dir + "/" + name;
+    if (!is_file_exist(path.c_str())) {
+        return "";
+    }
+
+    return path;
+}
+
+// returns the requested model (or the default one if path is empty), loading it if it is not resident
+std::shared_ptr<server_model> model_registry_get(
+        server_model_registry & registry,
+        const std::string & path,
+        const whisper_context_params & cparams,
+        const whisper_params & params,
+        int n_parallel) {
+    std::unique_lock<std::mutex> lock(registry.mutex);
+
+    const std::string path_model = path.empty() ? registry.path_default : path;
+
+    // another request may be loading the model already
+    registry.cv.wait(lock, [&] { return registry.loading.count(path_model) == 0; });
+
+    auto it = registry.models.find(path_model);
+    if (it != registry.models.end()) {
+        it->second->t_used_us = ggml_time_us();
+        return it->second;
+    }
+
+    if (!is_file_exist(path_model.c_str())) {
+        fprintf(stderr, "error: 'model': %s not found!\n", path_model.c_str());
+        return nullptr;
+    }
+
+    // load without holding the lock, so that requests for the other models are not blocked
+    registry.loading.insert(path_model);
+    lock.unlock();
+
+    fprintf(stderr, "%s: loading model '%s'\n", __func__, path_model.c_str());
+    auto model = model_load(path_model, cparams, params, n_parallel);
+
+    lock.lock();
+    registry.loading.erase(path_model);
+    if (model) {
+        registry.models[path_model] = model;
+        model_registry_evict(registry, path_model);
+    }
+    lock.unlock();
+
+    registry.cv.notify_all();
+
+    return model;
+}
+
 void check_ffmpeg_availibility() {
     int result = system("ffmpeg -version");
 
@@ -210,29 +601,105 @@ void check_ffmpeg_availibility() {
     }
 }
 
-bool convert_to_wav(const std::string & temp_filename, std::string & error_resp) {
+// converts the audio to raw 16 kHz float PCM with ffmpeg and reads it from a pipe
+// the input is written to a temporary file with a unique name, so concurrent requests do not clash
+bool ffmpeg_decode_audio(const std::string & content, int n_channels, std::vector<float> & pcm, std::string & error_resp) {
+    static std::atomic<uint64_t> n_converted(0);
+
+    std::ostringstream temp_stream;
+    temp_stream << "whisper_server_" << ggml_time_us() << "_" << n_converted++ << ".tmp";
+    const std::string temp_filename = temp_stream.str();
+
+    {
+        std::ofstream temp_file{temp_filename, std::ios::binary};
+        temp_file << content;
+    }
+
     std::ostringstream cmd_stream;
-    std::string converted_filename_temp = temp_filename + "_temp.wav";
-    cmd_stream << "ffmpeg -i \"" << temp_filename << "\" -ar 16000 -ac 1 -c:a pcm_s16le \"" << converted_filename_temp << "\" 2>&1";
-    std::string cmd = cmd_stream.str();
+    cmd_stream << "ffmpeg -nostdin -loglevel error -i \"" << temp_filename << "\" -ar " << COMMON_SAMPLE_RATE << " -ac " << n_channels << " -f f32le -";
+    const std::string cmd = cmd_stream.str();
+
+#ifdef _WIN32
+    FILE * pipe = _popen(cmd.c_str(), "rb");
+#else
+    FILE * pipe = popen(cmd.c_str(), "r");
+#endif
+    if (pipe == nullptr) {
+        std::remove(temp_filename.c_str());
+        error_resp = "{\"error\":\"Failed to execute ffmpeg command.\"}";
+        return false;
+    }
+
+    pcm.clear();
+
+    float buf[4096];
+    while (true) {
+        const size_t n = fread(buf, sizeof(float), sizeof(buf)/sizeof(float), pipe);
+        if (n == 0) {
+            break;
+        }
+        pcm.insert(pcm.end(), buf, buf + n);
+    }
+
+#ifdef _WIN32
+    const int status = _pclose(pipe);
+#else
+    const int status = pclose(pipe);
+#endif
+
+    std::remove(temp_filename.c_str());
 
-    int status = std::system(cmd.c_str());
-    if (status != 0) {
+    if (status != 0 || pcm.empty()) {
         error_resp = "{\"error\":\"FFmpeg conversion failed.\"}";
         return false;
     }
 
-    // Remove the original file
-    if (remove(temp_filename.c_str()) != 0) {
-        error_resp = "{\"error\":\"Failed to remove the original file.\"}";
+    return true;
+}
+
+// decodes the uploaded audio in memory into 16 kHz mono (and stereo for diarization) PCM
+// WAV files of any sample rate and sample format are decoded and resampled in process, other formats need ffmpeg
+bool decode_audio(
+        const std::string & content,
+        bool stereo,
+        bool use_ffmpeg,
+        std::vector<float> & pcmf32,
+        std::vector<std::vector<float>> & pcmf32s,
+        std::string & error_resp) {
+    if (is_wav_buffer(content)) {
+        if (!::read_wav(content, pcmf32, pcmf32s, stereo)) {
+            error_resp = "{\"error\":\"failed to read WAV file\"}";
+            return false;
+        }
+        return true;
+    }
+
+    if (!use_ffmpeg) {
+        error_resp = "{\"error\":\"unsupported audio format, only WAV is supported without --convert\"}";
         return false;
     }
 
-    // Rename the temporary file to match the original filename
-    if (rename(converted_filename_temp.c_str(), temp_filename.c_str()) != 0) {
-        error_resp = "{\"error\":\"Failed to rename the temporary file.\"}";
+    const int n_channels = stereo ? 2 : 1;
+
+    std::vector<float> pcm;
+    if (!ffmpeg_decode_audio(content, n_channels, pcm, error_resp)) {
         return false;
     }
+
+    const size_t n = pcm.size()/n_channels;
+
+    if (stereo) {
+        pcmf32.resize(n);
+        pcmf32s.assign(2, std::vector<float>(n));
+        for (size_t i = 0; i < n; i++) {
+            pcmf32s[0][i] = pcm[2*i];
+            pcmf32s[1][i] = pcm[2*i + 1];
+            pcmf32[i] = 0.5f*(pcm[2*i] + pcm[2*i + 1]);
+        }
+    } else {
+        pcmf32 = std::move(pcm);
+    }
+
     return true;
 }
 
@@ -278,11 +745,11 @@ void whisper_print_progress_callback(struct whisper_context * /*ctx*/, struct wh
     }
 }
 
-void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * /*state*/, int n_new, void * user_data) {
+void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data) {
     const auto & params  = *((whisper_print_user_data *) user_data)->params;
     const auto & pcmf32s = *((whisper_print_user_data *) user_data)->pcmf32s;
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
 
     std::string speaker = "";
 
@@ -298,8 +765,8 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
 
     for (int i = s0; i < n_segments; i++) {
         if (!params.no_timestamps || params.diarize) {
-            t0 = whisper_full_get_segment_t0(ctx, i);
-            t1 = whisper_full_get_segment_t1(ctx, i);
+            t0 = whisper_full_get_segment_t0_from_state(state, i);
+            t1 = whisper_full_get_segment_t1_from_state(state, i);
         }
 
         if (!params.no_timestamps) {
@@ -311,29 +778,29 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
         }
 
         if (params.print_colors) {
-            for (int j = 0; j < whisper_full_n_tokens(ctx, i); ++j) {
+            for (int j = 0; j < whisper_full_n_tokens_from_state(state, i); ++j) {
                 if (params.print_special == false) {
-                    const whisper_token id = whisper_full_get_token_id(ctx, i, j);
+                    const whisper_token id = whisper_full_get_token_id_from_state(state, i, j);
                     if (id >= whisper_token_eot(ctx)) {
                         continue;
                     }
                 }
 
-                const char * text = whisper_full_get_token_text(ctx, i, j);
-                const float  p    = whisper_full_get_token_p   (ctx, i, j);
+                const char * text = whisper_full_get_token_text_from_state(ctx, state, i, j);
+                const float  p    = whisper_full_get_token_p_from_state   (state, i, j);
 
                 const int col = std::max(0, std::min((int) k_colors.size() - 1, (int) (std::pow(p, 3)*float(k_colors.size()))));
 
                 printf("%s%s%s%s", speaker.c_str(), k_colors[col].c_str(), text, "\033[0m");
             }
         } else {
-            const char * text = whisper_full_get_segment_text(ctx, i);
+            const char * text = whisper_full_get_segment_text_from_state(state, i);
 
             printf("%s%s", speaker.c_str(), text);
         }
 
         if (params.tinydiarize) {
-            if (whisper_full_get_segment_speaker_turn_next(ctx, i)) {
+            if (whisper_full_get_segment_speaker_turn_next_from_state(state, i)) {
                 printf("%s", params.tdrz_speaker_turn.c_str());
             }
         }
@@ -346,73 +813,736 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
     }
 }
 
-std::string output_str(struct whisper_context * ctx, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
-    std::stringstream result;
-    const int n_segments = whisper_full_n_segments(ctx);
+// the results of a request, copied out of the state so that they can be cached and rendered in any format
+struct server_token {
+    whisper_token id;
+    std::string   text;
+
+    float p;
+    float plog;
+
+    int64_t t0;
+    int64_t t1;
+};
+
+struct server_segment {
+    int64_t t0;
+    int64_t t1;
+
+    std::string text;
+
+    bool  speaker_turn_next;
+    float no_speech_prob;
+
+    std::vector<server_token> tokens;
+};
+
+struct server_result {
+    int lang_id = -1;
+
+    std::vector<server_segment> segments;
+};
+
+server_segment result_segment_from_state(struct whisper_context * ctx, struct whisper_state * state, int i) {
+    server_segment segment;
+
+    segment.t0                = whisper_full_get_segment_t0_from_state(state, i);
+    segment.t1                = whisper_full_get_segment_t1_from_state(state, i);
+    segment.text              = whisper_full_get_segment_text_from_state(state, i);
+    segment.speaker_turn_next = whisper_full_get_segment_speaker_turn_next_from_state(state, i);
+    segment.no_speech_prob    = whisper_full_get_segment_no_speech_prob_from_state(state, i);
+
+    const int n_tokens = whisper_full_n_tokens_from_state(state, i);
+    segment.tokens.resize(n_tokens);
+
+    for (int j = 0; j < n_tokens; ++j) {
+        const whisper_token_data data = whisper_full_get_token_data_from_state(state, i, j);
+
+        auto & token = segment.tokens[j];
+
+        token.id   = data.id;
+        token.text = whisper_full_get_token_text_from_state(ctx, state, i, j);
+        token.p    = data.p;
+        token.plog = data.plog;
+        token.t0   = data.t0;
+        token.t1   = data.t1;
+    }
+
+    return segment;
+}
+
+void result_from_state(struct whisper_context * ctx, struct whisper_state * state, server_result & result) {
+    result.lang_id = whisper_full_lang_id_from_state(state);
+    result.segments.clear();
+
+    const int n_segments = whisper_full_n_segments_from_state(state);
     for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        std::string speaker = "";
+        result.segments.push_back(result_segment_from_state(ctx, state, i));
+    }
+}
 
-        if (params.diarize && pcmf32s.size() == 2)
-        {
-            const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-            const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
-            speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
+json result_to_json(const server_result & result) {
+    json jres = json{
+        {"lang_id",  result.lang_id},
+        {"segments", json::array()},
+    };
+
+    for (const auto & segment : result.segments) {
+        json jseg = json{
+            {"t0",                segment.t0},
+            {"t1",                segment.t1},
+            {"text",              segment.text},
+            {"speaker_turn_next", segment.speaker_turn_next},
+            {"no_speech_prob",    segment.no_speech_prob},
+            {"tokens",            json::array()},
+        };
+
+        for (const auto & token : segment.tokens) {
+            jseg["tokens"].push_back(json{
+                {"id",   token.id},
+                {"text", token.text},
+                {"p",    token.p},
+                {"plog", token.plog},
+                {"t0",   token.t0},
+                {"t1",   token.t1},
+            });
         }
 
-        result << speaker << text << "\n";
+        jres["segments"].push_back(jseg);
     }
-    return result.str();
+
+    return jres;
 }
 
-bool parse_str_to_bool(const std::string & s) {
-    if (s == "true" || s == "1" || s == "yes" || s == "y") {
-        return true;
+void result_from_json(const json & jres, server_result & result) {
+    result.lang_id = jres.at("lang_id");
+    result.segments.clear();
+
+    for (const auto & jseg : jres.at("segments")) {
+        server_segment segment;
+
+        segment.t0                = jseg.at("t0");
+        segment.t1                = jseg.at("t1");
+        segment.text              = jseg.at("text");
+        segment.speaker_turn_next = jseg.at("speaker_turn_next");
+        segment.no_speech_prob    = jseg.at("no_speech_prob");
+
+        for (const auto & jtok : jseg.at("tokens")) {
+            server_token token;
+
+            token.id   = jtok.at("id");
+            token.text = jtok.at("text");
+            token.p    = jtok.at("p");
+            token.plog = jtok.at("plog");
+            token.t0   = jtok.at("t0");
+            token.t1   = jtok.at("t1");
+
+            segment.tokens.push_back(std::move(token));
+        }
+
+        result.segments.push_back(std::move(segment));
     }
-    return false;
 }
 
-void get_req_parameters(const Request & req, whisper_params & params)
-{
-    if (req.has_file("offset_t"))
-    {
-        params.offset_t_ms = std::stoi(req.get_file_value("offset_t").content);
+// LRU cache of the results, keyed by a hash of the decoded audio and the decoding parameters
+// with a directory set, the results are also stored on disk and survive evictions and restarts
+struct server_result_cache {
+    std::mutex mutex;
+
+    size_t      capacity = 0; // max number of results in memory (0 - disabled)
+    std::string dir;          // "" - in memory only
+
+    std::list<std::string> lru; // most recently used first
+    std::unordered_map<std::string, std::pair<std::shared_ptr<const server_result>, std::list<std::string>::iterator>> entries;
+
+    int64_t n_hits      = 0;
+    int64_t n_hits_disk = 0; // hits that were loaded from the directory
+    int64_t n_misses    = 0;
+    int64_t n_evictions = 0;
+};
+
+// the key covers everything that changes the decoded segments and tokens
+// the output format only matters through the token timestamps, which are computed for verbose_json only
+std::string result_cache_key(const server_model & model, const whisper_params & params, const std::vector<float> & pcmf32) {
+    std::stringstream ss;
+    ss.precision(9);
+
+    ss << to_hex(hash_bytes(pcmf32.data(), pcmf32.size()*sizeof(float), 0)) << ":" << pcmf32.size();
+    ss << "|" << model.id;
+    ss << "|" << params.language << "|" << params.translate << "|" << params.detect_language;
+    ss << "|" << params.offset_t_ms << "|" << params.duration_ms << "|" << params.max_context << "|" << params.audio_ctx;
+    ss << "|" << params.max_len << "|" << params.split_on_word << "|" << params.word_thold;
+    ss << "|" << params.best_of << "|" << params.beam_size << "|" << params.speed_up << "|" << params.tinydiarize;
+    ss << "|" << params.temperature << "|" << params.temperature_inc << "|" << params.entropy_thold << "|" << params.logprob_thold;
+    ss << "|" << params.no_timestamps << "|" << (!params.no_timestamps && params.response_format == vjson_format);
+    ss << "|" << params.prompt;
+
+    return ss.str();
+}
+
+std::string result_cache_path(const server_result_cache & cache, const std::string & key) {
+    return cache.dir + "/" + to_hex(hash_bytes(key.data(), key.size(), 0)) + ".json";
+}
+
+// must be called with the cache locked
+void result_cache_insert(server_result_cache & cache, const std::string & key, std::shared_ptr<const server_result> result) {
+    auto it = cache.entries.find(key);
+    if (it != cache.entries.end()) {
+        cache.lru.erase(it->second.second);
+        cache.entries.erase(it);
     }
-    if (req.has_file("offset_n"))
-    {
-        params.offset_n = std::stoi(req.get_file_value("offset_n").content);
+
+    cache.lru.push_front(key);
+    cache.entries[key] = { std::move(result), cache.lru.begin() };
+
+    while (cache.entries.size() > cache.capacity) {
+        cache.entries.erase(cache.lru.back());
+        cache.lru.pop_back();
+        cache.n_evictions++;
     }
-    if (req.has_file("duration"))
-    {
-        params.duration_ms = std::stoi(req.get_file_value("duration").content);
+}
+
+// returns the cached result, or nullptr on a miss or if the cache is disabled
+std::shared_ptr<const server_result> result_cache_get(server_result_cache & cache, const std::string & key) {
+    if (cache.capacity == 0) {
+        return nullptr;
     }
-    if (req.has_file("max_context"))
+
     {
-        params.max_context = std::stoi(req.get_file_value("max_context").content);
+        std::lock_guard<std::mutex> lock(cache.mutex);
+
+        auto it = cache.entries.find(key);
+        if (it != cache.entries.end()) {
+            cache.lru.splice(cache.lru.begin(), cache.lru, it->second.second);
+            cache.n_hits++;
+            return it->second.first;
+        }
     }
-    if (req.has_file("max_len"))
-    {
-        params.max_len = std::stoi(req.get_file_value("max_len").content);
+
+    std::shared_ptr<server_result> result;
+
+    if (!cache.dir.empty()) {
+        std::ifstream fin(result_cache_path(cache, key));
+        if (fin) {
+            try {
+                const json jres = json::parse(fin);
+
+                // the file name is a hash of the key - make sure that it is not a collision
+                if (jres.at("key") == key) {
+                    result = std::make_shared<server_result>();
+                    result_from_json(jres.at("result"), *result);
+                }
+            } catch (const std::exception & e) {
+                fprintf(stderr, "%s: ignoring invalid cache file: %s\n", __func__, e.what());
+                result = nullptr;
+            }
+        }
     }
-    if (req.has_file("best_of"))
-    {
-        params.best_of = std::stoi(req.get_file_value("best_of").content);
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+
+    if (result == nullptr) {
+        cache.n_misses++;
+        return nullptr;
     }
-    if (req.has_file("beam_size"))
-    {
-        params.beam_size = std::stoi(req.get_file_value("beam_size").content);
+
+    cache.n_hits++;
+    cache.n_hits_disk++;
+    result_cache_insert(cache, key, result);
+
+    return result;
+}
+
+void result_cache_put(server_result_cache & cache, const std::string & key, std::shared_ptr<const server_result> result) {
+    if (cache.capacity == 0) {
+        return;
     }
-    if (req.has_file("audio_ctx"))
+
     {
-        params.audio_ctx = std::stof(req.get_file_value("audio_ctx").content);
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        result_cache_insert(cache, key, result);
     }
-    if (req.has_file("word_thold"))
-    {
-        params.word_thold = std::stof(req.get_file_value("word_thold").content);
+
+    if (!cache.dir.empty()) {
+        const std::string path = result_cache_path(cache, key);
+
+        // write to a temporary file first, so that readers never see a partial result
+        const std::string path_tmp = path + ".tmp" + to_hex(std::hash<std::thread::id>()(std::this_thread::get_id()));
+
+        {
+            std::ofstream fout(path_tmp);
+            fout << json{{"key", key}, {"result", result_to_json(*result)}}.dump(-1, ' ', false, json::error_handler_t::replace);
+        }
+
+        if (std::rename(path_tmp.c_str(), path.c_str()) != 0) {
+            fprintf(stderr, "%s: failed to write '%s'\n", __func__, path.c_str());
+            std::remove(path_tmp.c_str());
+        }
     }
-    if (req.has_file("entropy_thold"))
-    {
-        params.entropy_thold = std::stof(req.get_file_value("entropy_thold").content);
+}
+
+std::string output_str(const server_result & result, const whisper_params & params, const std::vector<std::vector<float>> & pcmf32s) {
+    std::stringstream result_str;
+    for (const auto & segment : result.segments) {
+        std::string speaker = "";
+
+        if (params.diarize && pcmf32s.size() == 2)
+        {
+            speaker = estimate_diarization_speaker(pcmf32s, segment.t0, segment.t1);
+        }
+
+        result_str << speaker << segment.text << "\n";
+    }
+    return result_str.str();
+}
+
+// renders the result in the requested response format
+void write_result(
+        whisper_context * ctx,
+    const server_result & result,
+   const whisper_params & params,
+ const std::vector<float> & pcmf32,
+ const std::vector<std::vector<float>> & pcmf32s,
+               Response & res) {
+    if (params.response_format == text_format)
+    {
+        std::string results = output_str(result, params, pcmf32s);
+        res.set_content(results.c_str(), "text/html");
+    }
+    else if (params.response_format == srt_format)
+    {
+        std::stringstream ss;
+        const int n_segments = result.segments.size();
+        for (int i = 0; i < n_segments; ++i) {
+            const auto & segment = result.segments[i];
+            std::string speaker = "";
+
+            if (params.diarize && pcmf32s.size() == 2)
+            {
+                speaker = estimate_diarization_speaker(pcmf32s, segment.t0, segment.t1);
+            }
+
+            ss << i + 1 + params.offset_n << "\n";
+            ss << to_timestamp(segment.t0, true) << " --> " << to_timestamp(segment.t1, true) << "\n";
+            ss << speaker << segment.text << "\n\n";
+        }
+        res.set_content(ss.str(), "application/x-subrip");
+    } else if (params.response_format == vtt_format) {
+        std::stringstream ss;
+
+        ss << "WEBVTT\n\n";
+
+        for (const auto & segment : result.segments) {
+            std::string speaker = "";
+
+            if (params.diarize && pcmf32s.size() == 2)
+            {
+                speaker = estimate_diarization_speaker(pcmf32s, segment.t0, segment.t1, true);
+                speaker.insert(0, "<v Speaker");
+                speaker.append(">");
+            }
+
+            ss << to_timestamp(segment.t0) << " --> " << to_timestamp(segment.t1) << "\n";
+            ss << speaker << segment.text << "\n\n";
+        }
+        res.set_content(ss.str(), "text/vtt");
+    } else if (params.response_format == vjson_format) {
+        /* try to match openai/whisper's Python format */
+        std::string results = output_str(result, params, pcmf32s);
+        json jres = json{
+            {"task", params.translate ? "translate" : "transcribe"},
+            {"language", whisper_lang_str_full(result.lang_id)},
+            {"duration", float(pcmf32.size())/WHISPER_SAMPLE_RATE},
+            {"text", results},
+            {"segments", json::array()}
+        };
+        const int n_segments = result.segments.size();
+        for (int i = 0; i < n_segments; ++i)
+        {
+            const auto & seg = result.segments[i];
+
+            json segment = json{
+                {"id", i},
+                {"text", seg.text},
+            };
+
+            if (!params.no_timestamps) {
+                segment["start"] = seg.t0 * 0.01;
+                segment["end"] = seg.t1 * 0.01;
+            }
+
+            float total_logprob = 0;
+            const int n_tokens = seg.tokens.size();
+            for (const auto & token : seg.tokens) {
+                if (token.id >= whisper_token_eot(ctx)) {
+                    continue;
+                }
+
+                segment["tokens"].push_back(token.id);
+                json word = json{{"word", token.text}};
+                if (!params.no_timestamps) {
+                    word["start"] = token.t0 * 0.01;
+                    word["end"] = token.t1 * 0.01;
+                }
+                word["probability"] = token.p;
+                total_logprob += token.plog;
+                segment["words"].push_back(word);
+            }
+
+            segment["temperature"] = params.temperature;
+            segment["avg_logprob"] = total_logprob / n_tokens;
+
+            segment["no_speech_prob"] = seg.no_speech_prob;
+
+            // TODO compression_ratio is not implemented yet
+            // segment["compression_ratio"] = 0;
+
+            jres["segments"].push_back(segment);
+        }
+        res.set_content(jres.dump(-1, ' ', false, json::error_handler_t::replace),
+                        "application/json");
+    }
+    // TODO add more output formats
+    else
+    {
+        std::string results = output_str(result, params, pcmf32s);
+        json jres = json{
+            {"text", results}
+        };
+        res.set_content(jres.dump(-1, ' ', false, json::error_handler_t::replace),
+                        "application/json");
+    }
+}
+
+struct whisper_stream_user_data {
+    const whisper_params * params;
+
+    const std::vector<std::vector<float>> * pcmf32s;
+    DataSink * sink;
+};
+
+void stream_send_segment(DataSink & sink, const server_segment & seg, int id, const whisper_params & params, const std::vector<std::vector<float>> & pcmf32s) {
+    json segment = json{
+        {"id",   id},
+        {"text", seg.text},
+    };
+
+    if (!params.no_timestamps) {
+        segment["start"] = seg.t0 * 0.01;
+        segment["end"]   = seg.t1 * 0.01;
+    }
+
+    if (params.diarize && pcmf32s.size() == 2) {
+        segment["speaker"] = estimate_diarization_speaker(pcmf32s, seg.t0, seg.t1, true);
+    }
+
+    const std::string event = "data: " + segment.dump(-1, ' ', false, json::error_handler_t::replace) + "\n\n";
+    sink.write(event.data(), event.size());
+}
+
+// sends each new segment to the client as a Server-Sent Event
+void whisper_stream_segment_callback(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data) {
+    const auto & params  = *((whisper_stream_user_data *) user_data)->params;
+    const auto & pcmf32s = *((whisper_stream_user_data *) user_data)->pcmf32s;
+
+    auto & sink = *((whisper_stream_user_data *) user_data)->sink;
+
+    const int n_segments = whisper_full_n_segments_from_state(state);
+
+    for (int i = n_segments - n_new; i < n_segments; ++i) {
+        stream_send_segment(sink, result_segment_from_state(ctx, state, i), i, params, pcmf32s);
+    }
+}
+
+// cancels the processing of a request when its client disconnects
+struct server_abort_data {
+    std::function<bool()> is_connection_closed;
+
+    std::atomic<bool>    aborted{false};
+    std::atomic<int64_t> t_check_us{0};
+};
+
+// called before each graph node, so the connection is checked at most once per 10 ms
+bool server_abort_callback(void * user_data) {
+    auto & data = *(server_abort_data *) user_data;
+
+    if (data.aborted) {
+        return true;
+    }
+
+    const int64_t t_now_us = ggml_time_us();
+
+    int64_t t_check_us = data.t_check_us;
+    if (t_now_us - t_check_us < 10000 || !data.t_check_us.compare_exchange_strong(t_check_us, t_now_us)) {
+        return false;
+    }
+
+    if (data.is_connection_closed()) {
+        fprintf(stderr, "%s: client disconnected, aborting\n", __func__);
+        data.aborted = true;
+    }
+
+    return data.aborted;
+}
+
+// Prometheus histogram with fixed bucket upper bounds
+struct server_histogram {
+    std::vector<double>  bounds;
+    std::vector<int64_t> counts; // per bucket, the last one is +Inf
+
+    double  sum   = 0.0;
+    int64_t count = 0;
+
+    server_histogram(std::vector<double> bounds) : bounds(std::move(bounds)), counts(this->bounds.size() + 1, 0) {}
+};
+
+void histogram_observe(server_histogram & h, double v) {
+    h.counts[std::lower_bound(h.bounds.begin(), h.bounds.end(), v) - h.bounds.begin()]++;
+    h.sum += v;
+    h.count++;
+}
+
+// per-request stats - reported in the Server-Timing header and aggregated in /metrics
+struct server_request_stats {
+    int64_t t_start_us = 0;
+    int64_t t_wait_us  = 0;
+    double  audio_s    = 0.0;
+    bool    cached     = false;
+
+    whisper_timings timings = {}; // counters of the inference only
+};
+
+struct server_metrics {
+    std::mutex mutex;
+
+    int64_t n_requests = 0;
+    int64_t n_failed   = 0;
+    int64_t n_cached   = 0;
+    double  audio_s    = 0.0;
+
+    whisper_timings timings = {};
+
+    server_histogram latency { { 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0, 60.0, 120.0, 300.0 } };
+    server_histogram rtf     { { 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1.0, 2.0, 5.0 } };
+    server_histogram wait    { { 0.001, 0.01, 0.1, 0.5, 1.0, 5.0, 10.0, 30.0, 60.0 } };
+};
+
+// dst += sign*src for the counters - mem_compute and mem_kv are not counters and are left as is
+void timings_accumulate(whisper_timings & dst, const whisper_timings & src, int sign) {
+    dst.t_mel_us    += sign*src.t_mel_us;
+    dst.t_sample_us += sign*src.t_sample_us;
+    dst.t_encode_us += sign*src.t_encode_us;
+    dst.t_decode_us += sign*src.t_decode_us;
+    dst.t_batchd_us += sign*src.t_batchd_us;
+    dst.t_prompt_us += sign*src.t_prompt_us;
+
+    dst.n_sample += sign*src.n_sample;
+    dst.n_encode += sign*src.n_encode;
+    dst.n_decode += sign*src.n_decode;
+    dst.n_batchd += sign*src.n_batchd;
+    dst.n_prompt += sign*src.n_prompt;
+
+    dst.n_fail_p += sign*src.n_fail_p;
+    dst.n_fail_h += sign*src.n_fail_h;
+    dst.n_fail_r += sign*src.n_fail_r;
+    dst.n_skip_r += sign*src.n_skip_r;
+    dst.n_skip_s += sign*src.n_skip_s;
+
+    dst.n_dl_fallback += sign*src.n_dl_fallback;
+    dst.n_dl_decoders += sign*src.n_dl_decoders;
+    dst.n_dl_tokens   += sign*src.n_dl_tokens;
+    dst.n_dl_missed   += sign*src.n_dl_missed;
+
+    dst.t_graph_us   += sign*src.t_graph_us;
+    dst.t_compute_us += sign*src.t_compute_us;
+
+    dst.n_windows += sign*src.n_windows;
+    dst.n_tokens  += sign*src.n_tokens;
+
+    for (int i = 0; i < WHISPER_MAX_TEMPERATURES; ++i) {
+        dst.n_temp[i] += sign*src.n_temp[i];
+    }
+}
+
+// escapes a label value of the Prometheus text format
+std::string metrics_label_escape(const std::string & value) {
+    std::string result;
+    for (const char c : value) {
+        switch (c) {
+            case '\\': result += "\\\\"; break;
+            case '"':  result += "\\\""; break;
+            case '\n': result += "\\n";  break;
+            default:   result += c;
+        }
+    }
+
+    return result;
+}
+
+void metrics_record(server_metrics & metrics, const server_request_stats & stats, bool ok) {
+    const double t_total_s = 1e-6*(ggml_time_us() - stats.t_start_us);
+
+    std::lock_guard<std::mutex> lock(metrics.mutex);
+
+    metrics.n_requests++;
+    histogram_observe(metrics.latency, t_total_s);
+
+    if (!ok) {
+        metrics.n_failed++;
+        return;
+    }
+
+    metrics.audio_s += stats.audio_s;
+
+    if (stats.cached) {
+        metrics.n_cached++;
+        return;
+    }
+
+    histogram_observe(metrics.wait, 1e-6*stats.t_wait_us);
+    if (stats.audio_s > 0.0) {
+        histogram_observe(metrics.rtf, (t_total_s - 1e-6*stats.t_wait_us)/stats.audio_s);
+    }
+
+    timings_accumulate(metrics.timings, stats.timings, 1);
+}
+
+// the stage times of the request in the format of the Server-Timing header, in ms
+std::string request_stats_server_timing(const server_request_stats & stats) {
+    const double t_total_ms = 1e-3*(ggml_time_us() - stats.t_start_us);
+
+    char buf[512];
+    if (stats.cached) {
+        snprintf(buf, sizeof(buf), "cache;desc=hit, total;dur=%.2f", t_total_ms);
+    } else {
+        snprintf(buf, sizeof(buf), "wait;dur=%.2f, mel;dur=%.2f, encode;dur=%.2f, decode;dur=%.2f, batchd;dur=%.2f, prompt;dur=%.2f, sample;dur=%.2f, total;dur=%.2f",
+                1e-3*stats.t_wait_us,
+                1e-3*stats.timings.t_mel_us,
+                1e-3*stats.timings.t_encode_us,
+                1e-3*stats.timings.t_decode_us,
+                1e-3*stats.timings.t_batchd_us,
+                1e-3*stats.timings.t_prompt_us,
+                1e-3*stats.timings.t_sample_us,
+                t_total_ms);
+    }
+
+    return buf;
+}
+
+void metrics_write_histogram(std::stringstream & ss, const char * name, const char * help, const server_histogram & h) {
+    ss << "# HELP " << name << " " << help << "\n";
+    ss << "# TYPE " << name << " histogram\n";
+
+    int64_t n = 0;
+    for (size_t i = 0; i < h.bounds.size(); ++i) {
+        n += h.counts[i];
+        ss << name << "_bucket{le=\"" << h.bounds[i] << "\"} " << n << "\n";
+    }
+    ss << name << "_bucket{le=\"+Inf\"} " << h.count << "\n";
+    ss << name << "_sum "   << h.sum   << "\n";
+    ss << name << "_count " << h.count << "\n";
+}
+
+void metrics_write_counter(std::stringstream & ss, const char * name, const char * help, double v) {
+    ss << "# HELP " << name << " " << help << "\n";
+    ss << "# TYPE " << name << " counter\n";
+    ss << name << " " << v << "\n";
+}
+
+// samples the requests whose processing is traced
+struct server_tracer {
+    std::string dir; // empty - disabled
+    double rate = 1.0;
+
+    std::atomic<uint64_t> n_requests = { 0 };
+};
+
+// returns the path of the trace file for the request, or an empty string if it is not sampled
+// the sampling is deterministic: request i is traced when floor((i + 1)*rate) > floor(i*rate)
+std::string tracer_sample(server_tracer & tracer) {
+    if (tracer.dir.empty() || tracer.rate <= 0.0) {
+        return "";
+    }
+
+    const uint64_t i = tracer.n_requests.fetch_add(1);
+    if (uint64_t((i + 1)*tracer.rate) == uint64_t(i*tracer.rate)) {
+        return "";
+    }
+
+    return tracer.dir + "/trace-" + std::to_string(ggml_time_us()) + "-" + std::to_string(i) + ".json";
+}
+
+// traces the processing on the state while in scope - a no-op if fname is empty
+struct trace_guard {
+    whisper_state * state;
+    std::string fname;
+
+    trace_guard(whisper_state * state, std::string fname) : state(state), fname(std::move(fname)) {
+        if (!this->fname.empty()) {
+            whisper_trace_enable_with_state(state, true);
+        }
+    }
+
+    ~trace_guard() {
+        if (!fname.empty()) {
+            whisper_trace_enable_with_state(state, false);
+            whisper_trace_write_with_state(state, fname.c_str());
+        }
+    }
+};
+
+bool parse_str_to_bool(const std::string & s) {
+    if (s == "true" || s == "1" || s == "yes" || s == "y") {
+        return true;
+    }
+    return false;
+}
+
+void get_req_parameters(const Request & req, whisper_params & params)
+{
+    if (req.has_file("offset_t"))
+    {
+        params.offset_t_ms = std::stoi(req.get_file_value("offset_t").content);
+    }
+    if (req.has_file("offset_n"))
+    {
+        params.offset_n = std::stoi(req.get_file_value("offset_n").content);
+    }
+    if (req.has_file("duration"))
+    {
+        params.duration_ms = std::stoi(req.get_file_value("duration").content);
+    }
+    if (req.has_file("deadline_ms"))
+    {
+        params.deadline_ms = std::stoi(req.get_file_value("deadline_ms").content);
+    }
+    if (req.has_file("max_context"))
+    {
+        params.max_context = std::stoi(req.get_file_value("max_context").content);
+    }
+    if (req.has_file("max_len"))
+    {
+        params.max_len = std::stoi(req.get_file_value("max_len").content);
+    }
+    if (req.has_file("best_of"))
+    {
+        params.best_of = std::stoi(req.get_file_value("best_of").content);
+    }
+    if (req.has_file("beam_size"))
+    {
+        params.beam_size = std::stoi(req.get_file_value("beam_size").content);
+    }
+    if (req.has_file("audio_ctx"))
+    {
+        params.audio_ctx = std::stof(req.get_file_value("audio_ctx").content);
+    }
+    if (req.has_file("word_thold"))
+    {
+        params.word_thold = std::stof(req.get_file_value("word_thold").content);
+    }
+    if (req.has_file("entropy_thold"))
+    {
+        params.entropy_thold = std::stof(req.get_file_value("entropy_thold").content);
     }
     if (req.has_file("logprob_thold"))
     {
@@ -466,6 +1596,428 @@ void get_req_parameters(const Request & req, whisper_params & params)
     {
         params.temperature_inc = std::stof(req.get_file_value("temperature_inc").content);
     }
+    if (req.has_file("model"))
+    {
+        params.model = req.get_file_value("model").content;
+    }
+    if (req.has_file("stream"))
+    {
+        params.stream = parse_str_to_bool(req.get_file_value("stream").content);
+    }
+    if (req.has_file("step_ms"))
+    {
+        params.step_ms = std::stoi(req.get_file_value("step_ms").content);
+    }
+    if (req.has_file("length_ms"))
+    {
+        params.length_ms = std::stoi(req.get_file_value("length_ms").content);
+    }
+    if (req.has_file("keep_ms"))
+    {
+        params.keep_ms = std::stoi(req.get_file_value("keep_ms").content);
+    }
+    if (req.has_file("vad_thold"))
+    {
+        params.vad_thold = std::stof(req.get_file_value("vad_thold").content);
+    }
+}
+
+// runs whisper_full on the given state of the pool
+// segment_callback is optional and is called on each new segment instead of printing it
+// the processing is aborted as soon as abort_data reports that the client is gone
+// the counters of the state are snapshotted around the processing, their difference is returned in timings
+bool run_inference(
+        whisper_context * ctx,
+          whisper_state * state,
+         whisper_params & params,
+      const std::string & filename,
+    const std::vector<float> & pcmf32,
+    const std::vector<std::vector<float>> & pcmf32s,
+    whisper_new_segment_callback segment_callback,
+                   void * segment_callback_user_data,
+      server_abort_data & abort_data,
+        whisper_timings & timings) {
+    // the client may have given up while the request was queued
+    if (server_abort_callback(&abort_data)) {
+        return false;
+    }
+
+    // print system information
+    {
+        fprintf(stderr, "\n");
+        fprintf(stderr, "system_info: n_threads = %d / %d | %s\n",
+                params.n_threads, std::thread::hardware_concurrency(), whisper_print_system_info());
+    }
+
+    // print some info about the processing
+    {
+        fprintf(stderr, "\n");
+        if (!whisper_is_multilingual(ctx)) {
+            if (params.language != "en" || params.translate) {
+                params.language = "en";
+                params.translate = false;
+                fprintf(stderr, "%s: WARNING: model is not multilingual, ignoring language and translation options\n", __func__);
+            }
+        }
+        if (params.detect_language) {
+            params.language = "auto";
+        }
+        fprintf(stderr, "%s: processing '%s' (%d samples, %.1f sec), %d threads, lang = %s, task = %s, %stimestamps = %d ...\n",
+                __func__, filename.c_str(), int(pcmf32.size()), float(pcmf32.size())/WHISPER_SAMPLE_RATE,
+                params.n_threads,
+                params.language.c_str(),
+                params.translate ? "translate" : "transcribe",
+                params.tinydiarize ? "tdrz = 1, " : "",
+                params.no_timestamps ? 0 : 1);
+
+        fprintf(stderr, "\n");
+    }
+
+    // run the inference
+    {
+        printf("Running whisper.cpp inference on %s\n", filename.c_str());
+        whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+        wparams.strategy = params.beam_size > 1 ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY;
+
+        wparams.print_realtime   = false;
+        wparams.print_progress   = params.print_progress;
+        wparams.print_timestamps = !params.no_timestamps;
+        wparams.print_special    = params.print_special;
+        wparams.translate        = params.translate;
+        wparams.language         = params.language.c_str();
+        wparams.detect_language  = params.detect_language;
+        wparams.n_threads        = params.n_threads;
+        wparams.n_max_text_ctx   = params.max_context >= 0 ? params.max_context : wparams.n_max_text_ctx;
+        wparams.offset_ms        = params.offset_t_ms;
+        wparams.duration_ms      = params.duration_ms;
+        wparams.deadline_ms      = params.deadline_ms;
+
+        wparams.thold_pt         = params.word_thold;
+        wparams.max_len          = params.max_len == 0 ? 60 : params.max_len;
+        wparams.split_on_word    = params.split_on_word;
+        wparams.audio_ctx        = params.audio_ctx;
+
+        wparams.speed_up         = params.speed_up;
+        wparams.debug_mode       = params.debug_mode;
+
+        wparams.tdrz_enable      = params.tinydiarize; // [TDRZ]
+
+        wparams.initial_prompt   = params.prompt.c_str();
+
+        wparams.greedy.best_of        = params.best_of;
+        wparams.beam_search.beam_size = params.beam_size;
+
+        wparams.temperature      = params.temperature;
+        wparams.temperature_inc  = params.temperature_inc;
+        wparams.entropy_thold    = params.entropy_thold;
+        wparams.logprob_thold    = params.logprob_thold;
+
+        wparams.no_timestamps    = params.no_timestamps;
+        wparams.token_timestamps = !params.no_timestamps && params.response_format == vjson_format;
+
+        whisper_print_user_data user_data = { &params, &pcmf32s, 0 };
+
+        // this callback is called on each new segment
+        if (segment_callback) {
+            wparams.new_segment_callback           = segment_callback;
+            wparams.new_segment_callback_user_data = segment_callback_user_data;
+        } else if (params.print_realtime) {
+            wparams.new_segment_callback           = whisper_print_segment_callback;
+            wparams.new_segment_callback_user_data = &user_data;
+        }
+
+        if (wparams.print_progress) {
+            wparams.progress_callback           = whisper_print_progress_callback;
+            wparams.progress_callback_user_data = &user_data;
+        }
+
+        // the callback is called before every graph node - if it returns true, the computation is aborted
+        wparams.abort_callback           = server_abort_callback;
+        wparams.abort_callback_user_data = &abort_data;
+
+        const whisper_timings timings_before = whisper_get_timings_from_state(state);
+
+        const int ret = whisper_full_with_state(ctx, state, wparams, pcmf32.data(), pcmf32.size());
+
+        timings = whisper_get_timings_from_state(state);
+        timings_accumulate(timings, timings_before, -1);
+
+        if (ret != 0) {
+            if (abort_data.aborted) {
+                fprintf(stderr, "%s: aborted processing of '%s'\n", __func__, filename.c_str());
+            } else {
+                fprintf(stderr, "%s: failed to process audio\n", __func__);
+            }
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// a live transcription session - the client posts the audio as it is captured and gets back the new text
+// the audio is transcribed like in examples/stream: a sliding window of length_ms that is updated every step_ms,
+// or with step_ms <= 0, each utterance once the VAD detects its end
+// the sessions only hold a state of the model pool while they transcribe, so many of them can share a model
+struct server_stream_session {
+    std::mutex mutex;
+
+    std::string id;
+    whisper_params params;
+
+    std::shared_ptr<server_model> model;
+
+    std::vector<float> pcmf32_new; // audio received since the last step
+    std::vector<float> pcmf32_old; // audio of the last step, part of it is reused by the next one
+
+    int     n_iter       = 0;
+    int64_t n_consumed   = 0; // number of samples moved from pcmf32_new to a window
+    int64_t n_vad_check  = 0; // size of pcmf32_new at the last VAD check
+    int64_t i_line_start = 0; // sample at which the current line started
+
+    json line_partial; // the current line until it is finalized, null if there is none
+
+    int64_t t_used_us = 0;
+};
+
+struct server_stream_registry {
+    std::mutex mutex;
+
+    std::map<std::string, std::shared_ptr<server_stream_session>> sessions;
+
+    int64_t n_created = 0;
+    int64_t n_expired = 0;
+};
+
+std::string stream_session_id() {
+    static std::mutex mutex;
+    static std::mt19937_64 rng(std::random_device{}());
+
+    std::lock_guard<std::mutex> lock(mutex);
+    return to_hex(rng());
+}
+
+// drops the sessions that have not received audio for timeout_s seconds - a session that is transcribing is in use
+void stream_registry_expire(server_stream_registry & registry, int timeout_s) {
+    const int64_t t_now_us = ggml_time_us();
+
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    for (auto it = registry.sessions.begin(); it != registry.sessions.end(); ) {
+        std::unique_lock<std::mutex> lock_session(it->second->mutex, std::try_to_lock);
+
+        if (lock_session.owns_lock() && t_now_us - it->second->t_used_us > 1000000ll*timeout_s) {
+            lock_session.unlock();
+
+            fprintf(stderr, "%s: session %s expired\n", __func__, it->first.c_str());
+            it = registry.sessions.erase(it);
+            registry.n_expired++;
+        } else {
+            ++it;
+        }
+    }
+}
+
+// transcribes one window of the session on a state of the model pool
+bool stream_transcribe(
+        server_stream_session & session,
+    const std::vector<float> & pcmf32,
+                         bool   use_vad,
+            server_abort_data & abort_data,
+                server_result & result) {
+    const auto & params = session.params;
+
+    whisper_context * ctx = session.model->ctx;
+
+    const bool multilingual = whisper_is_multilingual(ctx);
+
+    whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+    wparams.print_progress   = false;
+    wparams.print_special    = false;
+    wparams.print_realtime   = false;
+    wparams.print_timestamps = false;
+    wparams.translate        = multilingual && params.translate;
+    wparams.language         = multilingual ? params.language.c_str() : "en";
+    wparams.n_threads        = params.n_threads;
+    wparams.audio_ctx        = params.audio_ctx;
+    wparams.single_segment   = !use_vad;
+    wparams.no_timestamps    = !use_vad;
+    wparams.max_tokens       = 0;
+
+    wparams.tdrz_enable      = params.tinydiarize; // [TDRZ]
+
+    wparams.temperature      = params.temperature;
+    wparams.temperature_inc  = params.no_fallback ? 0.0f : params.temperature_inc;
+    wparams.entropy_thold    = params.entropy_thold;
+    wparams.logprob_thold    = params.logprob_thold;
+
+    wparams.abort_callback           = server_abort_callback;
+    wparams.abort_callback_user_data = &abort_data;
+
+    int64_t t_wait_us = 0;
+    state_pool_guard guard = { session.model->pool, state_pool_acquire(session.model->pool, t_wait_us) };
+
+    if (whisper_full_with_state(ctx, guard.state, wparams, pcmf32.data(), pcmf32.size()) != 0) {
+        fprintf(stderr, "%s: session %s: failed to process audio\n", __func__, session.id.c_str());
+        return false;
+    }
+
+    result_from_state(ctx, guard.state, result);
+
+    return true;
+}
+
+json stream_line_json(const server_result & result, int64_t i0, int64_t i1, bool use_vad) {
+    std::string text;
+    for (const auto & segment : result.segments) {
+        text += segment.text;
+    }
+
+    json line = json{
+        {"start", double(i0)/WHISPER_SAMPLE_RATE},
+        {"end",   double(i1)/WHISPER_SAMPLE_RATE},
+        {"text",  text},
+    };
+
+    // with VAD the segments have timestamps relative to the utterance
+    if (use_vad) {
+        line["segments"] = json::array();
+        for (const auto & segment : result.segments) {
+            line["segments"].push_back(json{
+                {"start", double(i0)/WHISPER_SAMPLE_RATE + segment.t0*0.01},
+                {"end",   double(i0)/WHISPER_SAMPLE_RATE + segment.t1*0.01},
+                {"text",  segment.text},
+            });
+        }
+    }
+
+    return line;
+}
+
+// appends the audio to the session and transcribes the steps that are complete
+// with flush, the remaining audio is transcribed as well and the current line is finalized
+// the finalized lines are added to jres["final"] and the text of the current line to jres["partial"]
+bool stream_process(server_stream_session & session, const std::vector<float> & pcmf32_in, bool flush, server_abort_data & abort_data, json & jres) {
+    const auto & params = session.params;
+
+    const int n_samples_step = (1e-3*params.step_ms  )*WHISPER_SAMPLE_RATE;
+    const int n_samples_len  = (1e-3*params.length_ms)*WHISPER_SAMPLE_RATE;
+    const int n_samples_keep = (1e-3*params.keep_ms  )*WHISPER_SAMPLE_RATE;
+    const int n_samples_vad  = 2*WHISPER_SAMPLE_RATE;
+
+    const bool use_vad = n_samples_step <= 0;
+
+    const int n_new_line = !use_vad ? std::max(1, params.length_ms / params.step_ms - 1) : 1;
+
+    session.pcmf32_new.insert(session.pcmf32_new.end(), pcmf32_in.begin(), pcmf32_in.end());
+    session.t_used_us = ggml_time_us();
+
+    jres["final"] = json::array();
+
+    server_result result;
+
+    if (use_vad) {
+        while (true) {
+            const int n_new = session.pcmf32_new.size();
+
+            bool ready = flush ? n_new > 0 : n_new >= n_samples_len;
+
+            // check for the end of an utterance every 2 seconds of audio
+            if (!ready && n_new >= n_samples_vad && n_new - session.n_vad_check >= n_samples_vad) {
+                // vad_simple filters the audio in place
+                std::vector<float> pcmf32_vad(session.pcmf32_new.end() - n_samples_vad, session.pcmf32_new.end());
+
+                ready = ::vad_simple(pcmf32_vad, WHISPER_SAMPLE_RATE, 1000, params.vad_thold, params.freq_thold, false);
+                session.n_vad_check = n_new;
+            }
+
+            if (!ready) {
+                break;
+            }
+
+            const int n_take = std::min(n_new, n_samples_len);
+            const std::vector<float> pcmf32(session.pcmf32_new.begin(), session.pcmf32_new.begin() + n_take);
+
+            if (!stream_transcribe(session, pcmf32, use_vad, abort_data, result)) {
+                return false;
+            }
+
+            jres["final"].push_back(stream_line_json(result, session.n_consumed, session.n_consumed + n_take, use_vad));
+
+            session.pcmf32_new.erase(session.pcmf32_new.begin(), session.pcmf32_new.begin() + n_take);
+            session.n_consumed += n_take;
+            session.n_vad_check = 0;
+        }
+
+        return true;
+    }
+
+    while ((int) session.pcmf32_new.size() >= n_samples_step || (flush && !session.pcmf32_new.empty())) {
+        // if the client sends audio faster than it can be transcribed, the steps are merged
+        // up to a window length - older audio is dropped, like examples/stream does
+        int n_samples_new = session.pcmf32_new.size();
+        if (n_samples_new > n_samples_len) {
+            fprintf(stderr, "%s: session %s: cannot process audio fast enough, dropping %.1f sec\n", __func__,
+                    session.id.c_str(), float(n_samples_new - n_samples_len)/WHISPER_SAMPLE_RATE);
+
+            session.pcmf32_new.erase(session.pcmf32_new.begin(), session.pcmf32_new.end() - n_samples_len);
+            session.n_consumed  += n_samples_new - n_samples_len;
+            session.i_line_start = std::max(session.i_line_start, session.n_consumed);
+
+            n_samples_new = n_samples_len;
+        }
+
+        // take up to params.length_ms audio from previous iteration
+        const int n_samples_take = std::min((int) session.pcmf32_old.size(), std::max(0, n_samples_keep + n_samples_len - n_samples_new));
+
+        std::vector<float> pcmf32(n_samples_new + n_samples_take);
+
+        std::copy(session.pcmf32_old.end() - n_samples_take, session.pcmf32_old.end(), pcmf32.begin());
+        std::copy(session.pcmf32_new.begin(), session.pcmf32_new.end(), pcmf32.begin() + n_samples_take);
+
+        session.pcmf32_new.clear();
+        session.n_consumed += n_samples_new;
+
+        if (!stream_transcribe(session, pcmf32, use_vad, abort_data, result)) {
+            return false;
+        }
+
+        session.pcmf32_old = std::move(pcmf32);
+
+        ++session.n_iter;
+
+        const bool new_line = (session.n_iter % n_new_line) == 0 || (flush && session.pcmf32_new.empty());
+
+        json line = stream_line_json(result, session.i_line_start, session.n_consumed, use_vad);
+
+        if (new_line) {
+            jres["final"].push_back(line);
+
+            // keep part of the audio for next iteration to try to mitigate word boundary issues
+            const int n_keep = std::min((int) session.pcmf32_old.size(), n_samples_keep);
+            session.pcmf32_old = std::vector<float>(session.pcmf32_old.end() - n_keep, session.pcmf32_old.end());
+
+            session.i_line_start = session.n_consumed;
+            session.line_partial = nullptr;
+            jres.erase("partial");
+        } else {
+            session.line_partial = line;
+            jres["partial"] = line;
+        }
+    }
+
+    // a flush without new audio finalizes the line of the previous steps
+    if (flush && !session.line_partial.is_null()) {
+        jres["final"].push_back(session.line_partial);
+
+        session.i_line_start = session.n_consumed;
+        session.line_partial = nullptr;
+        jres.erase("partial");
+    }
+
+    return true;
 }
 
 }  // namespace
@@ -474,7 +2026,11 @@ int main(int argc, char ** argv) {
     whisper_params params;
     server_params sparams;
 
-    std::mutex whisper_mutex;
+    server_model_registry registry;
+    server_result_cache   cache;
+    server_stream_registry streams;
+    server_metrics         metrics;
+    server_tracer          tracer;
 
     if (whisper_params_parse(argc, argv, params, sparams) == false) {
         whisper_print_usage(argc, argv, params, sparams);
@@ -493,22 +2049,48 @@ int main(int argc, char ** argv) {
         exit(0);
     }
 
+    if (sparams.n_parallel < 1) {
+        fprintf(stderr, "error: --parallel must be at least 1\n");
+        whisper_print_usage(argc, argv, params, sparams);
+        exit(0);
+    }
+
+    // the requests are processed on states from the pool, so whisper_full_parallel() cannot be used
+    if (params.n_processors > 1) {
+        fprintf(stderr, "warning: --processors is not supported by the server, use --parallel to process requests in parallel\n");
+        params.n_processors = 1;
+    }
+
+    if (sparams.n_parallel*params.n_threads > (int) std::thread::hardware_concurrency()) {
+        fprintf(stderr, "warning: %d parallel requests x %d threads oversubscribe the %d hardware threads\n",
+                sparams.n_parallel, params.n_threads, std::thread::hardware_concurrency());
+    }
+
     if (sparams.ffmpeg_converter) {
         check_ffmpeg_availibility();
     }
     // whisper init
     struct whisper_context_params cparams = whisper_context_default_params();
-    cparams.use_gpu = params.use_gpu;
+    cparams.use_gpu  = params.use_gpu;
+    cparams.use_mmap = params.use_mmap;
 
-    struct whisper_context * ctx = whisper_init_from_file_with_params(params.model.c_str(), cparams);
+    registry.mem_budget = (size_t) sparams.models_mem_mb << 20;
 
-    if (ctx == nullptr) {
-        fprintf(stderr, "error: failed to initialize whisper context\n");
-        return 3;
-    }
+    cache.capacity = std::max(0, sparams.cache_size);
+    cache.dir      = sparams.cache_dir;
+
+    tracer.dir  = sparams.trace_dir;
+    tracer.rate = sparams.trace_rate;
 
-    // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
-    whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
+    {
+        auto model = model_load(params.model, cparams, params, sparams.n_parallel);
+        if (model == nullptr) {
+            fprintf(stderr, "error: failed to initialize whisper context\n");
+            return 3;
+        }
+
+        model_registry_add(registry, model, true);
+    }
 
     Server svr;
     svr.set_default_headers({{"Server", "whisper.cpp"},
@@ -553,6 +2135,18 @@ int main(int argc, char ** argv) {
     -F temperature_inc="0.2" \
     -F response_format="json"
         </pre>
+        <p>Add <code>-F stream="true"</code> to receive the segments as Server-Sent Events while they are decoded.</p>
+
+        <h2>/stream</h2>
+        <pre>
+    curl 127.0.0.1:)" + std::to_string(sparams.port) + R"(/stream -F step_ms="3000" -F length_ms="10000"
+    curl 127.0.0.1:)" + std::to_string(sparams.port) + R"(/stream/&lt;session&gt;?format=s16 \
+    -H "Content-Type: application/octet-stream" \
+    --data-binary "@&lt;pcm-file&gt;"
+    curl -X DELETE 127.0.0.1:)" + std::to_string(sparams.port) + R"(/stream/&lt;session&gt;
+        </pre>
+        <p>Creates a live transcription session, posts mono 16 kHz PCM to it as it is captured and gets back the
+        <code>partial</code> text of the current line and the <code>final</code> lines. <code>step_ms="0"</code> uses VAD.</p>
 
         <h2>/load</h2>
         <pre>
@@ -561,6 +2155,11 @@ int main(int argc, char ** argv) {
     -F model="&lt;path-to-model-file&gt;"
         </pre>
 
+        <h2>/status</h2>
+        <pre>
+    curl 127.0.0.1:)" + std::to_string(sparams.port) + R"(/status
+        </pre>
+
         <div>
             <h2>Try it out</h2>
             <form action="/inference" method="POST" enctype="multipart/form-data">
@@ -598,9 +2197,175 @@ int main(int argc, char ** argv) {
     svr.Options(sparams.request_path + "/inference", [&](const Request &, Response &){
     });
 
+    svr.Get(sparams.request_path + "/status", [&](const Request &, Response &res){
+        json jres = json{
+            {"models", json::array()},
+        };
+
+        std::lock_guard<std::mutex> lock_registry(registry.mutex);
+
+        jres["default"] = registry.path_default;
+
+        for (const auto & kv : registry.models) {
+            auto & pool = kv.second->pool;
+
+            std::lock_guard<std::mutex> lock(pool.mutex);
+
+            // all states of a model have compute buffers of the same size
+            const whisper_timings timings = whisper_get_timings_from_state(pool.states[0]);
+
+            jres["models"].push_back(json{
+                {"model",       kv.first},
+                {"mem_mb",      kv.second->mem_size >> 20},
+                {"model_mb",    kv.second->mem_model >> 20},
+                {"states_mb",   kv.second->mem_states >> 20},
+                {"compute_mb",  timings.mem_compute >> 20},
+                {"states",      pool.states.size()},
+                {"idle",        pool.idle.size()},
+                {"in_flight",   pool.n_in_flight},
+                {"queued",      pool.n_queued},
+                {"requests",    pool.n_requests},
+                {"wait_ms_avg", pool.n_requests > 0 ? 1e-3*pool.t_wait_us/pool.n_requests : 0.0},
+                {"wait_ms_max", 1e-3*pool.t_wait_max_us},
+            });
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(cache.mutex);
+
+            jres["cache"] = json{
+                {"entries",   cache.entries.size()},
+                {"capacity",  cache.capacity},
+                {"hits",      cache.n_hits},
+                {"hits_disk", cache.n_hits_disk},
+                {"misses",    cache.n_misses},
+                {"evictions", cache.n_evictions},
+            };
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(streams.mutex);
+
+            jres["streams"] = json{
+                {"active",  streams.sessions.size()},
+                {"created", streams.n_created},
+                {"expired", streams.n_expired},
+            };
+        }
+
+        res.set_content(jres.dump(), "application/json");
+    });
+
+    // Prometheus text exposition format
+    svr.Get(sparams.request_path + "/metrics", [&](const Request &, Response &res){
+        std::stringstream ss;
+
+        {
+            std::lock_guard<std::mutex> lock(metrics.mutex);
+
+            const auto & t = metrics.timings;
+
+            metrics_write_counter(ss, "whisper_requests_total",        "Number of /inference requests",                 metrics.n_requests);
+            metrics_write_counter(ss, "whisper_requests_failed_total", "Number of /inference requests that failed",     metrics.n_failed);
+            metrics_write_counter(ss, "whisper_requests_cached_total", "Number of /inference requests served from the cache", metrics.n_cached);
+            metrics_write_counter(ss, "whisper_audio_seconds_total",   "Seconds of audio transcribed",                  metrics.audio_s);
+
+            metrics_write_histogram(ss, "whisper_request_duration_seconds",   "Latency of the /inference requests",                  metrics.latency);
+            metrics_write_histogram(ss, "whisper_request_queue_wait_seconds", "Time the requests waited for a free state",          metrics.wait);
+            metrics_write_histogram(ss, "whisper_request_real_time_factor",   "Processing time over audio duration of the requests", metrics.rtf);
+
+            ss << "# HELP whisper_stage_seconds_total Time spent in each stage of the processing\n";
+            ss << "# TYPE whisper_stage_seconds_total counter\n";
+            ss << "whisper_stage_seconds_total{stage=\"mel\"} "    << 1e-6*t.t_mel_us    << "\n";
+            ss << "whisper_stage_seconds_total{stage=\"encode\"} " << 1e-6*t.t_encode_us << "\n";
+            ss << "whisper_stage_seconds_total{stage=\"decode\"} " << 1e-6*t.t_decode_us << "\n";
+            ss << "whisper_stage_seconds_total{stage=\"batchd\"} " << 1e-6*t.t_batchd_us << "\n";
+            ss << "whisper_stage_seconds_total{stage=\"prompt\"} " << 1e-6*t.t_prompt_us << "\n";
+            ss << "whisper_stage_seconds_total{stage=\"sample\"} " << 1e-6*t.t_sample_us << "\n";
+
+            metrics_write_counter(ss, "whisper_tokens_sampled_total", "Number of tokens sampled", t.n_sample);
+
+            ss << "# HELP whisper_fallbacks_total Number of temperature fallbacks by reason\n";
+            ss << "# TYPE whisper_fallbacks_total counter\n";
+            ss << "whisper_fallbacks_total{reason=\"logprob\"} "    << t.n_fail_p << "\n";
+            ss << "whisper_fallbacks_total{reason=\"entropy\"} "    << t.n_fail_h << "\n";
+            ss << "whisper_fallbacks_total{reason=\"repetition\"} " << t.n_fail_r << "\n";
+
+            metrics_write_counter(ss, "whisper_windows_skipped_total", "Number of windows skipped as no speech", t.n_skip_s);
+            metrics_write_counter(ss, "whisper_windows_total",         "Number of windows processed",            t.n_windows);
+            metrics_write_counter(ss, "whisper_tokens_generated_total", "Number of tokens in the results",       t.n_tokens);
+
+            ss << "# HELP whisper_windows_by_temperature_total Number of windows by the index of the temperature they were decoded at\n";
+            ss << "# TYPE whisper_windows_by_temperature_total counter\n";
+            for (int i = 0; i < WHISPER_MAX_TEMPERATURES; ++i) {
+                ss << "whisper_windows_by_temperature_total{index=\"" << i << "\"} " << t.n_temp[i] << "\n";
+            }
+
+            ss << "# HELP whisper_deadline_windows_total Number of windows degraded to meet the deadline by reason\n";
+            ss << "# TYPE whisper_deadline_windows_total counter\n";
+            ss << "whisper_deadline_windows_total{reason=\"no_fallback\"} "    << t.n_dl_fallback << "\n";
+            ss << "whisper_deadline_windows_total{reason=\"single_decoder\"} " << t.n_dl_decoders << "\n";
+            ss << "whisper_deadline_windows_total{reason=\"max_tokens\"} "     << t.n_dl_tokens   << "\n";
+            ss << "whisper_deadline_windows_total{reason=\"missed\"} "         << t.n_dl_missed   << "\n";
+
+            ss << "# HELP whisper_graph_seconds_total Time of the encoder and decoder graphs by phase\n";
+            ss << "# TYPE whisper_graph_seconds_total counter\n";
+            ss << "whisper_graph_seconds_total{phase=\"build\"} "   << 1e-6*t.t_graph_us   << "\n";
+            ss << "whisper_graph_seconds_total{phase=\"compute\"} " << 1e-6*t.t_compute_us << "\n";
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(cache.mutex);
+
+            metrics_write_counter(ss, "whisper_cache_hits_total",      "Number of result cache hits",      cache.n_hits);
+            metrics_write_counter(ss, "whisper_cache_misses_total",    "Number of result cache misses",    cache.n_misses);
+            metrics_write_counter(ss, "whisper_cache_evictions_total", "Number of result cache evictions", cache.n_evictions);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(streams.mutex);
+
+            ss << "# HELP whisper_stream_sessions Number of live transcription sessions\n";
+            ss << "# TYPE whisper_stream_sessions gauge\n";
+            ss << "whisper_stream_sessions " << streams.sessions.size() << "\n";
+        }
+
+        {
+            std::lock_guard<std::mutex> lock_registry(registry.mutex);
+
+            ss << "# HELP whisper_states Number of states of the model pools by status\n";
+            ss << "# TYPE whisper_states gauge\n";
+
+            for (const auto & kv : registry.models) {
+                auto & pool = kv.second->pool;
+
+                std::lock_guard<std::mutex> lock(pool.mutex);
+
+                ss << "whisper_states{model=\"" << metrics_label_escape(kv.first) << "\",status=\"active\"} " << pool.n_in_flight  << "\n";
+                ss << "whisper_states{model=\"" << metrics_label_escape(kv.first) << "\",status=\"idle\"} "   << pool.idle.size() << "\n";
+            }
+
+            ss << "# HELP whisper_requests_queued Number of requests waiting for a free state\n";
+            ss << "# TYPE whisper_requests_queued gauge\n";
+
+            for (const auto & kv : registry.models) {
+                auto & pool = kv.second->pool;
+
+                std::lock_guard<std::mutex> lock(pool.mutex);
+
+                ss << "whisper_requests_queued{model=\"" << metrics_label_escape(kv.first) << "\"} " << pool.n_queued << "\n";
+            }
+        }
+
+        res.set_content(ss.str(), "text/plain; version=0.0.4");
+    });
+
     svr.Post(sparams.request_path + "/inference", [&](const Request &req, Response &res){
-        // acquire whisper model mutex lock
-        std::lock_guard<std::mutex> lock(whisper_mutex);
+        // each request starts from the default params
+        whisper_params params = default_params;
+
+        server_request_stats stats;
+        stats.t_start_us = ggml_time_us();
 
         // first check user requested fields of the request
         if (!req.has_file("file"))
@@ -608,6 +2373,7 @@ int main(int argc, char ** argv) {
             fprintf(stderr, "error: no 'file' field in the request\n");
             const std::string error_resp = "{\"error\":\"no 'file' field in the request\"}";
             res.set_content(error_resp, "application/json");
+            metrics_record(metrics, stats, false);
             return;
         }
         auto audio_file = req.get_file_value("file");
@@ -622,283 +2388,313 @@ int main(int argc, char ** argv) {
         std::vector<float> pcmf32;               // mono-channel F32 PCM
         std::vector<std::vector<float>> pcmf32s; // stereo-channel F32 PCM
 
-        if (sparams.ffmpeg_converter) {
-            // if file is not wav, convert to wav
-            // write to temporary file
-            const std::string temp_filename = "whisper_server_temp_file.wav";
-            std::ofstream temp_file{temp_filename, std::ios::binary};
-            temp_file << audio_file.content;
-            temp_file.close();
-
-            std::string error_resp = "{\"error\":\"Failed to execute ffmpeg command.\"}";
-            const bool is_converted = convert_to_wav(temp_filename, error_resp);
-            if (!is_converted) {
+        {
+            std::string error_resp;
+            if (!decode_audio(audio_file.content, params.diarize, sparams.ffmpeg_converter, pcmf32, pcmf32s, error_resp)) {
+                fprintf(stderr, "error: failed to decode audio file '%s'\n", filename.c_str());
                 res.set_content(error_resp, "application/json");
+                metrics_record(metrics, stats, false);
                 return;
             }
+        }
 
-            // read wav content into pcmf32
-            if (!::read_wav(temp_filename, pcmf32, pcmf32s, params.diarize))
-            {
-                fprintf(stderr, "error: failed to read WAV file '%s'\n", temp_filename.c_str());
-                const std::string error_resp = "{\"error\":\"failed to read WAV file\"}";
-                res.set_content(error_resp, "application/json");
-                std::remove(temp_filename.c_str());
-                return;
-            }
-            // remove temp file
-            std::remove(temp_filename.c_str());
-        } else {
-            if (!::read_wav(audio_file.content, pcmf32, pcmf32s, params.diarize))
-            {
-                fprintf(stderr, "error: failed to read WAV file\n");
-                const std::string error_resp = "{\"error\":\"failed to read WAV file\"}";
+        printf("Successfully loaded %s\n", filename.c_str());
+
+        stats.audio_s = double(pcmf32.size())/WHISPER_SAMPLE_RATE;
+
+        std::string path_model;
+        if (req.has_file("model")) {
+            path_model = model_resolve(sparams, params.model);
+            if (path_model.empty()) {
+                fprintf(stderr, "error: 'model': %s is not in the model directory\n", params.model.c_str());
+                const std::string error_resp = "{\"error\":\"model not found in the model directory\"}";
                 res.set_content(error_resp, "application/json");
+                metrics_record(metrics, stats, false);
                 return;
             }
         }
 
+        // the model stays alive until the request is done, even if it is replaced or evicted in the meantime
+        auto model = model_registry_get(registry, path_model, cparams, default_params, sparams.n_parallel);
+        if (model == nullptr) {
+            const std::string error_resp = "{\"error\":\"failed to load model\"}";
+            res.set_content(error_resp, "application/json");
+            metrics_record(metrics, stats, false);
+            return;
+        }
 
-        printf("Successfully loaded %s\n", filename.c_str());
+        whisper_context * ctx = model->ctx;
 
-        // print system information
-        {
-            fprintf(stderr, "\n");
-            fprintf(stderr, "system_info: n_threads = %d / %d | %s\n",
-                    params.n_threads*params.n_processors, std::thread::hardware_concurrency(), whisper_print_system_info());
-        }
+        // repeated requests are served from the cache without running the inference
+        // results computed under a deadline may be degraded, so they are not cached
+        const std::string cache_key = result_cache_key(*model, params, pcmf32);
+        const bool cache_store = params.deadline_ms <= 0;
 
-        // print some info about the processing
-        {
-            fprintf(stderr, "\n");
-            if (!whisper_is_multilingual(ctx)) {
-                if (params.language != "en" || params.translate) {
-                    params.language = "en";
-                    params.translate = false;
-                    fprintf(stderr, "%s: WARNING: model is not multilingual, ignoring language and translation options\n", __func__);
-                }
-            }
-            if (params.detect_language) {
-                params.language = "auto";
-            }
-            fprintf(stderr, "%s: processing '%s' (%d samples, %.1f sec), %d threads, %d processors, lang = %s, task = %s, %stimestamps = %d ...\n",
-                    __func__, filename.c_str(), int(pcmf32.size()), float(pcmf32.size())/WHISPER_SAMPLE_RATE,
-                    params.n_threads, params.n_processors,
-                    params.language.c_str(),
-                    params.translate ? "translate" : "transcribe",
-                    params.tinydiarize ? "tdrz = 1, " : "",
-                    params.no_timestamps ? 0 : 1);
+        auto cached = result_cache_get(cache, cache_key);
+        if (cache.capacity > 0) {
+            res.set_header("X-Cache", cached ? "hit" : "miss");
+        }
 
-            fprintf(stderr, "\n");
+        const std::string fname_trace = cached ? "" : tracer_sample(tracer);
+        if (!fname_trace.empty()) {
+            res.set_header("X-Trace", fname_trace.substr(fname_trace.find_last_of('/') + 1));
         }
 
-        // run the inference
-        {
-            printf("Running whisper.cpp inference on %s\n", filename.c_str());
-            whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+        // stream the segments as Server-Sent Events while they are decoded
+        // httplib calls the content provider after this handler returns, so the inference runs from there
+        if (params.stream) {
+            struct stream_request {
+                whisper_params params;
+                std::string filename;
+                std::vector<float> pcmf32;
+                std::vector<std::vector<float>> pcmf32s;
+
+                // valid while the content provider runs - it is called before the request is done
+                std::function<bool()> is_connection_closed;
+            };
 
-            wparams.strategy = params.beam_size > 1 ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY;
+            auto sreq = std::make_shared<stream_request>();
+            sreq->params   = params;
+            sreq->filename = filename;
+            sreq->pcmf32   = std::move(pcmf32);
+            sreq->pcmf32s  = std::move(pcmf32s);
 
-            wparams.print_realtime   = false;
-            wparams.print_progress   = params.print_progress;
-            wparams.print_timestamps = !params.no_timestamps;
-            wparams.print_special    = params.print_special;
-            wparams.translate        = params.translate;
-            wparams.language         = params.language.c_str();
-            wparams.detect_language  = params.detect_language;
-            wparams.n_threads        = params.n_threads;
-            wparams.n_max_text_ctx   = params.max_context >= 0 ? params.max_context : wparams.n_max_text_ctx;
-            wparams.offset_ms        = params.offset_t_ms;
-            wparams.duration_ms      = params.duration_ms;
+            sreq->is_connection_closed = req.is_connection_closed;
 
-            wparams.thold_pt         = params.word_thold;
-            wparams.max_len          = params.max_len == 0 ? 60 : params.max_len;
-            wparams.split_on_word    = params.split_on_word;
-            wparams.audio_ctx        = params.audio_ctx;
+            res.set_chunked_content_provider("text/event-stream", [model, sreq, cached, cache_key, cache_store, fname_trace, stats, &cache, &metrics](size_t /*offset*/, DataSink & sink) mutable {
+                whisper_context * ctx = model->ctx;
 
-            wparams.speed_up         = params.speed_up;
-            wparams.debug_mode       = params.debug_mode;
+                if (cached) {
+                    stats.cached = true;
+                    metrics_record(metrics, stats, true);
 
-            wparams.tdrz_enable      = params.tinydiarize; // [TDRZ]
+                    for (int i = 0; i < (int) cached->segments.size(); ++i) {
+                        stream_send_segment(sink, cached->segments[i], i, sreq->params, sreq->pcmf32s);
+                    }
 
-            wparams.initial_prompt   = params.prompt.c_str();
+                    const std::string event = "data: [DONE]\n\n";
+                    sink.write(event.data(), event.size());
+                    sink.done();
 
-            wparams.greedy.best_of        = params.best_of;
-            wparams.beam_search.beam_size = params.beam_size;
+                    return true;
+                }
 
-            wparams.temperature      = params.temperature;
-            wparams.temperature_inc  = params.temperature_inc;
-            wparams.entropy_thold    = params.entropy_thold;
-            wparams.logprob_thold    = params.logprob_thold;
+                state_pool_guard guard = { model->pool, state_pool_acquire(model->pool, stats.t_wait_us) };
 
-            wparams.no_timestamps    = params.no_timestamps;
-            wparams.token_timestamps = !params.no_timestamps && params.response_format == vjson_format;
+                fprintf(stderr, "%s: waited %.1f ms for a free state\n", __func__, 1e-3*stats.t_wait_us);
 
-            whisper_print_user_data user_data = { &params, &pcmf32s, 0 };
+                whisper_stream_user_data user_data = { &sreq->params, &sreq->pcmf32s, &sink };
 
-            // this callback is called on each new segment
-            if (params.print_realtime) {
-                wparams.new_segment_callback           = whisper_print_segment_callback;
-                wparams.new_segment_callback_user_data = &user_data;
-            }
+                server_abort_data abort_data;
+                abort_data.is_connection_closed = sreq->is_connection_closed;
 
-            if (wparams.print_progress) {
-                wparams.progress_callback           = whisper_print_progress_callback;
-                wparams.progress_callback_user_data = &user_data;
-            }
+                std::string event = "data: [DONE]\n\n";
 
-            // examples for abort mechanism
-            // in examples below, we do not abort the processing, but we could if the flag is set to true
+                bool ok = false;
+                {
+                    trace_guard tguard(guard.state, fname_trace);
+                    ok = run_inference(ctx, guard.state, sreq->params, sreq->filename, sreq->pcmf32, sreq->pcmf32s,
+                            whisper_stream_segment_callback, &user_data, abort_data, stats.timings);
+                }
 
-            // the callback is called before every encoder run - if it returns false, the processing is aborted
-            {
-                static bool is_aborted = false; // NOTE: this should be atomic to avoid data race
+                if (!ok) {
+                    event = "event: error\ndata: {\"error\":\"failed to process audio\"}\n\n";
+                    metrics_record(metrics, stats, false);
+                } else {
+                    if (cache_store) {
+                        auto result = std::make_shared<server_result>();
+                        result_from_state(ctx, guard.state, *result);
+                        result_cache_put(cache, cache_key, result);
+                    }
+                    metrics_record(metrics, stats, true);
+                }
+                sink.write(event.data(), event.size());
+                sink.done();
 
-                wparams.encoder_begin_callback = [](struct whisper_context * /*ctx*/, struct whisper_state * /*state*/, void * user_data) {
-                    bool is_aborted = *(bool*)user_data;
-                    return !is_aborted;
-                };
-                wparams.encoder_begin_callback_user_data = &is_aborted;
-            }
+                return true;
+            });
 
-            // the callback is called before every computation - if it returns true, the computation is aborted
-            {
-                static bool is_aborted = false; // NOTE: this should be atomic to avoid data race
+            return;
+        }
+
+        if (cached) {
+            write_result(ctx, *cached, params, pcmf32, pcmf32s, res);
+
+            stats.cached = true;
+            res.set_header("Server-Timing", request_stats_server_timing(stats));
+            metrics_record(metrics, stats, true);
+            return;
+        }
+
+        auto result = std::make_shared<server_result>();
 
-                wparams.abort_callback = [](void * user_data) {
-                    bool is_aborted = *(bool*)user_data;
-                    return is_aborted;
-                };
-                wparams.abort_callback_user_data = &is_aborted;
+        {
+            // wait for a free state
+            state_pool_guard guard = { model->pool, state_pool_acquire(model->pool, stats.t_wait_us) };
+            whisper_state * state = guard.state;
+
+            fprintf(stderr, "%s: waited %.1f ms for a free state\n", __func__, 1e-3*stats.t_wait_us);
+
+            server_abort_data abort_data;
+            abort_data.is_connection_closed = req.is_connection_closed;
+
+            bool ok = false;
+            {
+                trace_guard tguard(state, fname_trace);
+                ok = run_inference(ctx, state, params, filename, pcmf32, pcmf32s, nullptr, nullptr, abort_data, stats.timings);
             }
 
-            if (whisper_full_parallel(ctx, wparams, pcmf32.data(), pcmf32.size(), params.n_processors) != 0) {
-                fprintf(stderr, "%s: failed to process audio\n", argv[0]);
+            if (!ok) {
                 const std::string error_resp = "{\"error\":\"failed to process audio\"}";
                 res.set_content(error_resp, "application/json");
+                metrics_record(metrics, stats, false);
                 return;
             }
+
+            result_from_state(ctx, state, *result);
+        }
+
+        if (cache_store) {
+            result_cache_put(cache, cache_key, result);
         }
 
         // return results to user
-        if (params.response_format == text_format)
-        {
-            std::string results = output_str(ctx, params, pcmf32s);
-            res.set_content(results.c_str(), "text/html");
+        write_result(ctx, *result, params, pcmf32, pcmf32s, res);
+
+        res.set_header("Server-Timing", request_stats_server_timing(stats));
+        metrics_record(metrics, stats, true);
+    });
+    // live transcription: create a session, post the audio to it as it is captured and delete it at the end
+    svr.Post(sparams.request_path + "/stream", [&](const Request &req, Response &res){
+        stream_registry_expire(streams, sparams.stream_timeout);
+
+        auto session = std::make_shared<server_stream_session>();
+
+        session->params = default_params;
+        get_req_parameters(req, session->params);
+
+        auto & params = session->params;
+        if (params.step_ms > 0) {
+            params.keep_ms   = std::min(params.keep_ms,   params.step_ms);
+            params.length_ms = std::max(params.length_ms, params.step_ms);
         }
-        else if (params.response_format == srt_format)
-        {
-            std::stringstream ss;
-            const int n_segments = whisper_full_n_segments(ctx);
-            for (int i = 0; i < n_segments; ++i) {
-                const char * text = whisper_full_get_segment_text(ctx, i);
-                const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-                const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
-                std::string speaker = "";
-
-                if (params.diarize && pcmf32s.size() == 2)
-                {
-                    speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
-                }
 
-                ss << i + 1 + params.offset_n << "\n";
-                ss << to_timestamp(t0, true) << " --> " << to_timestamp(t1, true) << "\n";
-                ss << speaker << text << "\n\n";
+        std::string path_model;
+        if (req.has_file("model")) {
+            path_model = model_resolve(sparams, params.model);
+            if (path_model.empty()) {
+                fprintf(stderr, "error: 'model': %s is not in the model directory\n", params.model.c_str());
+                const std::string error_resp = "{\"error\":\"model not found in the model directory\"}";
+                res.set_content(error_resp, "application/json");
+                return;
             }
-            res.set_content(ss.str(), "application/x-subrip");
-        } else if (params.response_format == vtt_format) {
-            std::stringstream ss;
+        }
+
+        session->model = model_registry_get(registry, path_model, cparams, default_params, sparams.n_parallel);
+        if (session->model == nullptr) {
+            const std::string error_resp = "{\"error\":\"failed to load model\"}";
+            res.set_content(error_resp, "application/json");
+            return;
+        }
 
-            ss << "WEBVTT\n\n";
+        session->id        = stream_session_id();
+        session->t_used_us = ggml_time_us();
 
-            const int n_segments = whisper_full_n_segments(ctx);
-            for (int i = 0; i < n_segments; ++i) {
-                const char * text = whisper_full_get_segment_text(ctx, i);
-                const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-                const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
-                std::string speaker = "";
+        {
+            std::lock_guard<std::mutex> lock(streams.mutex);
+            streams.sessions[session->id] = session;
+            streams.n_created++;
+        }
 
-                if (params.diarize && pcmf32s.size() == 2)
-                {
-                    speaker = estimate_diarization_speaker(pcmf32s, t0, t1, true);
-                    speaker.insert(0, "<v Speaker");
-                    speaker.append(">");
-                }
+        fprintf(stderr, "%s: created stream session %s (step = %d ms, length = %d ms, vad = %d)\n", __func__,
+                session->id.c_str(), params.step_ms, params.length_ms, params.step_ms <= 0);
+
+        json jres = json{
+            {"session",     session->id},
+            {"sample_rate", WHISPER_SAMPLE_RATE},
+            {"step_ms",     params.step_ms},
+            {"length_ms",   params.length_ms},
+            {"vad",         params.step_ms <= 0},
+        };
+        res.set_content(jres.dump(), "application/json");
+    });
 
-                ss << to_timestamp(t0) << " --> " << to_timestamp(t1) << "\n";
-                ss << speaker << text << "\n\n";
+    // the body is mono 16 kHz PCM - 32-bit float by default, or 16-bit signed with ?format=s16
+    // posting audio returns the new lines, deleting the session transcribes what is left of the audio
+    const auto stream_handler = [&](const Request &req, Response &res, bool flush) {
+        std::vector<float> pcmf32;
+
+        const std::string format = req.has_param("format") ? req.get_param_value("format") : "f32";
+        if (format == "s16") {
+            pcmf32.resize(req.body.size()/sizeof(int16_t));
+            for (size_t i = 0; i < pcmf32.size(); ++i) {
+                int16_t v;
+                memcpy(&v, req.body.data() + i*sizeof(int16_t), sizeof(int16_t));
+                pcmf32[i] = float(v)/32768.0f;
             }
-            res.set_content(ss.str(), "text/vtt");
-        } else if (params.response_format == vjson_format) {
-            /* try to match openai/whisper's Python format */
-            std::string results = output_str(ctx, params, pcmf32s);
-            json jres = json{
-                {"task", params.translate ? "translate" : "transcribe"},
-                {"language", whisper_lang_str_full(whisper_full_lang_id(ctx))},
-                {"duration", float(pcmf32.size())/WHISPER_SAMPLE_RATE},
-                {"text", results},
-                {"segments", json::array()}
-            };
-            const int n_segments = whisper_full_n_segments(ctx);
-            for (int i = 0; i < n_segments; ++i)
-            {
-                json segment = json{
-                    {"id", i},
-                    {"text", whisper_full_get_segment_text(ctx, i)},
-                };
+        } else if (format == "f32") {
+            pcmf32.resize(req.body.size()/sizeof(float));
+            memcpy(pcmf32.data(), req.body.data(), pcmf32.size()*sizeof(float));
+        } else {
+            const std::string error_resp = "{\"error\":\"unknown format, must be f32 or s16\"}";
+            res.set_content(error_resp, "application/json");
+            return;
+        }
 
-                if (!params.no_timestamps) {
-                    segment["start"] = whisper_full_get_segment_t0(ctx, i) * 0.01;
-                    segment["end"] = whisper_full_get_segment_t1(ctx, i) * 0.01;
-                }
+        stream_registry_expire(streams, sparams.stream_timeout);
 
-                float total_logprob = 0;
-                const int n_tokens = whisper_full_n_tokens(ctx, i);
-                for (int j = 0; j < n_tokens; ++j) {
-                    whisper_token_data token = whisper_full_get_token_data(ctx, i, j);
-                    if (token.id >= whisper_token_eot(ctx)) {
-                        continue;
-                    }
+        std::shared_ptr<server_stream_session> session;
 
-                    segment["tokens"].push_back(token.id);
-                    json word = json{{"word", whisper_full_get_token_text(ctx, i, j)}};
-                    if (!params.no_timestamps) {
-                        word["start"] = token.t0 * 0.01;
-                        word["end"] = token.t1 * 0.01;
-                    }
-                    word["probability"] = token.p;
-                    total_logprob += token.plog;
-                    segment["words"].push_back(word);
+        {
+            std::lock_guard<std::mutex> lock(streams.mutex);
+
+            auto it = streams.sessions.find(req.matches[1]);
+            if (it != streams.sessions.end()) {
+                session = it->second;
+                if (flush) {
+                    streams.sessions.erase(it);
                 }
+            }
+        }
+
+        if (session == nullptr) {
+            const std::string error_resp = "{\"error\":\"unknown session\"}";
+            res.set_content(error_resp, "application/json");
+            return;
+        }
 
-                segment["temperature"] = params.temperature;
-                segment["avg_logprob"] = total_logprob / n_tokens;
+        // the audio of a session is processed in order
+        std::lock_guard<std::mutex> lock(session->mutex);
 
-                // TODO compression_ratio and no_speech_prob are not implemented yet
-                // segment["compression_ratio"] = 0;
-                // segment["no_speech_prob"] = 0;
+        server_abort_data abort_data;
+        abort_data.is_connection_closed = req.is_connection_closed;
 
-                jres["segments"].push_back(segment);
-            }
-            res.set_content(jres.dump(-1, ' ', false, json::error_handler_t::replace),
-                            "application/json");
-        }
-        // TODO add more output formats
-        else
-        {
-            std::string results = output_str(ctx, params, pcmf32s);
-            json jres = json{
-                {"text", results}
-            };
-            res.set_content(jres.dump(-1, ' ', false, json::error_handler_t::replace),
-                            "application/json");
+        json jres = json{
+            {"session", session->id},
+        };
+
+        const bool ok = stream_process(*session, pcmf32, flush, abort_data, jres);
+
+        session->t_used_us = ggml_time_us();
+
+        if (!ok) {
+            const std::string error_resp = "{\"error\":\"failed to process audio\"}";
+            res.set_content(error_resp, "application/json");
+            return;
         }
 
-        // reset params to thier defaults
-        params = default_params;
+        res.set_content(jres.dump(-1, ' ', false, json::error_handler_t::replace), "application/json");
+    };
+
+    svr.Post(sparams.request_path + R"(/stream/([0-9a-f]+))", [&](const Request &req, Response &res){
+        stream_handler(req, res, false);
+    });
+
+    svr.Delete(sparams.request_path + R"(/stream/([0-9a-f]+))", [&](const Request &req, Response &res){
+        stream_handler(req, res, true);
     });
+
     svr.Post(sparams.request_path + "/load", [&](const Request &req, Response &res){
-        std::lock_guard<std::mutex> lock(whisper_mutex);
         if (!req.has_file("model"))
         {
             fprintf(stderr, "error: no 'model' field in the request\n");
@@ -906,34 +2702,29 @@ int main(int argc, char ** argv) {
             res.set_content(error_resp, "application/json");
             return;
         }
-        std::string model = req.get_file_value("model").content;
-        if (!is_file_exist(model.c_str()))
+        const std::string name  = req.get_file_value("model").content;
+        const std::string model = model_resolve(sparams, name);
+        if (model.empty())
         {
-            fprintf(stderr, "error: 'model': %s not found!\n", model.c_str());
-            const std::string error_resp = "{\"error\":\"model not found!\"}";
+            fprintf(stderr, "error: 'model': %s is not in the model directory\n", name.c_str());
+            const std::string error_resp = "{\"error\":\"model not found in the model directory\"}";
             res.set_content(error_resp, "application/json");
             return;
         }
 
-        // clean up
-        whisper_free(ctx);
-
-        // whisper init
-        ctx = whisper_init_from_file_with_params(model.c_str(), cparams);
-
-        // TODO perhaps load prior model here instead of exit
-        if (ctx == nullptr) {
-            fprintf(stderr, "error: model init  failed, no model loaded must exit\n");
-            exit(1);
+        // the other requests keep running while the model is loaded
+        auto model_new = model_load(model, cparams, default_params, sparams.n_parallel);
+        if (model_new == nullptr) {
+            const std::string error_resp = "{\"error\":\"failed to load model\"}";
+            res.set_content(error_resp, "application/json");
+            return;
         }
 
-        // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
-        whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
+        // swap it in as the default model - in-flight requests finish on the previous instance
+        model_registry_add(registry, model_new, true);
 
         const std::string success = "Load was successful!";
         res.set_content(success, "application/text");
-
-        // check if the model is in the file system
     });
 
     svr.set_exception_handler([](const Request &, Response &res, std::exception_ptr ep) {
@@ -981,8 +2772,11 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
-    whisper_print_timings(ctx);
-    whisper_free(ctx);
+    {
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        whisper_print_timings(registry.models[registry.path_default]->ctx);
+        registry.models.clear();
+    }
 
     return 0;
 }
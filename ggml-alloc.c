@@ -874,6 +874,23 @@ size_t ggml_gallocr_get_buffer_size(ggml_gallocr_t galloc, int buffer_id) {
     return ggml_backend_buffer_get_size(galloc->buffers[buffer_id]);
 }
 
+bool ggml_gallocr_reserve_size(ggml_gallocr_t galloc, int buffer_id, size_t size) {
+    GGML_ASSERT(buffer_id >= 0 && buffer_id < galloc->n_buffers);
+
+    size_t cur_size = galloc->buffers[buffer_id] ? ggml_backend_buffer_get_size(galloc->buffers[buffer_id]) : 0;
+
+    if (size > cur_size || galloc->buffers[buffer_id] == NULL) {
+        ggml_backend_buffer_free(galloc->buffers[buffer_id]);
+        galloc->buffers[buffer_id] = ggml_backend_buft_alloc_buffer(galloc->bufts[buffer_id], size);
+        if (galloc->buffers[buffer_id] == NULL) {
+            fprintf(stderr, "%s: failed to allocate %s buffer of size %zu\n", __func__, ggml_backend_buft_name(galloc->bufts[buffer_id]), size);
+            return false;
+        }
+    }
+
+    return true;
+}
+
 // utils
 
 static bool alloc_tensor_range(struct ggml_context * ctx,
@@ -66,6 +66,11 @@ GGML_API bool ggml_gallocr_alloc_graph(ggml_gallocr_t galloc, struct ggml_cgraph
 
 GGML_API size_t ggml_gallocr_get_buffer_size(ggml_gallocr_t galloc, int buffer_id);
 
+// pre-allocate a buffer with a known size, e.g. the size returned by ggml_gallocr_get_buffer_size for the same graphs
+// the graphs are then planned by ggml_gallocr_alloc_graph without measuring or reallocating the buffer
+// returns false if the buffer allocation failed
+GGML_API bool ggml_gallocr_reserve_size(ggml_gallocr_t galloc, int buffer_id, size_t size);
+
 // Utils
 // Create a buffer and allocate all the tensors in a ggml_context
 GGML_API struct ggml_backend_buffer * ggml_backend_alloc_ctx_tensors_from_buft(struct ggml_context * ctx, ggml_backend_buffer_type_t buft);
@@ -18255,12 +18255,6 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
     int task_phase = GGML_TASK_TYPE_FINALIZE;
 
     while (true) {
-        if (cplan->abort_callback && cplan->abort_callback(cplan->abort_callback_data)) {
-            state->shared->node_n += 1;
-            state->ec = GGML_STATUS_ABORTED;
-            return 0;
-        }
-
         if (atomic_fetch_sub(&state->shared->n_active, 1) == 1) {
             // all other threads are finished and spinning
             // do finalize and init here so we don't have synchronize again
@@ -18284,6 +18278,14 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
 
             // distribute new work or execute it direct if 1T
             while (++node_n < cgraph->n_nodes) {
+                // only the thread that finished the previous node checks for an abort - it is latched by moving
+                // node_n past the last node, so that all threads leave the graph at the same node boundary
+                if (cplan->abort_callback && cplan->abort_callback(cplan->abort_callback_data)) {
+                    node_n = cgraph->n_nodes;
+                    state->ec = GGML_STATUS_ABORTED;
+                    break;
+                }
+
                 GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, node_n, cgraph->n_nodes);
                 struct ggml_tensor * node = cgraph->nodes[node_n];
                 const int n_tasks = ggml_get_n_tasks(node, n_threads, state->shared->n_threads);
@@ -18294,6 +18296,8 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
                 params.nth = n_tasks;
 
                 if (n_tasks == 1) {
+                    const int64_t t_start_us = cplan->trace_callback ? ggml_time_us() : 0;
+
                     /* INIT */
                     if (GGML_OP_HAS_INIT[node->op]) {
                         params.type = GGML_TASK_TYPE_INIT;
@@ -18311,11 +18315,11 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
                     }
 
                     ggml_graph_compute_perf_stats_node(node, state->shared);
-                } else {
-                    break;
-                }
 
-                if (cplan->abort_callback && cplan->abort_callback(cplan->abort_callback_data)) {
+                    if (cplan->trace_callback) {
+                        cplan->trace_callback(node, state->ith, t_start_us, ggml_time_us(), cplan->trace_callback_data);
+                    }
+                } else {
                     break;
                 }
             }
@@ -18366,8 +18370,14 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
         }
 
         if (state->ith < n_tasks) {
+            const int64_t t_start_us = cplan->trace_callback ? ggml_time_us() : 0;
+
             params.type = GGML_TASK_TYPE_COMPUTE;
             ggml_compute_forward(&params, node);
+
+            if (cplan->trace_callback) {
+                cplan->trace_callback(node, state->ith, t_start_us, ggml_time_us(), cplan->trace_callback_data);
+            }
         }
 
         if (atomic_fetch_sub(&state->shared->n_active, 1) == 1) {
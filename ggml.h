@@ -601,6 +601,11 @@ extern "C" {
     // If it returns true, the computation is aborted
     typedef bool (*ggml_abort_callback)(void * data);
 
+    // Trace callback
+    // If not NULL, called by each thread after it has computed its share of a node
+    // t_start_us and t_end_us are from ggml_time_us()
+    typedef void (*ggml_trace_callback)(const struct ggml_tensor * node, int ith, int64_t t_start_us, int64_t t_end_us, void * data);
+
     // the compute plan that needs to be prepared for ggml_graph_compute()
     // since https://github.com/ggerganov/ggml/issues/287
     struct ggml_cplan {
@@ -612,6 +617,10 @@ extern "C" {
         // abort ggml_graph_compute when true
         ggml_abort_callback abort_callback;
         void *              abort_callback_data;
+
+        // record the compute time of each node
+        ggml_trace_callback trace_callback;
+        void *              trace_callback_data;
     };
 
     enum ggml_cgraph_eval_order {
@@ -0,0 +1,171 @@
+# Convert a whisper.cpp ggml model to the GGUF container
+#
+# Usage:
+#
+#   python3 models/convert-ggml-to-gguf.py models/ggml-base.en.bin models/ggml-base.en.gguf
+#
+# The GGUF file stores the same hparams, mel filters, vocab and tensors as the ggml file, but the metadata is a set of
+# key-value pairs followed by an index of the tensors, and the data of each tensor starts at an aligned offset. This
+# allows the weights to be memory-mapped and used in place, and the tensors to be loaded in parallel or selectively.
+#
+# whisper.cpp loads both formats. Quantize the ggml model first, then convert the result.
+#
+
+import os
+import sys
+import struct
+
+GGML_FILE_MAGIC = 0x67676d6c # "ggml"
+GGUF_MAGIC      = 0x46554747 # "GGUF"
+GGUF_VERSION    = 3
+
+GGUF_TYPE_UINT8   = 0
+GGUF_TYPE_UINT32  = 4
+GGUF_TYPE_INT32   = 5
+GGUF_TYPE_FLOAT32 = 6
+GGUF_TYPE_STRING  = 8
+GGUF_TYPE_ARRAY   = 9
+
+# ggml type -> (block size, bytes per block)
+GGML_TYPE_SIZE = {
+     0: (  1,   4), # f32
+     1: (  1,   2), # f16
+     2: ( 32,  18), # q4_0
+     3: ( 32,  20), # q4_1
+     6: ( 32,  22), # q5_0
+     7: ( 32,  24), # q5_1
+     8: ( 32,  34), # q8_0
+     9: ( 32,  36), # q8_1
+    10: (256,  84), # q2_K
+    11: (256, 110), # q3_K
+    12: (256, 144), # q4_K
+    13: (256, 176), # q5_K
+    14: (256, 210), # q6_K
+    15: (256, 292), # q8_K
+    16: (256,  66), # iq2_xxs
+    17: (256,  74), # iq2_xs
+    18: (256,  98), # iq3_xxs
+    19: (256,  50), # iq1_s
+    20: ( 32,  18), # iq4_nl
+    21: (256, 110), # iq3_s
+    22: (256,  82), # iq2_s
+    23: (256, 136), # iq4_xs
+    24: (  1,   1), # i8
+    25: (  1,   2), # i16
+    26: (  1,   4), # i32
+    29: (256,  56), # iq1_m
+}
+
+if len(sys.argv) < 3:
+    print("Usage: convert-ggml-to-gguf.py model.bin model.gguf [alignment]\n")
+    sys.exit(1)
+
+fname_inp = sys.argv[1]
+fname_out = sys.argv[2]
+alignment = int(sys.argv[3]) if len(sys.argv) > 3 else 32
+
+fin = open(fname_inp, "rb")
+
+def read_i32():
+    return struct.unpack("<i", fin.read(4))[0]
+
+if struct.unpack("<I", fin.read(4))[0] != GGML_FILE_MAGIC:
+    print("Error: '%s' is not a ggml model" % fname_inp)
+    sys.exit(1)
+
+hparams = {}
+for key in [ "whisper.vocab_size",
+             "whisper.audio.context_length", "whisper.audio.embedding_length", "whisper.audio.head_count", "whisper.audio.block_count",
+             "whisper.text.context_length",  "whisper.text.embedding_length",  "whisper.text.head_count",  "whisper.text.block_count",
+             "whisper.mel_count", "general.file_type" ]:
+    hparams[key] = read_i32()
+
+# mel filters
+n_mel = read_i32()
+n_fft = read_i32()
+filters = fin.read(4*n_mel*n_fft)
+
+# vocab - the tokens are raw bytes
+n_vocab = read_i32()
+tokens = []
+for i in range(n_vocab):
+    tokens.append(fin.read(read_i32()))
+
+# tensors - only the headers are kept, the data is copied from the input when writing
+tensors = []
+while True:
+    header = fin.read(12)
+    if len(header) < 12:
+        break
+
+    n_dims, length, ttype = struct.unpack("<iii", header)
+    ne = [ read_i32() for i in range(n_dims) ]
+    name = fin.read(length)
+
+    if ttype not in GGML_TYPE_SIZE:
+        print("Error: tensor '%s' has an unknown type %d" % (name.decode(), ttype))
+        sys.exit(1)
+
+    blck, size = GGML_TYPE_SIZE[ttype]
+
+    nelements = 1
+    for n in ne:
+        nelements *= n
+
+    nbytes = nelements//blck*size
+
+    tensors.append((name, ne, ttype, fin.tell(), nbytes))
+    fin.seek(nbytes, os.SEEK_CUR)
+
+def pad(n):
+    return (n + alignment - 1)//alignment*alignment
+
+def gguf_str(s):
+    return struct.pack("<Q", len(s)) + s
+
+def gguf_kv(key, vtype, value):
+    return gguf_str(key.encode()) + struct.pack("<I", vtype) + value
+
+def gguf_arr(atype, n, data):
+    return struct.pack("<IQ", atype, n) + data
+
+kv = []
+kv.append(gguf_kv("general.architecture", GGUF_TYPE_STRING, gguf_str(b"whisper")))
+kv.append(gguf_kv("general.alignment",    GGUF_TYPE_UINT32, struct.pack("<I", alignment)))
+for key, value in hparams.items():
+    kv.append(gguf_kv(key, GGUF_TYPE_INT32, struct.pack("<i", value)))
+kv.append(gguf_kv("whisper.mel_filters.n_mel", GGUF_TYPE_INT32, struct.pack("<i", n_mel)))
+kv.append(gguf_kv("whisper.mel_filters.n_fft", GGUF_TYPE_INT32, struct.pack("<i", n_fft)))
+kv.append(gguf_kv("whisper.mel_filters",       GGUF_TYPE_ARRAY, gguf_arr(GGUF_TYPE_FLOAT32, n_mel*n_fft, filters)))
+kv.append(gguf_kv("whisper.vocab.bytes",       GGUF_TYPE_ARRAY, gguf_arr(GGUF_TYPE_UINT8, sum(len(t) for t in tokens), b"".join(tokens))))
+kv.append(gguf_kv("whisper.vocab.lengths",     GGUF_TYPE_ARRAY, gguf_arr(GGUF_TYPE_INT32, n_vocab, b"".join(struct.pack("<i", len(t)) for t in tokens))))
+
+# tensor index - the offsets are relative to the start of the data
+infos = []
+offset = 0
+for name, ne, ttype, _, nbytes in tensors:
+    infos.append(gguf_str(name) + struct.pack("<I", len(ne)) + b"".join(struct.pack("<Q", n) for n in ne) + struct.pack("<IQ", ttype, offset))
+    offset = pad(offset + nbytes)
+
+fout = open(fname_out, "wb")
+
+fout.write(struct.pack("<IIQQ", GGUF_MAGIC, GGUF_VERSION, len(tensors), len(kv)))
+for x in kv:
+    fout.write(x)
+for x in infos:
+    fout.write(x)
+fout.write(b"\0"*(pad(fout.tell()) - fout.tell()))
+
+data_start = fout.tell()
+for name, ne, ttype, offs, nbytes in tensors:
+    fin.seek(offs)
+    fout.write(fin.read(nbytes))
+    fout.write(b"\0"*(pad(fout.tell() - data_start) - (fout.tell() - data_start)))
+
+    print("%48s - %s, type = %d" % (name.decode(), ne, ttype))
+
+fin.close()
+fout.close()
+
+print("Done. Output file: " + fname_out)
+print("")
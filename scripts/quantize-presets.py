@@ -0,0 +1,101 @@
+import os
+import subprocess
+import re
+import argparse
+
+# Quantize a model with the mixed-precision presets of the quantize tool and with uniform types, then transcribe an
+# audio file with each result and report the size, the speed and the word error rate against a reference transcript
+#
+# Usage:
+#
+#   python3 scripts/quantize-presets.py -m models/ggml-base.en.bin
+#   python3 scripts/quantize-presets.py -m models/ggml-base.en.bin -f audio.wav -r audio.txt -p q5_mix -u q5_0,q8_0
+#
+
+JFK_TRANSCRIPT = "And so my fellow Americans, ask not what your country can do for you, ask what you can do for your country."
+
+parser = argparse.ArgumentParser(description="Compare the quantization presets of a model")
+
+parser.add_argument("-m", "--model",      type=str, required=True,                  help="F16 or F32 model to quantize")
+parser.add_argument("-f", "--filename",   type=str, default="./samples/jfk.wav",    help="Audio file to transcribe (default: ./samples/jfk.wav)")
+parser.add_argument("-r", "--reference",  type=str, default="",                     help="Reference transcript file (default: the jfk.wav transcript)")
+parser.add_argument("-p", "--presets",    type=str, default="q4_mix,q5_mix,k4_mix,iq4_mix", help="Comma-separated presets")
+parser.add_argument("-u", "--uniform",    type=str, default="q4_0,q5_0,q8_0",       help="Comma-separated uniform types to compare with")
+parser.add_argument("-i", "--imatrix",    type=str, default="",                     help="imatrix file for the quantization")
+parser.add_argument("-t", "--threads",    type=int, default=4,                      help="Number of threads (default: 4)")
+parser.add_argument("-b", "--bin-dir",    type=str, default=".",                    help="Directory of the quantize and main binaries (default: .)")
+
+args = parser.parse_args()
+
+if args.reference:
+    with open(args.reference) as f:
+        reference = f.read()
+elif os.path.basename(args.filename) == "jfk.wav":
+    reference = JFK_TRANSCRIPT
+else:
+    parser.error("a reference transcript is required for '%s'" % args.filename)
+
+
+def words(text):
+    return re.sub(r"[^a-z0-9' ]", " ", text.lower()).split()
+
+
+# word error rate - the edit distance between the word sequences over the number of reference words
+def wer(ref, hyp):
+    ref = words(ref)
+    hyp = words(hyp)
+
+    d = list(range(len(hyp) + 1))
+    for i in range(1, len(ref) + 1):
+        prev, d[0] = d[0], i
+        for j in range(1, len(hyp) + 1):
+            cur = min(d[j] + 1, d[j - 1] + 1, prev + (ref[i - 1] != hyp[j - 1]))
+            prev, d[j] = d[j], cur
+
+    return d[len(hyp)] / max(1, len(ref))
+
+
+def transcribe(model):
+    cmd = [os.path.join(args.bin_dir, "main"), "-m", model, "-f", args.filename, "-t", str(args.threads), "-nt"]
+    res = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.PIPE, text=True)
+    if res.returncode != 0:
+        print(res.stderr)
+        raise RuntimeError("failed to run '%s'" % " ".join(cmd))
+
+    total_ms = float(re.search(r"total time\s*=\s*([\d.]+) ms", res.stderr).group(1))
+
+    return res.stdout, total_ms
+
+
+runs = [("f16", args.model)]
+
+base = os.path.splitext(args.model)[0]
+
+for kind, names in [("preset", args.presets), ("type", args.uniform)]:
+    for name in filter(None, names.split(",")):
+        fname = "%s-%s.bin" % (base, name)
+
+        cmd = [os.path.join(args.bin_dir, "quantize")]
+        if args.imatrix:
+            cmd += ["--imatrix", args.imatrix]
+        if kind == "preset":
+            cmd += ["--preset", name, args.model, fname]
+        else:
+            cmd += [args.model, fname, name]
+
+        print("Quantizing %s ..." % fname)
+        res = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+        if res.returncode != 0:
+            print(res.stdout)
+            raise RuntimeError("failed to run '%s'" % " ".join(cmd))
+
+        runs.append((name, fname))
+
+print("")
+print("| Model | Size (MB) | Total time (ms) | WER (%) |")
+print("| --- | --- | --- | --- |")
+
+for name, fname in runs:
+    text, total_ms = transcribe(fname)
+
+    print("| %s | %.1f | %.1f | %.2f |" % (name, os.path.getsize(fname) / 1024 / 1024, total_ms, 100 * wer(reference, text)))
@@ -0,0 +1,211 @@
+// test the early stop of decoders stuck in repetition loops
+//
+// the decoding loop of whisper_full is simulated token by token: a token is appended to the sequence, timestamps
+// update result_len and seek_delta, and whisper_sequence_check_loop decides if the decoder fails
+//
+// usage: test-decode-loop models/for-tests-ggml-tiny.en.bin - the vocab of the model is used to write the segments
+
+#include "whisper.cpp" // the decoding helpers are internal
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+static const whisper_token TOKEN_BEG = 50363;
+
+struct test_decoder {
+    whisper_sequence sequence = {};
+
+    int seek_delta = 0;
+    int n_skip     = 0; // steps saved when the decoder failed, 0 if it did not
+};
+
+// append tokens to the decoder until it fails or all of them are sampled - returns the index of the token after which
+// it failed, or -1
+static int test_decode(const whisper_full_params & params, test_decoder & decoder, const std::vector<whisper_token> & ids, int n_max) {
+    for (int i = 0; i < (int) ids.size(); ++i) {
+        whisper_token_data token = {};
+        token.id  = ids[i];
+        token.tid = std::max(ids[i], TOKEN_BEG);
+
+        decoder.sequence.tokens.push_back(token);
+
+        if (token.id > TOKEN_BEG) {
+            decoder.seek_delta = 2*(token.id - TOKEN_BEG);
+            decoder.sequence.result_len = i + 1;
+        }
+
+        decoder.n_skip = whisper_sequence_check_loop(params, decoder.sequence, TOKEN_BEG, i, n_max, params.max_tokens, decoder.seek_delta);
+        if (decoder.n_skip > 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static std::vector<whisper_token> test_text(int n, int first) {
+    std::vector<whisper_token> ids;
+    for (int i = 0; i < n; ++i) {
+        ids.push_back(first + i);
+    }
+
+    return ids;
+}
+
+static std::vector<whisper_token> test_loop(int n, const std::vector<whisper_token> & ngram) {
+    std::vector<whisper_token> ids;
+    for (int i = 0; i < n; ++i) {
+        ids.push_back(ngram[i % ngram.size()]);
+    }
+
+    return ids;
+}
+
+// few distinct tokens in no short period, e.g. a word repeated with varying punctuation
+static std::vector<whisper_token> test_mixed(int n) {
+    std::vector<whisper_token> ids;
+    for (int i = 0; i < n; ++i) {
+        ids.push_back(5 + (i*i/3 + i/7) % 3);
+    }
+
+    return ids;
+}
+
+static std::vector<whisper_token> operator+(std::vector<whisper_token> a, const std::vector<whisper_token> & b) {
+    a.insert(a.end(), b.begin(), b.end());
+    return a;
+}
+
+#define TEST_ASSERT(x) \
+    do { \
+        if (!(x)) { \
+            fprintf(stderr, "%s:%d: assertion failed: %s\n", __FILE__, __LINE__, #x); \
+            exit(1); \
+        } \
+    } while (0)
+
+// number of tokens in the segments of the results
+static int test_n_tokens(const whisper_state & state) {
+    int n_tokens = 0;
+    for (const auto & segment : state.result_all) {
+        n_tokens += segment.tokens.size();
+    }
+
+    return n_tokens;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s model.bin\n", argv[0]);
+        return 1;
+    }
+
+    whisper_context * ctx = whisper_init_from_file_with_params(argv[1], whisper_context_default_params());
+    TEST_ASSERT(ctx != nullptr);
+    TEST_ASSERT(whisper_token_beg(ctx) == TOKEN_BEG);
+
+    const int n_max = 220;
+
+    whisper_full_params params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+    // a loop right after a short segment: at n_max, seek_delta < half of the window fails the decoder
+    {
+        test_decoder decoder;
+
+        const int i_fail = test_decode(params, decoder, test_text(10, 100) + std::vector<whisper_token>{ TOKEN_BEG + 200 } + test_loop(100, { 7, 8, 9 }), n_max);
+
+        TEST_ASSERT(i_fail == 10 + 32);
+        TEST_ASSERT(decoder.n_skip == n_max - 1 - i_fail);
+
+        // at the last temperature the failed decoder is the result as it is - all of its tokens are written to the
+        // segments, not only the result_len tokens up to the last timestamp
+        TEST_ASSERT(decoder.sequence.result_len == 11);
+
+        ctx->state->result_all.clear();
+
+        const int n_tokens = whisper_full_add_segments(ctx, ctx->state, params, decoder.sequence.tokens, 0, decoder.seek_delta);
+
+        TEST_ASSERT(n_tokens == i_fail + 1);
+        TEST_ASSERT(n_tokens == test_n_tokens(*ctx->state));
+        TEST_ASSERT(ctx->state->result_all.size() == 2);
+    }
+
+    // the same at the last temperature without any timestamp, e.g. with no_timestamps - result_len stays 0
+    {
+        test_decoder decoder;
+
+        const int i_fail = test_decode(params, decoder, test_text(10, 100) + test_loop(100, { 7, 8, 9 }), n_max);
+
+        TEST_ASSERT(i_fail > 0);
+        TEST_ASSERT(decoder.sequence.result_len == 0);
+
+        ctx->state->result_all.clear();
+
+        const int n_tokens = whisper_full_add_segments(ctx, ctx->state, params, decoder.sequence.tokens, 0, 100*WHISPER_CHUNK_SIZE);
+
+        TEST_ASSERT(n_tokens == i_fail + 1);
+        TEST_ASSERT(n_tokens == test_n_tokens(*ctx->state));
+    }
+
+    // the same loop after a long segment: the decoder would end at n_max with the segment, so it continues and can
+    // recover - here a timestamp follows the loop
+    {
+        test_decoder decoder;
+
+        const int i_fail = test_decode(params, decoder,
+                test_text(40, 100) + std::vector<whisper_token>{ TOKEN_BEG + 1000 } + test_loop(60, { 7, 8, 9 }) + test_text(20, 200) + std::vector<whisper_token>{ TOKEN_BEG + 1400 }, n_max);
+
+        TEST_ASSERT(i_fail == -1);
+        TEST_ASSERT(decoder.sequence.result_len == 40 + 1 + 60 + 20 + 1);
+    }
+
+    // a loop of timestamped segments moves result_len and seek_delta, so it is left to the checks at the end
+    {
+        test_decoder decoder;
+
+        std::vector<whisper_token> ids;
+        for (int k = 0; k < 30; ++k) {
+            ids = ids + std::vector<whisper_token>{ 7, 8, TOKEN_BEG + 10 };
+        }
+
+        TEST_ASSERT(test_decode(params, decoder, ids, n_max) == -1);
+    }
+
+    // a loop after a segment that fails the entropy check fails at once
+    {
+        test_decoder decoder;
+
+        const int i_fail = test_decode(params, decoder, test_mixed(40) + std::vector<whisper_token>{ TOKEN_BEG + 1000 } + test_text(10, 100) + test_loop(40, { 7 }), n_max);
+
+        TEST_ASSERT(i_fail == 40 + 1 + 10 + 31);
+    }
+
+    // with max_tokens and no timestamps the result is the loop itself
+    {
+        params.max_tokens    = 100;
+        params.no_timestamps = true;
+
+        test_decoder decoder;
+
+        const int i_fail = test_decode(params, decoder, test_text(10, 100) + test_loop(100, { 7, 8 }), n_max);
+
+        TEST_ASSERT(i_fail == 10 + 32 - 1);
+        TEST_ASSERT(decoder.n_skip == params.max_tokens - i_fail);
+    }
+
+    // with max_tokens and timestamps the decoder completes with the segment
+    {
+        params.max_tokens    = 100;
+        params.no_timestamps = false;
+
+        test_decoder decoder;
+
+        TEST_ASSERT(test_decode(params, decoder, test_text(10, 100) + std::vector<whisper_token>{ TOKEN_BEG + 200 } + test_loop(80, { 7, 8 }), n_max) == -1);
+    }
+
+    whisper_free(ctx);
+
+    return 0;
+}
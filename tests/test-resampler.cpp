@@ -0,0 +1,92 @@
+// test the audio resampler of examples/common: the gain of tones in the pass band, the attenuation of tones above the
+// output Nyquist frequency (they must not alias into the pass band), and chunked processing
+
+#include "common.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#define TEST_ASSERT(x) \
+    do { \
+        if (!(x)) { \
+            fprintf(stderr, "%s:%d: assertion failed: %s\n", __FILE__, __LINE__, #x); \
+            exit(1); \
+        } \
+    } while (0)
+
+static std::vector<float> test_tone(int rate, double freq, double seconds) {
+    std::vector<float> pcm((size_t) (rate*seconds));
+    for (size_t i = 0; i < pcm.size(); ++i) {
+        pcm[i] = sin(2.0*M_PI*freq*i/rate);
+    }
+
+    return pcm;
+}
+
+// gain of a tone in dB, from the RMS of the output away from its edges
+static double test_gain_db(const std::vector<float> & out) {
+    const size_t n0 = out.size()/4;
+    const size_t n1 = out.size() - out.size()/4;
+
+    double sum = 0.0;
+    for (size_t i = n0; i < n1; ++i) {
+        sum += out[i]*out[i];
+    }
+
+    return 10.0*log10(2.0*sum/(n1 - n0) + 1e-30);
+}
+
+int main() {
+    const int rate_out = COMMON_SAMPLE_RATE;
+
+    for (const int rate_in : { 48000, 44100, 22050, 8000 }) {
+        const double nyquist = 0.5*std::min(rate_in, rate_out);
+
+        // length of the output
+        {
+            const auto out = resample_pcm(test_tone(rate_in, 1000.0, 1.0), rate_in, rate_out);
+            TEST_ASSERT(out.size() == (size_t) rate_out);
+        }
+
+        // pass band
+        for (const double freq : { 100.0, 1000.0, 0.8*nyquist }) {
+            const double gain = test_gain_db(resample_pcm(test_tone(rate_in, freq, 1.0), rate_in, rate_out));
+
+            printf("%5d Hz -> %5d Hz: %7.1f Hz, gain = %8.3f dB\n", rate_in, rate_out, freq, gain);
+            TEST_ASSERT(fabs(gain) < 0.05);
+        }
+
+        // stop band - only when decimating, the input has no content above its own Nyquist frequency
+        if (rate_in > rate_out) {
+            for (const double freq : { 1.02*nyquist, 1.1*nyquist, 1.5*nyquist, 0.45*rate_in }) {
+                const double gain = test_gain_db(resample_pcm(test_tone(rate_in, freq, 1.0), rate_in, rate_out));
+
+                printf("%5d Hz -> %5d Hz: %7.1f Hz, gain = %8.3f dB\n", rate_in, rate_out, freq, gain);
+                TEST_ASSERT(gain < -70.0);
+            }
+        }
+
+        // processing the input in chunks gives the same output
+        {
+            const auto pcm = test_tone(rate_in, 440.0, 1.0);
+            const auto ref = resample_pcm(pcm, rate_in, rate_out);
+
+            std::vector<float> out;
+
+            audio_resampler resampler(rate_in, rate_out);
+            for (size_t i = 0; i < pcm.size(); i += 1234) {
+                resampler.process(pcm.data() + i, std::min<size_t>(1234, pcm.size() - i), out);
+            }
+            resampler.flush(out);
+
+            TEST_ASSERT(out.size() == ref.size());
+            for (size_t i = 0; i < out.size(); ++i) {
+                TEST_ASSERT(fabs(out[i] - ref[i]) < 1e-5f);
+            }
+        }
+    }
+
+    return 0;
+}
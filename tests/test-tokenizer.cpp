@@ -0,0 +1,174 @@
+// test the tokenizer: the words of whisper_split_words must match the GPT-2 regex it replaces, and tokenize must find
+// the longest tokens of the vocab
+//
+// usage: test-tokenizer models/for-tests-ggml-tiny.en.bin
+
+#include "whisper.cpp" // the tokenizer is internal
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <regex>
+#include <string>
+#include <vector>
+
+#define TEST_ASSERT(x) \
+    do { \
+        if (!(x)) { \
+            fprintf(stderr, "%s:%d: assertion failed: %s\n", __FILE__, __LINE__, #x); \
+            exit(1); \
+        } \
+    } while (0)
+
+// the words of the regex that whisper_split_words replaces
+static std::vector<std::string> test_split_regex(const std::string & text) {
+    static const std::regex re(R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)");
+
+    std::vector<std::string> words;
+
+    std::string str = text;
+    std::smatch m;
+    while (std::regex_search(str, m, re)) {
+        words.push_back(m[0]);
+        str = m.suffix();
+    }
+
+    return words;
+}
+
+static std::vector<std::string> test_split(const std::string & text) {
+    std::vector<std::pair<size_t, size_t>> offs;
+    whisper_split_words(text, offs);
+
+    std::vector<std::string> words;
+    for (const auto & w : offs) {
+        words.push_back(text.substr(w.first, w.second));
+    }
+
+    return words;
+}
+
+static void test_split_compare(const std::string & text) {
+    const auto ref = test_split_regex(text);
+    const auto res = test_split(text);
+
+    if (ref != res) {
+        fprintf(stderr, "%s: mismatch for '%s':\n", __func__, text.c_str());
+        for (const auto & w : ref) {
+            fprintf(stderr, "  regex: '%s'\n", w.c_str());
+        }
+        for (const auto & w : res) {
+            fprintf(stderr, "  split: '%s'\n", w.c_str());
+        }
+    }
+
+    TEST_ASSERT(ref == res);
+}
+
+// the longest match found by looking up every prefix of the rest of the word, as tokenize did before the trie
+static std::vector<whisper_vocab::id> test_tokenize_ref(const whisper_vocab & vocab, const std::string & text) {
+    std::vector<whisper_vocab::id> tokens;
+    for (const auto & word : test_split_regex(text)) {
+        size_t i = 0;
+        while (i < word.size()) {
+            size_t j = word.size();
+            for (; j > i; --j) {
+                const whisper_vocab::id id = vocab.find(word.data() + i, j - i);
+                if (id >= 0) {
+                    tokens.push_back(id);
+                    break;
+                }
+            }
+            i = j > i ? j : i + 1;
+        }
+    }
+
+    return tokens;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s model.bin\n", argv[0]);
+        return 1;
+    }
+
+    // the splitting
+    {
+        const std::vector<std::string> texts = {
+            "",
+            "Hello world",
+            "And so my fellow Americans, ask not what your country can do for you.",
+            // contractions, and ' not followed by one
+            "it's don't we're they've I'm you'll he'd",
+            "'s't're've'm'll'd",
+            "'x 'S 'LL ' '' rock 'n' roll '",
+            "o'clock 'quoted' can''t",
+            // whitespace runs before a word, also tabs and newlines followed by a letter
+            "a  b   c    d",
+            "a\tb\nc\rd\ve\ff",
+            "a \tb \nc\t\td\n\ne",
+            "  \t\n  word",
+            "\nword\tword",
+            // trailing whitespace
+            "word ",
+            "word   ",
+            "word \t\n",
+            " ",
+            "\t",
+            // digits and punctuation
+            "1234 5,678.90 $12 3rd 2nd-place",
+            "hello!!! ...what?? (yes) [no] {maybe}",
+            " !x ?1 ,a",
+            // bytes 0x80-0xff
+            "caf\xc3\xa9 na\xc3\xafve \xe4\xbd\xa0\xe5\xa5\xbd \xf0\x9f\x98\x80",
+            "\x80\x81\xfe\xff a\xff b \xc3",
+            // control characters
+            "a\x01" "b\x1f" "c \x7f" "d \x1b[0m",
+            "\x01\x02 \x03",
+        };
+
+        for (const auto & text : texts) {
+            test_split_compare(text);
+        }
+
+        // random strings from the characters above
+        const std::string chars = "ab Z09'stdlmrev\t\n\r\v\f.,!?-\x01\x1f\x7f\x80\xc3\xa9\xff";
+
+        std::mt19937 rng(42);
+        for (int i = 0; i < 5000; ++i) {
+            std::string text(rng() % 24, ' ');
+            for (auto & c : text) {
+                c = chars[rng() % chars.size()];
+            }
+
+            test_split_compare(text);
+        }
+    }
+
+    whisper_context * ctx = whisper_init_from_file_with_params(argv[1], whisper_context_default_params());
+    TEST_ASSERT(ctx != nullptr);
+
+    const auto & vocab = ctx->vocab;
+
+    // the longest tokens - the ids of the GPT-2 vocab of the English models
+    {
+        TEST_ASSERT(tokenize(vocab, "Hello")                == std::vector<whisper_vocab::id>({ 15496 }));
+        TEST_ASSERT(tokenize(vocab, " Hello world")         == std::vector<whisper_vocab::id>({ 18435, 995 }));
+        TEST_ASSERT(tokenize(vocab, "it's the")             == std::vector<whisper_vocab::id>({ 270, 338, 262 }));
+
+        const std::vector<std::string> texts = {
+            " And so my fellow Americans, ask not what your country can do for you, ask what you can do for your country.",
+            " tokenization of unbelievably long words: antidisestablishmentarianism",
+            " caf\xc3\xa9 \xe4\xbd\xa0\xe5\xa5\xbd 1234567 !!!???",
+            "  \t\n trailing whitespace \n",
+        };
+
+        for (const auto & text : texts) {
+            TEST_ASSERT(tokenize(vocab, text) == test_tokenize_ref(vocab, text));
+        }
+    }
+
+    whisper_free(ctx);
+
+    return 0;
+}
@@ -27,6 +27,7 @@
 #include <atomic>
 #include <algorithm>
 #include <cassert>
+#include <cinttypes>
 #define _USE_MATH_DEFINES
 #include <cmath>
 #include <cstdio>
@@ -34,6 +35,8 @@
 #include <cstring>
 #include <fstream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <string>
 #include <thread>
@@ -46,6 +49,13 @@
 #pragma warning(disable: 4244 4267) // possible loss of data
 #endif
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #if defined(GGML_BIG_ENDIAN)
 #include <bit>
 
@@ -178,16 +188,48 @@ static bool ggml_graph_compute_helper(
 static bool ggml_graph_compute_helper(
        struct ggml_backend * backend,
         struct ggml_cgraph * graph,
-                       int   n_threads) {
+                       int   n_threads,
+       ggml_abort_callback   abort_callback,
+                      void * abort_callback_data,
+     whisper_eval_callback   eval_callback      = nullptr,
+                      void * eval_callback_data = nullptr) {
     if (ggml_backend_is_cpu(backend)) {
         ggml_backend_cpu_set_n_threads(backend, n_threads);
+
+        // checked by the compute threads before each node, so that an abort does not wait for the whole graph
+        ggml_backend_cpu_set_abort_callback(backend, abort_callback, abort_callback_data);
     }
 #ifdef GGML_USE_METAL
     if (ggml_backend_is_metal(backend)) {
         ggml_backend_metal_set_n_cb(backend, n_threads);
     }
 #endif
-    return ggml_backend_graph_compute(backend, graph) == GGML_STATUS_SUCCESS;
+
+    if (eval_callback == nullptr) {
+        return ggml_backend_graph_compute(backend, graph) == GGML_STATUS_SUCCESS;
+    }
+
+    // compute the graph up to each node that the callback wants to see, before the allocator reuses its inputs
+    for (int i0 = 0; i0 < graph->n_nodes; ) {
+        int  i1   = i0;
+        bool want = eval_callback(graph->nodes[i1], true, eval_callback_data);
+        while (!want && i1 + 1 < graph->n_nodes) {
+            want = eval_callback(graph->nodes[++i1], true, eval_callback_data);
+        }
+
+        struct ggml_cgraph view = ggml_graph_view(graph, i0, i1 + 1);
+        if (ggml_backend_graph_compute(backend, &view) != GGML_STATUS_SUCCESS) {
+            return false;
+        }
+
+        if (want && !eval_callback(graph->nodes[i1], false, eval_callback_data)) {
+            return false;
+        }
+
+        i0 = i1 + 1;
+    }
+
+    return true;
 }
 
 // faster matrix multiplications for tensors that do not have dimension 0 divisible by "pad"
@@ -401,8 +443,187 @@ struct whisper_vocab {
 
     int n_vocab = 51864;
 
-    std::map<token, id> token_to_id;
-    std::map<id, token> id_to_token;
+    // the text of all tokens in one buffer - token i starts at text_offs[i] and is followed by a 0, so that it can be
+    // returned as a C string (the tokens are raw bytes and may contain 0 themselves)
+    std::vector<char>     text;
+    std::vector<uint32_t> text_offs;
+    std::vector<uint32_t> text_len;
+
+    // open addressing hash table from the text of a token to its id, -1 - empty slot
+    std::vector<id> index;
+
+    // byte trie of the tokens, for the longest match in tokenize() - built on first use, since most uses of a model do
+    // not tokenize any text
+    // the children of a node are a list of siblings sorted by byte, the children of the root are in a table
+    struct trie_node {
+        id      token = -1;
+        int32_t child = -1;
+        int32_t next  = -1;
+        uint8_t byte  = 0;
+    };
+
+    mutable std::vector<trie_node> trie;
+    mutable int32_t trie_root[256];
+    mutable std::once_flag trie_once;
+
+    int size() const {
+        return (int) text_offs.size();
+    }
+
+    // appends the token with the next id
+    void add(const char * str, size_t len) {
+        text_offs.push_back(text.size());
+        text_len.push_back(len);
+
+        text.insert(text.end(), str, str + len);
+        text.push_back(0);
+    }
+
+    const char * str(id i) const {
+        return i >= 0 && i < size() ? text.data() + text_offs[i] : "";
+    }
+
+    std::string str_s(id i) const {
+        return i >= 0 && i < size() ? std::string(text.data() + text_offs[i], text_len[i]) : std::string();
+    }
+
+    static uint32_t hash(const char * str, size_t len) {
+        uint32_t h = 2166136261u; // FNV-1a
+        for (size_t i = 0; i < len; i++) {
+            h = (h ^ (uint8_t) str[i])*16777619u;
+        }
+        return h;
+    }
+
+    // must be called after the last token is added
+    void build_index() {
+        size_t n = 1;
+        while (n < 2*text_offs.size()) {
+            n *= 2;
+        }
+
+        index.assign(n, -1);
+
+        for (id i = 0; i < size(); i++) {
+            size_t k = hash(str(i), text_len[i]) & (n - 1);
+            while (index[k] >= 0 && (text_len[index[k]] != text_len[i] || memcmp(str(index[k]), str(i), text_len[i]) != 0)) {
+                k = (k + 1) & (n - 1);
+            }
+
+            // a duplicated token maps to its last id
+            index[k] = i;
+        }
+    }
+
+    void build_trie() const {
+        // insert the tokens in sorted order - the child on the path of a new token is then always the last one added
+        std::vector<id> order;
+        order.reserve(size());
+        for (id i = 0; i < size(); i++) {
+            if (text_len[i] > 0) {
+                order.push_back(i);
+            }
+        }
+
+        std::stable_sort(order.begin(), order.end(), [this](id a, id b) {
+            const int res = memcmp(str(a), str(b), std::min(text_len[a], text_len[b]));
+            return res != 0 ? res < 0 : text_len[a] < text_len[b];
+        });
+
+        std::vector<int32_t> last; // last child of each node
+
+        trie.clear();
+        trie.reserve(text.size());
+        last.reserve(text.size());
+        std::fill(trie_root, trie_root + 256, -1);
+
+        for (const id i : order) {
+            const uint8_t * s = (const uint8_t *) str(i);
+
+            int32_t node = -1;
+            for (uint32_t k = 0; k < text_len[i]; k++) {
+                int32_t child = node < 0 ? trie_root[s[k]] : last[node];
+
+                if (child < 0 || trie[child].byte != s[k]) {
+                    trie_node cur;
+                    cur.byte = s[k];
+
+                    const int32_t idx = trie.size();
+                    trie.push_back(cur);
+                    last.push_back(-1);
+
+                    if (node < 0) {
+                        trie_root[s[k]] = idx;
+                    } else if (last[node] < 0) {
+                        trie[node].child = idx;
+                    } else {
+                        trie[last[node]].next = idx;
+                    }
+                    if (node >= 0) {
+                        last[node] = idx;
+                    }
+
+                    child = idx;
+                }
+
+                node = child;
+            }
+
+            // a duplicated token maps to its last id
+            trie[node].token = i;
+        }
+    }
+
+    // the longest token that is a prefix of str, returns its length or 0 if there is none
+    size_t find_longest(const char * str, size_t len, id & res) const {
+        std::call_once(trie_once, [this]() { build_trie(); });
+
+        size_t n_best = 0;
+
+        int32_t node = len > 0 ? trie_root[(uint8_t) str[0]] : -1;
+        for (size_t k = 1; node >= 0; k++) {
+            if (trie[node].token >= 0) {
+                res    = trie[node].token;
+                n_best = k;
+            }
+
+            if (k == len) {
+                break;
+            }
+
+            const uint8_t c = str[k];
+
+            int32_t child = trie[node].child;
+            while (child >= 0 && trie[child].byte < c) {
+                child = trie[child].next;
+            }
+
+            node = child >= 0 && trie[child].byte == c ? child : -1;
+        }
+
+        return n_best;
+    }
+
+    // -1 if not found
+    id find(const char * str, size_t len) const {
+        if (index.empty()) {
+            return -1;
+        }
+
+        const size_t n = index.size();
+
+        for (size_t k = hash(str, len) & (n - 1); index[k] >= 0; k = (k + 1) & (n - 1)) {
+            if (text_len[index[k]] == len && memcmp(this->str(index[k]), str, len) == 0) {
+                return index[k];
+            }
+        }
+
+        return -1;
+    }
+
+    id find(const std::string & str) const {
+        return find(str.data(), str.size());
+    }
 
     // reference: https://github.com/openai/whisper/blob/248b6cb124225dd263bb9bd32d060b6517e067f8/whisper/tokenizer.py#L334-L349
     id token_eot        = 50256;
@@ -435,6 +656,8 @@ struct whisper_segment {
     std::vector<whisper_token_data> tokens;
 
     bool speaker_turn_next;
+
+    float no_speech_prob; // probability of the no-speech token in the window that produced the segment
 };
 
 struct whisper_batch {
@@ -506,21 +729,40 @@ struct whisper_pair {
 struct whisper_allocr {
     ggml_gallocr_t alloc = nullptr;
 
-    std::vector<uint8_t> meta;
+    // graph metadata - left uninitialized, ggml does not need it zeroed and touching all of it is most of the cost of
+    // a new state once the buffer sizes are known
+    std::unique_ptr<uint8_t[]> meta;
+    size_t                     meta_size = 0;
+};
+
+// compute buffer sizes of a state, 0 if not measured yet
+struct whisper_compute_sizes {
+    size_t alloc[2] = { 0, 0 };
 };
 
 static size_t whisper_allocr_size(struct whisper_allocr & allocr) {
-    return allocr.meta.size() + ggml_gallocr_get_buffer_size(allocr.alloc, 0);
+    return allocr.meta_size + ggml_gallocr_get_buffer_size(allocr.alloc, 0);
 }
 
-// measure the memory usage of a graph and prepare the allocr's internal data buffer
-static bool whisper_allocr_graph_init(struct whisper_allocr & allocr, ggml_backend_t backend, std::function<struct ggml_cgraph *()> && get_graph) {
+// measure the memory usage of a graph and grow the allocr's internal data buffer to fit it
+// if the size of the buffer is already known, it is allocated directly and the graph is not built
+static bool whisper_allocr_graph_init(struct whisper_allocr & allocr, ggml_backend_t backend, size_t size, std::function<struct ggml_cgraph *()> && get_graph) {
     auto & alloc = allocr.alloc;
-    auto & meta  = allocr.meta;
 
-    alloc = ggml_gallocr_new(ggml_backend_get_default_buffer_type(backend));
+    if (alloc == nullptr) {
+        alloc = ggml_gallocr_new(ggml_backend_get_default_buffer_type(backend));
 
-    meta.resize(ggml_tensor_overhead()*WHISPER_MAX_NODES + ggml_graph_overhead());
+        allocr.meta_size = ggml_tensor_overhead()*WHISPER_MAX_NODES + ggml_graph_overhead();
+        allocr.meta.reset(new uint8_t[allocr.meta_size]);
+    }
+
+    if (size > 0) {
+        if (!ggml_gallocr_reserve_size(alloc, 0, size)) {
+            WHISPER_LOG_ERROR("%s: failed to allocate the compute buffer\n", __func__);
+            return false;
+        }
+        return true;
+    }
 
     // since there are dependencies between the different graphs,
     // we need to allocate them instead of only reserving to get the correct compute buffer size
@@ -751,6 +993,9 @@ struct whisper_sequence {
     double avg_logprobs;     // the average log probability of the tokens
     double entropy;          // the entropy of the tokens
     double score;            // likelihood rank score
+
+    // rolling hashes of the token ids: hashes[k] is the hash of the first k tokens (used for repetition detection)
+    std::vector<uint64_t> hashes;
 };
 
 // TAGS: WHISPER_DECODER_INIT
@@ -786,6 +1031,29 @@ struct whisper_aheads_masks {
     ggml_backend_buffer_t buffer = nullptr;
 };
 
+// [EXPERIMENTAL] a stage of whisper_full() or a graph node computed by the CPU backend
+struct whisper_trace_event {
+    const char * name; // static string - the stage or the op of the node
+    const char * cat;  // "whisper" or "ggml"
+
+    int tid; // 0 for the stages, the ggml thread for the nodes
+
+    int64_t t_start_us;
+    int64_t t_end_us;
+
+    // nodes only
+    char      tensor[GGML_MAX_NAME];
+    int64_t   ne[GGML_MAX_DIMS];
+    ggml_type type;
+};
+
+struct whisper_trace {
+    bool enabled = false;
+
+    std::mutex mutex; // the nodes are recorded by the ggml threads
+    std::vector<whisper_trace_event> events;
+};
+
 struct whisper_state {
     int64_t t_sample_us = 0;
     int64_t t_encode_us = 0;
@@ -801,6 +1069,26 @@ struct whisper_state {
     int32_t n_prompt = 0; // number of decoder calls with n_tokens >  1  (prompt encoding)
     int32_t n_fail_p = 0; // number of logprob threshold failures
     int32_t n_fail_h = 0; // number of entropy threshold failures
+    int32_t n_fail_r = 0; // number of decoders stopped early due to a repetition loop
+    int32_t n_skip_r = 0; // number of decoding steps saved by stopping repetition loops early
+    int32_t n_skip_s = 0; // number of windows skipped as no speech
+
+    int64_t t_graph_us   = 0; // time to build and allocate the graphs
+    int64_t t_compute_us = 0; // time to compute the graphs
+
+    int32_t n_windows = 0; // number of windows processed
+    int32_t n_tokens  = 0; // number of tokens generated in the results
+
+    int32_t n_temp[WHISPER_MAX_TEMPERATURES] = {}; // number of windows decoded at the i-th temperature of the fallback
+
+    // decoding degraded to meet whisper_full_params.deadline_ms
+    int32_t n_dl_fallback = 0; // number of windows decoded without temperature fallback
+    int32_t n_dl_decoders = 0; // number of windows decoded with a single decoder instead of beam search / best-of
+    int32_t n_dl_tokens   = 0; // number of windows decoded with a reduced max_tokens
+    int32_t n_dl_missed   = 0; // number of windows started after the deadline has passed
+
+    // [EXPERIMENTAL] timeline of the processing, see whisper_trace_enable_with_state()
+    whisper_trace trace;
 
     // unified self-attention KV cache for all decoders
     whisper_kv_cache kv_self;
@@ -820,10 +1108,8 @@ struct whisper_state {
     // ggml-alloc:
     // - stores meta info about the intermediate tensors into the `meta` buffers
     // - stores the actual tensor data into the `data` buffers
-    whisper_allocr alloc_conv;
-    whisper_allocr alloc_encode;
-    whisper_allocr alloc_cross;
-    whisper_allocr alloc_decode;
+    // the conv, encode, cross and decode graphs share these, see whisper_state_allocr
+    whisper_allocr alloc[2];
 
     // result of the encoder
     struct ggml_tensor * embd_conv = nullptr;
@@ -836,6 +1122,9 @@ struct whisper_state {
     // decode output (2-dimensional array: [n_tokens][n_vocab])
     std::vector<float> logits;
 
+    // probability of the no-speech token at the SOT position of the current window
+    float no_speech_prob = 0.0f;
+
     std::vector<whisper_segment> result_all;
     std::vector<whisper_token>   prompt_past;
 
@@ -868,6 +1157,124 @@ struct whisper_state {
     int32_t exp_n_audio_ctx = 0; // 0 - use default
 };
 
+// a model file opened for random access, so that the tensors can be read in parallel or used in place
+// when mapped, the pages are shared with the page cache, so the processes that map the same model share one copy of
+// the weights
+struct whisper_file {
+    int    fd   = -1;
+    void * addr = nullptr; // the mapping of the file, if any
+    size_t size = 0;
+    size_t offs = 0;       // read position of the model loader
+
+    // the model loader reads the headers a few bytes at a time
+    std::vector<char> buf;
+    size_t buf_offs = 0;
+
+    whisper_file() = default;
+    whisper_file(const whisper_file &) = delete;
+    whisper_file & operator=(const whisper_file &) = delete;
+
+    bool open(const char * path, bool use_mmap) {
+#if defined(_POSIX_MAPPED_FILES)
+        fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            return false;
+        }
+
+        size = st.st_size;
+
+        if (use_mmap) {
+            void * res = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (res == MAP_FAILED) {
+                WHISPER_LOG_WARN("%s: failed to map '%s', reading it instead\n", __func__, path);
+            } else {
+                addr = res;
+            }
+        }
+
+        return true;
+#else
+        GGML_UNUSED(path);
+        GGML_UNUSED(use_mmap);
+        return false;
+#endif
+    }
+
+    // reads size bytes at the given offset - can be called from several threads
+    bool read_at(void * dst, size_t n, size_t offset) const {
+        if (offset + n > size) {
+            return false;
+        }
+
+        if (addr) {
+            memcpy(dst, (const char *) addr + offset, n);
+            return true;
+        }
+
+#if defined(_POSIX_MAPPED_FILES)
+        while (n > 0) {
+            const ssize_t res = pread(fd, dst, n, offset);
+            if (res <= 0) {
+                return false;
+            }
+
+            dst     = (char *) dst + res;
+            n      -= res;
+            offset += res;
+        }
+
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // sequential read at the position of the model loader
+    size_t read(void * dst, size_t n) {
+        n = std::min(n, size - offs);
+
+        const size_t buf_size = 1024*1024;
+
+        if (addr || n >= buf_size) {
+            if (!read_at(dst, n, offs)) {
+                return 0;
+            }
+        } else {
+            if (offs < buf_offs || offs + n > buf_offs + buf.size()) {
+                buf.resize(std::min(buf_size, size - offs));
+                buf_offs = offs;
+
+                if (!read_at(buf.data(), buf.size(), buf_offs)) {
+                    buf.clear();
+                    return 0;
+                }
+            }
+
+            memcpy(dst, buf.data() + (offs - buf_offs), n);
+        }
+
+        offs += n;
+
+        return n;
+    }
+
+    ~whisper_file() {
+#if defined(_POSIX_MAPPED_FILES)
+        if (addr) {
+            munmap(addr, size);
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+#endif
+    }
+};
+
 struct whisper_context {
     int64_t t_load_us  = 0;
     int64_t t_start_us = 0;
@@ -885,6 +1292,13 @@ struct whisper_context {
     ggml_backend_t backend = nullptr;
 
     std::string path_model; // populated by whisper_init_from_file_with_params()
+
+    std::unique_ptr<whisper_file> file; // the model file, while loading or when the weights are mapped
+
+    // compute buffer sizes measured by the first whisper_init_state - the next states are allocated with them instead
+    // of measuring the worst-case graphs again. [1] is for the states that use an external encoder
+    std::mutex            compute_mutex;
+    whisper_compute_sizes compute_sizes[2];
 };
 
 struct whisper_global {
@@ -1244,6 +1658,179 @@ static ggml_backend_t whisper_backend_init(const whisper_context_params & params
     return ggml_backend_cpu_init();
 }
 
+// GGUF container - the same data as the ggml file, with an index of the tensors and the tensor data aligned
+// see the convert-ggml-to-gguf.py script for details
+#define WHISPER_GGUF_MAGIC 0x46554747 // "GGUF"
+
+#define WHISPER_KV_FILE_TYPE       "general.file_type"
+#define WHISPER_KV_VOCAB_SIZE      "whisper.vocab_size"
+#define WHISPER_KV_AUDIO_CTX       "whisper.audio.context_length"
+#define WHISPER_KV_AUDIO_STATE     "whisper.audio.embedding_length"
+#define WHISPER_KV_AUDIO_HEAD      "whisper.audio.head_count"
+#define WHISPER_KV_AUDIO_LAYER     "whisper.audio.block_count"
+#define WHISPER_KV_TEXT_CTX        "whisper.text.context_length"
+#define WHISPER_KV_TEXT_STATE      "whisper.text.embedding_length"
+#define WHISPER_KV_TEXT_HEAD       "whisper.text.head_count"
+#define WHISPER_KV_TEXT_LAYER      "whisper.text.block_count"
+#define WHISPER_KV_N_MELS          "whisper.mel_count"
+#define WHISPER_KV_FILTERS_N_MEL   "whisper.mel_filters.n_mel"
+#define WHISPER_KV_FILTERS_N_FFT   "whisper.mel_filters.n_fft"
+#define WHISPER_KV_FILTERS         "whisper.mel_filters"
+#define WHISPER_KV_VOCAB_BYTES     "whisper.vocab.bytes"   // the tokens, concatenated - they are raw bytes and may contain 0
+#define WHISPER_KV_VOCAB_LENGTHS   "whisper.vocab.lengths" // the length of each token in bytes
+
+struct whisper_gguf {
+    gguf_context * ctx  = nullptr;
+    ggml_context * meta = nullptr; // shape and type of the tensors, without data
+
+    ~whisper_gguf() {
+        if (ctx) {
+            gguf_free(ctx);
+        }
+        if (meta) {
+            ggml_free(meta);
+        }
+    }
+};
+
+static bool whisper_gguf_get_i32(const gguf_context * ctx, const char * key, int32_t & dest) {
+    const int kid = gguf_find_key(ctx, key);
+    if (kid < 0 || gguf_get_kv_type(ctx, kid) != GGUF_TYPE_INT32) {
+        WHISPER_LOG_ERROR("%s: key '%s' not found or not an int32\n", __func__, key);
+        return false;
+    }
+
+    dest = gguf_get_val_i32(ctx, kid);
+
+    return true;
+}
+
+static bool whisper_gguf_get_arr(const gguf_context * ctx, const char * key, gguf_type type, const void * & data, int & n) {
+    const int kid = gguf_find_key(ctx, key);
+    if (kid < 0 || gguf_get_kv_type(ctx, kid) != GGUF_TYPE_ARRAY || gguf_get_arr_type(ctx, kid) != type) {
+        WHISPER_LOG_ERROR("%s: key '%s' not found or not an array of %s\n", __func__, key, gguf_type_name(type));
+        return false;
+    }
+
+    data = gguf_get_arr_data(ctx, kid);
+    n    = gguf_get_arr_n(ctx, kid);
+
+    return true;
+}
+
+// a range of a tensor to read from the model file
+struct whisper_load_task {
+    ggml_tensor * tensor;
+
+    size_t offs_file;
+    size_t offs_tensor;
+    size_t size;
+};
+
+// the big tensors are split, so that the threads get a similar amount of work
+static void whisper_load_task_add(std::vector<whisper_load_task> & tasks, ggml_tensor * tensor, size_t offs_file) {
+    const size_t chunk = 16*1024*1024;
+    const size_t size  = ggml_nbytes(tensor);
+
+    for (size_t offs = 0; offs < size; offs += chunk) {
+        tasks.push_back({ tensor, offs_file + offs, offs, std::min(chunk, size - offs) });
+    }
+}
+
+// reads the tensor data on a few threads - with a device buffer, each thread uploads what it has read, while the
+// others keep reading
+static bool whisper_load_tasks_run(const whisper_file & file, const std::vector<whisper_load_task> & tasks, ggml_backend_buffer_t buffer, int n_threads) {
+    const bool is_host = ggml_backend_buffer_is_host(buffer);
+
+    std::atomic<size_t> i_next(0);
+    std::atomic<bool>   ok(true);
+    std::mutex          mutex_upload;
+
+    auto worker = [&]() {
+        std::vector<char> read_buf;
+
+        for (size_t i = i_next++; i < tasks.size() && ok; i = i_next++) {
+            const auto & task = tasks[i];
+
+            if (is_host) {
+                if (!file.read_at((char *) task.tensor->data + task.offs_tensor, task.size, task.offs_file)) {
+                    ok = false;
+                }
+                continue;
+            }
+
+            read_buf.resize(task.size);
+            if (!file.read_at(read_buf.data(), task.size, task.offs_file)) {
+                ok = false;
+                continue;
+            }
+
+            // not all backends support concurrent uploads
+            std::lock_guard<std::mutex> lock(mutex_upload);
+            ggml_backend_tensor_set(task.tensor, read_buf.data(), task.offs_tensor, task.size);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n_threads; i++) {
+        workers.emplace_back(worker);
+    }
+    worker();
+
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    return ok;
+}
+
+// the weight matrices of a mixed-precision model can have other types than the one of the model (hparams.ftype), as
+// chosen for each tensor by the quantization policy - this changes the type of a tensor before it is allocated
+static bool whisper_tensor_set_type(ggml_tensor * tensor, ggml_type type) {
+    if (tensor->ne[0] % ggml_blck_size(type) != 0) {
+        return false;
+    }
+
+    tensor->type  = type;
+    tensor->nb[0] = ggml_type_size(type);
+    tensor->nb[1] = tensor->nb[0]*(tensor->ne[0]/ggml_blck_size(type));
+    for (int i = 2; i < GGML_MAX_DIMS; i++) {
+        tensor->nb[i] = tensor->nb[i - 1]*tensor->ne[i - 1];
+    }
+
+    return true;
+}
+
+// the names and types of the tensors of a ggml model file, from the first tensor header at offs
+static void whisper_file_scan_types(const whisper_file & file, size_t offs, std::map<std::string, ggml_type> & types) {
+    while (true) {
+        int32_t hdr[3]; // n_dims, length, ttype
+        if (!file.read_at(hdr, sizeof(hdr), offs)) {
+            break;
+        }
+
+        const int32_t n_dims = hdr[0];
+        const int32_t length = hdr[1];
+        const int32_t ttype  = hdr[2];
+
+        if (n_dims < 1 || n_dims > 4 || length <= 0 || length > 256 || ttype < 0 || ttype >= GGML_TYPE_COUNT || ggml_blck_size(ggml_type(ttype)) == 0) {
+            break;
+        }
+        offs += sizeof(hdr);
+
+        int32_t ne[4] = { 1, 1, 1, 1 };
+        std::string name(length, 0);
+        if (!file.read_at(ne, n_dims*sizeof(int32_t), offs) || !file.read_at(&name[0], length, offs + n_dims*sizeof(int32_t))) {
+            break;
+        }
+        offs += n_dims*sizeof(int32_t) + length;
+
+        types[name] = ggml_type(ttype);
+
+        offs += ggml_row_size(ggml_type(ttype), ne[0])*ne[1]*ne[2]*ne[3];
+    }
+}
+
 // load the model from a ggml file
 //
 // file format:
@@ -1255,6 +1842,9 @@ static ggml_backend_t whisper_backend_init(const whisper_context_params & params
 //
 // see the convert-pt-to-ggml.py script for details
 //
+// model files in the GGUF container are also accepted when loading from a file - they store the same data as
+// key-value pairs, followed by the tensors at aligned offsets
+//
 static bool whisper_model_load(struct whisper_model_loader * loader, whisper_context & wctx) {
     WHISPER_LOG_INFO("%s: loading model\n", __func__);
 
@@ -1265,11 +1855,29 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
     auto & model = wctx.model;
     auto & vocab = wctx.vocab;
 
+    whisper_gguf gguf;
+
     // verify magic
     {
         uint32_t magic;
         read_safe(loader, magic);
-        if (magic != GGML_FILE_MAGIC) {
+        if (magic == WHISPER_GGUF_MAGIC) {
+            if (wctx.path_model.empty()) {
+                WHISPER_LOG_ERROR("%s: GGUF models can only be loaded from a file\n", __func__);
+                return false;
+            }
+
+            gguf_init_params params = {
+                /*.no_alloc =*/ true,
+                /*.ctx      =*/ &gguf.meta,
+            };
+
+            gguf.ctx = gguf_init_from_file(wctx.path_model.c_str(), params);
+            if (!gguf.ctx) {
+                WHISPER_LOG_ERROR("%s: failed to read the GGUF header of '%s'\n", __func__, wctx.path_model.c_str());
+                return false;
+            }
+        } else if (magic != GGML_FILE_MAGIC) {
             WHISPER_LOG_ERROR("%s: invalid model data (bad magic)\n", __func__);
             return false;
         }
@@ -1279,17 +1887,33 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
     {
         auto & hparams = model.hparams;
 
-        read_safe(loader, hparams.n_vocab);
-        read_safe(loader, hparams.n_audio_ctx);
-        read_safe(loader, hparams.n_audio_state);
-        read_safe(loader, hparams.n_audio_head);
-        read_safe(loader, hparams.n_audio_layer);
-        read_safe(loader, hparams.n_text_ctx);
-        read_safe(loader, hparams.n_text_state);
-        read_safe(loader, hparams.n_text_head);
-        read_safe(loader, hparams.n_text_layer);
-        read_safe(loader, hparams.n_mels);
-        read_safe(loader, hparams.ftype);
+        if (gguf.ctx) {
+            if (!whisper_gguf_get_i32(gguf.ctx, WHISPER_KV_VOCAB_SIZE,  hparams.n_vocab)       ||
+                !whisper_gguf_get_i32(gguf.ctx, WHISPER_KV_AUDIO_CTX,   hparams.n_audio_ctx)   ||
+                !whisper_gguf_get_i32(gguf.ctx, WHISPER_KV_AUDIO_STATE, hparams.n_audio_state) ||
+                !whisper_gguf_get_i32(gguf.ctx, WHISPER_KV_AUDIO_HEAD,  hparams.n_audio_head)  ||
+                !whisper_gguf_get_i32(gguf.ctx, WHISPER_KV_AUDIO_LAYER, hparams.n_audio_layer) ||
+                !whisper_gguf_get_i32(gguf.ctx, WHISPER_KV_TEXT_CTX,    hparams.n_text_ctx)    ||
+                !whisper_gguf_get_i32(gguf.ctx, WHISPER_KV_TEXT_STATE,  hparams.n_text_state)  ||
+                !whisper_gguf_get_i32(gguf.ctx, WHISPER_KV_TEXT_HEAD,   hparams.n_text_head)   ||
+                !whisper_gguf_get_i32(gguf.ctx, WHISPER_KV_TEXT_LAYER,  hparams.n_text_layer)  ||
+                !whisper_gguf_get_i32(gguf.ctx, WHISPER_KV_N_MELS,      hparams.n_mels)        ||
+                !whisper_gguf_get_i32(gguf.ctx, WHISPER_KV_FILE_TYPE,   hparams.ftype)) {
+                return false;
+            }
+        } else {
+            read_safe(loader, hparams.n_vocab);
+            read_safe(loader, hparams.n_audio_ctx);
+            read_safe(loader, hparams.n_audio_state);
+            read_safe(loader, hparams.n_audio_head);
+            read_safe(loader, hparams.n_audio_layer);
+            read_safe(loader, hparams.n_text_ctx);
+            read_safe(loader, hparams.n_text_state);
+            read_safe(loader, hparams.n_text_head);
+            read_safe(loader, hparams.n_text_layer);
+            read_safe(loader, hparams.n_mels);
+            read_safe(loader, hparams.ftype);
+        }
 
         assert(hparams.n_text_state == hparams.n_audio_state);
 
@@ -1350,18 +1974,67 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
     {
         auto & filters = wctx.model.filters;
 
-        read_safe(loader, filters.n_mel);
-        read_safe(loader, filters.n_fft);
+        if (gguf.ctx) {
+            const void * data = nullptr;
+            int n = 0;
+
+            if (!whisper_gguf_get_i32(gguf.ctx, WHISPER_KV_FILTERS_N_MEL, filters.n_mel) ||
+                !whisper_gguf_get_i32(gguf.ctx, WHISPER_KV_FILTERS_N_FFT, filters.n_fft) ||
+                !whisper_gguf_get_arr(gguf.ctx, WHISPER_KV_FILTERS, GGUF_TYPE_FLOAT32, data, n)) {
+                return false;
+            }
 
-        filters.data.resize(filters.n_mel * filters.n_fft);
-        loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
-        BYTESWAP_FILTERS(filters);
+            if (n != filters.n_mel * filters.n_fft) {
+                WHISPER_LOG_ERROR("%s: invalid model (bad mel filters size %d != %d)\n", __func__, n, filters.n_mel * filters.n_fft);
+                return false;
+            }
+
+            filters.data.assign((const float *) data, (const float *) data + n);
+        } else {
+            read_safe(loader, filters.n_mel);
+            read_safe(loader, filters.n_fft);
+
+            filters.data.resize(filters.n_mel * filters.n_fft);
+            loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
+            BYTESWAP_FILTERS(filters);
+        }
     }
 
     // load vocab
     {
         int32_t n_vocab = 0;
-        read_safe(loader, n_vocab);
+
+        const char    * gguf_bytes   = nullptr;
+        const int32_t * gguf_lengths = nullptr;
+        size_t          gguf_offs    = 0;
+
+        if (gguf.ctx) {
+            const void * bytes   = nullptr;
+            const void * lengths = nullptr;
+            int n_bytes = 0;
+
+            if (!whisper_gguf_get_arr(gguf.ctx, WHISPER_KV_VOCAB_BYTES,   GGUF_TYPE_UINT8, bytes,   n_bytes) ||
+                !whisper_gguf_get_arr(gguf.ctx, WHISPER_KV_VOCAB_LENGTHS, GGUF_TYPE_INT32, lengths, n_vocab)) {
+                return false;
+            }
+
+            gguf_bytes   = (const char *)    bytes;
+            gguf_lengths = (const int32_t *) lengths;
+
+            size_t n_total = 0;
+            for (int i = 0; i < n_vocab; i++) {
+                n_total += gguf_lengths[i];
+            }
+
+            if (n_total != (size_t) n_bytes) {
+                WHISPER_LOG_ERROR("%s: invalid model (bad vocab size %zu != %d)\n", __func__, n_total, n_bytes);
+                return false;
+            }
+
+            vocab.text.reserve(n_total + n_vocab);
+        } else {
+            read_safe(loader, n_vocab);
+        }
 
         //if (n_vocab != model.hparams.n_vocab) {
         //    WHISPER_LOG_ERROR("%s: invalid model file '%s' (bad vocab size %d != %d)\n",
@@ -1374,24 +2047,29 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
 
         tmp.reserve(128);
 
+        vocab.text_offs.reserve(std::max(n_vocab, model.hparams.n_vocab));
+        vocab.text_len .reserve(std::max(n_vocab, model.hparams.n_vocab));
+
         for (int i = 0; i < n_vocab; i++) {
+            if (gguf.ctx) {
+                vocab.add(gguf_bytes + gguf_offs, gguf_lengths[i]);
+                gguf_offs += gguf_lengths[i];
+
+                continue;
+            }
+
             uint32_t len;
             read_safe(loader, len);
 
+            // seems like we have an empty-string token in multi-language models (i = 50256)
+            tmp.resize(len);
             if (len > 0) {
-                tmp.resize(len);
                 loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
-                word.assign(&tmp[0], tmp.size());
-            } else {
-                // seems like we have an empty-string token in multi-language models (i = 50256)
-                //WHISPER_LOG_WARN("%s: warning: empty-string token in vocab, i = %d\n", __func__, i);
-                word = "";
             }
 
-            vocab.token_to_id[word] = i;
-            vocab.id_to_token[i] = word;
+            vocab.add(tmp.data(), len);
 
-            //printf("%s: vocab[%d] = '%s'\n", __func__, i, word.c_str());
+            //printf("%s: vocab[%d] = '%s'\n", __func__, i, vocab.str(i));
         }
 
         vocab.n_vocab = model.hparams.n_vocab;
@@ -1439,11 +2117,12 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
                 } else {
                     word = "[_extra_token_" + std::to_string(i) + "]";
                 }
-                vocab.token_to_id[word] = i;
-                vocab.id_to_token[i] = word;
+                vocab.add(word.data(), word.size());
             }
         }
 
+        vocab.build_index();
+
         WHISPER_LOG_INFO("%s: n_langs       = %d\n", __func__, vocab.num_languages());
     }
 
@@ -1654,129 +2333,299 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
                 model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn_ln.weight"]    = layer.cross_attn_ln_0_w;
                 model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn_ln.bias"]      = layer.cross_attn_ln_0_b;
 
-                model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.query.weight"] = layer.cross_attn_q_w;
-                model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.query.bias"]   = layer.cross_attn_q_b;
+                model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.query.weight"] = layer.cross_attn_q_w;
+                model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.query.bias"]   = layer.cross_attn_q_b;
+
+                model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.key.weight"]   = layer.cross_attn_k_w;
+
+                model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.value.weight"] = layer.cross_attn_v_w;
+                model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.value.bias"]   = layer.cross_attn_v_b;
+
+                model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.out.weight"]   = layer.cross_attn_ln_1_w;
+                model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.out.bias"]     = layer.cross_attn_ln_1_b;
+            }
+        }
+
+        // so that the weights can be recognized in the compute graphs, e.g. by cb_eval
+        for (auto & t : model.tensors) {
+            ggml_set_name(t.second, t.first.c_str());
+        }
+    }
+
+    // mixed-precision models - the types of the weight matrices are read from the tensor headers before the allocation
+    // the loaders without random access need the headers in order, so their weight matrices must all have the same type
+    {
+        std::map<std::string, ggml_type> types;
+
+        if (gguf.ctx) {
+            for (ggml_tensor * meta = ggml_get_first_tensor(gguf.meta); meta; meta = ggml_get_next_tensor(gguf.meta, meta)) {
+                types[meta->name] = meta->type;
+            }
+        } else if (wctx.file) {
+            whisper_file_scan_types(*wctx.file, wctx.file->offs, types);
+        }
+
+        int n_mixed = 0;
+
+        for (const auto & it : types) {
+            const auto t = model.tensors.find(it.first);
+            if (t == model.tensors.end() || t->second->type == it.second) {
+                continue;
+            }
+
+            // other mismatches are reported when loading the tensor
+            if (t->second->type == wtype && ggml_n_dims(t->second) == 2 && whisper_tensor_set_type(t->second, it.second)) {
+                n_mixed++;
+            }
+        }
+
+        if (n_mixed > 0) {
+            WHISPER_LOG_INFO("%s: %d weight matrices do not have the type of the model (mixed precision)\n", __func__, n_mixed);
+        }
+    }
+
+    wctx.backend = whisper_backend_init(wctx.params);
+    if (!wctx.backend) {
+        WHISPER_LOG_ERROR("%s: failed to initialize the backend\n", __func__);
+        return false;
+    }
+
+    // with the CPU backend the tensors of a GGUF file point directly into the mapped file, the other backends need a
+    // copy - so does the legacy format, its tensor data is not aligned
+    // when loading from a file, the data is read in parallel once all the tensor headers are parsed
+#if defined(GGML_BIG_ENDIAN)
+    const bool use_mmap  = false;
+    const bool use_tasks = false;
+#else
+    const bool use_mmap  = wctx.file && wctx.file->addr && gguf.ctx && ggml_backend_is_cpu(wctx.backend) &&
+                           gguf_get_data_offset(gguf.ctx) % ggml_backend_get_alignment(wctx.backend) == 0 &&
+                           gguf_get_alignment(gguf.ctx)   % ggml_backend_get_alignment(wctx.backend) == 0;
+    const bool use_tasks = wctx.file && !use_mmap;
+#endif
+
+    std::vector<whisper_load_task> tasks;
+
+    // allocate tensors in the backend buffers
+    if (use_mmap) {
+        model.buffer = ggml_backend_cpu_buffer_from_ptr(wctx.file->addr, wctx.file->size);
+    } else {
+        model.buffer = ggml_backend_alloc_ctx_tensors(model.ctx, wctx.backend);
+    }
+    if (!model.buffer) {
+        WHISPER_LOG_ERROR("%s: failed to allocate memory for the model\n", __func__);
+        return false;
+    }
+
+    size_t size_main = ggml_backend_buffer_get_size(model.buffer);
+    WHISPER_LOG_INFO("%s: %8s total size = %8.2f MB%s\n", __func__, ggml_backend_name(wctx.backend), size_main / 1e6, use_mmap ? " (mmap)" : "");
+
+    // load weights
+    {
+        size_t total_size = 0;
+
+        model.n_loaded = 0;
+
+        std::vector<char> read_buf;
+
+        if (gguf.ctx) {
+            const int n_tensors = gguf_get_n_tensors(gguf.ctx);
+
+            // in the order of the data, so that the loader reads the file sequentially
+            std::vector<int> order(n_tensors);
+            for (int i = 0; i < n_tensors; i++) {
+                order[i] = i;
+            }
+            std::sort(order.begin(), order.end(), [&](int a, int b) {
+                return gguf_get_tensor_offset(gguf.ctx, a) < gguf_get_tensor_offset(gguf.ctx, b);
+            });
+
+            const size_t data_offset = gguf_get_data_offset(gguf.ctx);
+
+            size_t offs = sizeof(uint32_t); // the magic has been read
+
+            for (int i : order) {
+                const std::string name = gguf_get_tensor_name(gguf.ctx, i);
+
+                if (model.tensors.find(name) == model.tensors.end()) {
+                    WHISPER_LOG_ERROR("%s: unknown tensor '%s' in model file\n", __func__, name.c_str());
+                    return false;
+                }
+
+                auto tensor = model.tensors[name];
+
+                const ggml_tensor * meta = ggml_get_tensor(gguf.meta, name.c_str());
+
+                if (meta->type != tensor->type || !ggml_are_same_shape(meta, tensor)) {
+                    WHISPER_LOG_ERROR("%s: tensor '%s' has wrong type or shape in model file: got %s [%d, %d, %d], expected %s [%d, %d, %d]\n",
+                            __func__, name.c_str(),
+                            ggml_type_name(meta->type),   (int) meta->ne[0],   (int) meta->ne[1],   (int) meta->ne[2],
+                            ggml_type_name(tensor->type), (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2]);
+                    return false;
+                }
+
+                const size_t offs_tensor = data_offset + gguf_get_tensor_offset(gguf.ctx, i);
+
+                if (use_mmap) {
+                    if (tensor->data != nullptr || offs_tensor + ggml_nbytes(tensor) > wctx.file->size) {
+                        WHISPER_LOG_ERROR("%s: tensor '%s' is duplicated or truncated in model file\n", __func__, name.c_str());
+                        return false;
+                    }
+
+                    ggml_backend_tensor_alloc(model.buffer, tensor, (char *) wctx.file->addr + offs_tensor);
+                } else if (use_tasks) {
+                    whisper_load_task_add(tasks, tensor, offs_tensor);
+                } else {
+                    if (offs_tensor < offs) {
+                        WHISPER_LOG_ERROR("%s: tensor '%s' overlaps another tensor in model file\n", __func__, name.c_str());
+                        return false;
+                    }
+
+                    // skip the metadata and the alignment padding
+                    read_buf.resize(offs_tensor - offs);
+                    loader->read(loader->context, read_buf.data(), read_buf.size());
+
+                    if (ggml_backend_buffer_is_host(model.buffer)) {
+                        loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
+                    } else {
+                        read_buf.resize(ggml_nbytes(tensor));
+
+                        loader->read(loader->context, read_buf.data(), read_buf.size());
 
-                model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.key.weight"]   = layer.cross_attn_k_w;
+                        ggml_backend_tensor_set(tensor, read_buf.data(), 0, ggml_nbytes(tensor));
+                    }
 
-                model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.value.weight"] = layer.cross_attn_v_w;
-                model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.value.bias"]   = layer.cross_attn_v_b;
+                    offs = offs_tensor + ggml_nbytes(tensor);
+                }
 
-                model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.out.weight"]   = layer.cross_attn_ln_1_w;
-                model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.out.bias"]     = layer.cross_attn_ln_1_b;
+                total_size += ggml_nbytes(tensor);
+                model.n_loaded++;
             }
-        }
-    }
+        } else {
+            while (true) {
+                int32_t n_dims;
+                int32_t length;
+                int32_t ttype;
 
-    wctx.backend = whisper_backend_init(wctx.params);
-    if (!wctx.backend) {
-        WHISPER_LOG_ERROR("%s: failed to initialize the backend\n", __func__);
-        return false;
-    }
+                read_safe(loader, n_dims);
+                read_safe(loader, length);
+                read_safe(loader, ttype);
 
-    // allocate tensors in the backend buffers
-    model.buffer = ggml_backend_alloc_ctx_tensors(model.ctx, wctx.backend);
-    if (!model.buffer) {
-        WHISPER_LOG_ERROR("%s: failed to allocate memory for the model\n", __func__);
-        return false;
-    }
+                if (loader->eof(loader->context)) {
+                    break;
+                }
 
-    size_t size_main = ggml_backend_buffer_get_size(model.buffer);
-    WHISPER_LOG_INFO("%s: %8s total size = %8.2f MB\n", __func__, ggml_backend_name(wctx.backend), size_main / 1e6);
+                int32_t nelements = 1;
+                int32_t ne[4] = { 1, 1, 1, 1 };
+                for (int i = 0; i < n_dims; ++i) {
+                    read_safe(loader, ne[i]);
+                    nelements *= ne[i];
+                }
 
-    // load weights
-    {
-        size_t total_size = 0;
+                std::string name;
+                std::vector<char> tmp(length); // create a buffer
+                loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
+                name.assign(&tmp[0], tmp.size());
 
-        model.n_loaded = 0;
+                if (model.tensors.find(name) == model.tensors.end()) {
+                    WHISPER_LOG_ERROR("%s: unknown tensor '%s' in model file\n", __func__, name.data());
+                    return false;
+                }
 
-        std::vector<char> read_buf;
+                auto tensor = model.tensors[name.data()];
 
-        while (true) {
-            int32_t n_dims;
-            int32_t length;
-            int32_t ttype;
+                if (ggml_nelements(tensor) != nelements) {
+                    WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file\n", __func__, name.data());
+                    WHISPER_LOG_ERROR("%s: shape: [%d, %d, %d], expected: [%d, %d, %d]\n",
+                            __func__, ne[0], ne[1], ne[2], (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2]);
+                    return false;
+                }
 
-            read_safe(loader, n_dims);
-            read_safe(loader, length);
-            read_safe(loader, ttype);
+                if (tensor->ne[0] != ne[0] || tensor->ne[1] != ne[1] || tensor->ne[2] != ne[2]) {
+                    WHISPER_LOG_ERROR("%s: tensor '%s' has wrong shape in model file: got [%d, %d, %d], expected [%d, %d, %d]\n",
+                            __func__, name.data(), (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2], ne[0], ne[1], ne[2]);
+                    return false;
+                }
 
-            if (loader->eof(loader->context)) {
-                break;
-            }
+                if (tensor->type != ggml_type(ttype)) {
+                    WHISPER_LOG_ERROR("%s: tensor '%s' has type %s in model file, expected %s - mixed-precision models can only be loaded from a file\n",
+                            __func__, name.data(), ttype >= 0 && ttype < GGML_TYPE_COUNT ? ggml_type_name(ggml_type(ttype)) : "?", ggml_type_name(tensor->type));
+                    return false;
+                }
 
-            int32_t nelements = 1;
-            int32_t ne[4] = { 1, 1, 1, 1 };
-            for (int i = 0; i < n_dims; ++i) {
-                read_safe(loader, ne[i]);
-                nelements *= ne[i];
-            }
+                const size_t bpe = ggml_type_size(ggml_type(ttype));
 
-            std::string name;
-            std::vector<char> tmp(length); // create a buffer
-            loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
-            name.assign(&tmp[0], tmp.size());
+                if ((nelements*bpe)/ggml_blck_size(tensor->type) != ggml_nbytes(tensor)) {
+                    WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
+                            __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
+                    return false;
+                }
 
-            if (model.tensors.find(name) == model.tensors.end()) {
-                WHISPER_LOG_ERROR("%s: unknown tensor '%s' in model file\n", __func__, name.data());
-                return false;
-            }
+                //ggml_backend_t backend = wctx.backend;
 
-            auto tensor = model.tensors[name.data()];
+                //printf("%s: [%5.5s] %s\n", __func__, ggml_backend_name(backend), name.c_str());
 
-            if (ggml_nelements(tensor) != nelements) {
-                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file\n", __func__, name.data());
-                WHISPER_LOG_ERROR("%s: shape: [%d, %d, %d], expected: [%d, %d, %d]\n",
-                        __func__, ne[0], ne[1], ne[2], (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2]);
-                return false;
-            }
+                if (use_tasks) {
+                    // skip the data, it is read after the loop
+                    whisper_load_task_add(tasks, tensor, wctx.file->offs);
+                    wctx.file->offs += ggml_nbytes(tensor);
+                } else if (ggml_backend_buffer_is_host(model.buffer)) {
+                    // for the CPU and Metal backend, we can read directly into the tensor
+                    loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
+                    BYTESWAP_TENSOR(tensor);
+                } else {
+                    // read into a temporary buffer first, then copy to device memory
+                    read_buf.resize(ggml_nbytes(tensor));
 
-            if (tensor->ne[0] != ne[0] || tensor->ne[1] != ne[1] || tensor->ne[2] != ne[2]) {
-                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong shape in model file: got [%d, %d, %d], expected [%d, %d, %d]\n",
-                        __func__, name.data(), (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2], ne[0], ne[1], ne[2]);
-                return false;
-            }
+                    loader->read(loader->context, read_buf.data(), read_buf.size());
 
-            const size_t bpe = ggml_type_size(ggml_type(ttype));
+                    ggml_backend_tensor_set(tensor, read_buf.data(), 0, ggml_nbytes(tensor));
+                }
 
-            if ((nelements*bpe)/ggml_blck_size(tensor->type) != ggml_nbytes(tensor)) {
-                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
-                        __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
-                return false;
+                //printf("%48s - [%5d, %5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ne[2], ggml_type_name((ggml_type) ttype), ggml_nbytes(tensor)/1e6);
+                total_size += ggml_nbytes(tensor);
+                model.n_loaded++;
             }
+        }
 
-            //ggml_backend_t backend = wctx.backend;
-
-            //printf("%s: [%5.5s] %s\n", __func__, ggml_backend_name(backend), name.c_str());
-
-            if (ggml_backend_buffer_is_host(model.buffer)) {
-                // for the CPU and Metal backend, we can read directly into the tensor
-                loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
-                BYTESWAP_TENSOR(tensor);
-            } else {
-                // read into a temporary buffer first, then copy to device memory
-                read_buf.resize(ggml_nbytes(tensor));
+        if (!tasks.empty()) {
+            const int64_t t_start_read_us = ggml_time_us();
 
-                loader->read(loader->context, read_buf.data(), read_buf.size());
+            // the reads block on I/O, so a few threads help even with few cores
+            const int n_threads = std::min<size_t>(tasks.size(), std::min(8u, std::max(4u, std::thread::hardware_concurrency())));
 
-                ggml_backend_tensor_set(tensor, read_buf.data(), 0, ggml_nbytes(tensor));
+            if (!whisper_load_tasks_run(*wctx.file, tasks, model.buffer, n_threads)) {
+                WHISPER_LOG_ERROR("%s: failed to read the tensor data - the model file is truncated\n", __func__);
+                return false;
             }
 
-            //printf("%48s - [%5d, %5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ne[2], ggml_type_name((ggml_type) ttype), ggml_nbytes(tensor)/1e6);
-            total_size += ggml_nbytes(tensor);
-            model.n_loaded++;
+            WHISPER_LOG_INFO("%s: read %.2f MB in %.2f ms with %d threads\n", __func__, total_size/1e6, (ggml_time_us() - t_start_read_us)/1000.0, n_threads);
         }
 
         WHISPER_LOG_INFO("%s: model size    = %7.2f MB\n", __func__, total_size/1e6);
 
         if (model.n_loaded == 0) {
             WHISPER_LOG_WARN("%s: WARN no tensors loaded from model file - assuming empty model for testing\n", __func__);
+
+            if (use_mmap) {
+                // there is nothing to map - the tensors still need memory
+                ggml_backend_buffer_free(model.buffer);
+
+                model.buffer = ggml_backend_alloc_ctx_tensors(model.ctx, wctx.backend);
+                if (!model.buffer) {
+                    WHISPER_LOG_ERROR("%s: failed to allocate memory for the model\n", __func__);
+                    return false;
+                }
+            }
         } else if (model.n_loaded != (int) model.tensors.size()) {
             WHISPER_LOG_ERROR("%s: ERROR not all tensors loaded from model file - expected %zu, got %d\n", __func__, model.tensors.size(), model.n_loaded);
             return false;
         }
     }
 
+    if (!use_mmap || model.n_loaded == 0) {
+        wctx.file.reset();
+    }
+
     wctx.t_load_us = ggml_time_us() - t_start_us;
 
     return true;
@@ -1800,6 +2649,33 @@ static bool whisper_encode_external(const whisper_state & wstate) {
     return use_coreml || use_openvino;
 }
 
+enum whisper_graph_type {
+    WHISPER_GRAPH_CONV,
+    WHISPER_GRAPH_ENCODE,
+    WHISPER_GRAPH_CROSS,
+    WHISPER_GRAPH_DECODE,
+};
+
+// the graphs of a state never run at the same time, so they share two allocators instead of having one each, and the
+// compute memory is about the size of the largest graph instead of the sum. each graph reads the output of the previous
+// one, so it must use the other allocator:
+//   conv (0) -> encode (1) -> cross (0) -> decode (1)
+//   conv (0) ->     external -> cross (1) -> decode (1)
+static int whisper_state_allocr_id(const whisper_state & wstate, whisper_graph_type type) {
+    switch (type) {
+        case WHISPER_GRAPH_CONV:   return 0;
+        case WHISPER_GRAPH_ENCODE: return 1;
+        case WHISPER_GRAPH_CROSS:  return whisper_encode_external(wstate) ? 1 : 0;
+        case WHISPER_GRAPH_DECODE: return 1;
+    }
+
+    GGML_ASSERT(false);
+}
+
+static whisper_allocr & whisper_state_allocr(whisper_state & wstate, whisper_graph_type type) {
+    return wstate.alloc[whisper_state_allocr_id(wstate, type)];
+}
+
 static struct ggml_cgraph * whisper_build_graph_conv(
         whisper_context & wctx,
           whisper_state & wstate) {
@@ -1812,8 +2688,8 @@ static struct ggml_cgraph * whisper_build_graph_conv(
     const int n_mels = hparams.n_mels;
 
     struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.alloc_conv.meta.size(),
-        /*.mem_buffer =*/ wstate.alloc_conv.meta.data(),
+        /*.mem_size   =*/ whisper_state_allocr(wstate, WHISPER_GRAPH_CONV).meta_size,
+        /*.mem_buffer =*/ whisper_state_allocr(wstate, WHISPER_GRAPH_CONV).meta.get(),
         /*.no_alloc   =*/ true,
     };
 
@@ -1873,8 +2749,8 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
     const int n_layer = hparams.n_audio_layer;
 
     struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.alloc_encode.meta.size(),
-        /*.mem_buffer =*/ wstate.alloc_encode.meta.data(),
+        /*.mem_size   =*/ whisper_state_allocr(wstate, WHISPER_GRAPH_ENCODE).meta_size,
+        /*.mem_buffer =*/ whisper_state_allocr(wstate, WHISPER_GRAPH_ENCODE).meta.get(),
         /*.no_alloc   =*/ true,
     };
 
@@ -2114,8 +2990,8 @@ static struct ggml_cgraph * whisper_build_graph_cross(
     const int n_head  = hparams.n_audio_head;
 
     struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.alloc_cross.meta.size(),
-        /*.mem_buffer =*/ wstate.alloc_cross.meta.data(),
+        /*.mem_size   =*/ whisper_state_allocr(wstate, WHISPER_GRAPH_CROSS).meta_size,
+        /*.mem_buffer =*/ whisper_state_allocr(wstate, WHISPER_GRAPH_CROSS).meta.get(),
         /*.no_alloc   =*/ true,
     };
 
@@ -2175,6 +3051,73 @@ static struct ggml_cgraph * whisper_build_graph_cross(
 //   - n_threads:  number of threads to use
 //   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
 //
+static void whisper_trace_add(whisper_state & wstate, const char * name, int64_t t_start_us, int64_t t_end_us) {
+    if (!wstate.trace.enabled) {
+        return;
+    }
+
+    whisper_trace_event event = {};
+    event.name       = name;
+    event.cat        = "whisper";
+    event.tid        = 0;
+    event.t_start_us = t_start_us;
+    event.t_end_us   = t_end_us;
+
+    std::lock_guard<std::mutex> lock(wstate.trace.mutex);
+    wstate.trace.events.push_back(event);
+}
+
+// records the lifetime of the scope as a stage
+struct whisper_trace_scope {
+    whisper_state & wstate;
+    const char    * name;
+
+    const bool    enabled;
+    const int64_t t_start_us;
+
+    whisper_trace_scope(whisper_state & wstate, const char * name) :
+        wstate(wstate), name(name), enabled(wstate.trace.enabled), t_start_us(enabled ? ggml_time_us() : 0) {}
+
+    ~whisper_trace_scope() {
+        if (enabled) {
+            whisper_trace_add(wstate, name, t_start_us, ggml_time_us());
+        }
+    }
+};
+
+// ggml_trace_callback of the CPU backend
+static void whisper_trace_node(const struct ggml_tensor * node, int ith, int64_t t_start_us, int64_t t_end_us, void * data) {
+    // views and reshapes are not computed
+    switch (node->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_VIEW:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return;
+        default:
+            break;
+    }
+
+    whisper_state * wstate = (whisper_state *) data;
+
+    whisper_trace_event event = {};
+    event.name       = ggml_op_desc(node);
+    event.cat        = "ggml";
+    event.tid        = ith;
+    event.t_start_us = t_start_us;
+    event.t_end_us   = t_end_us;
+    event.type       = node->type;
+
+    snprintf(event.tensor, sizeof(event.tensor), "%s", node->name);
+    for (int i = 0; i < GGML_MAX_DIMS; ++i) {
+        event.ne[i] = node->ne[i];
+    }
+
+    std::lock_guard<std::mutex> lock(wstate->trace.mutex);
+    wstate->trace.events.push_back(event);
+}
+
 static bool whisper_encode_internal(
         whisper_context & wctx,
           whisper_state & wstate,
@@ -2186,7 +3129,11 @@ static bool whisper_encode_internal(
 
     // conv
     {
-        auto & alloc = wstate.alloc_conv.alloc;
+        whisper_trace_scope trace_scope(wstate, "conv");
+
+        auto & alloc = whisper_state_allocr(wstate, WHISPER_GRAPH_CONV).alloc;
+
+        const int64_t t_graph_start_us = ggml_time_us();
 
         ggml_cgraph * gf = whisper_build_graph_conv(wctx, wstate);
 
@@ -2195,6 +3142,8 @@ static bool whisper_encode_internal(
             return false;
         }
 
+        wstate.t_graph_us += ggml_time_us() - t_graph_start_us;
+
         struct ggml_tensor * mel = ggml_graph_get_tensor(gf, "mel");
 
         // set the input
@@ -2223,9 +3172,13 @@ static bool whisper_encode_internal(
         }
 
         if (!whisper_encode_external(wstate)) {
-            if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads)) {
+            const int64_t t_compute_start_us = ggml_time_us();
+
+            if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads, abort_callback, abort_callback_data, wctx.params.cb_eval, wctx.params.cb_eval_user_data)) {
                 return false;
             }
+
+            wstate.t_compute_us += ggml_time_us() - t_compute_start_us;
         } else {
 #if defined(WHISPER_USE_COREML)
             whisper_coreml_encode(wstate.ctx_coreml, mel->ne[0], mel->ne[1], (float *) mel->data, (float *) wstate.embd_enc->data);
@@ -2237,7 +3190,11 @@ static bool whisper_encode_internal(
 
     // encoder
     if (!whisper_encode_external(wstate)) {
-        auto & alloc = wstate.alloc_encode.alloc;
+        whisper_trace_scope trace_scope(wstate, "encoder");
+
+        auto & alloc = whisper_state_allocr(wstate, WHISPER_GRAPH_ENCODE).alloc;
+
+        const int64_t t_graph_start_us = ggml_time_us();
 
         ggml_cgraph * gf = whisper_build_graph_encoder(wctx, wstate);
 
@@ -2246,14 +3203,24 @@ static bool whisper_encode_internal(
             return false;
         }
 
-        if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads)) {
+        wstate.t_graph_us += ggml_time_us() - t_graph_start_us;
+
+        const int64_t t_compute_start_us = ggml_time_us();
+
+        if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads, abort_callback, abort_callback_data, wctx.params.cb_eval, wctx.params.cb_eval_user_data)) {
             return false;
         }
+
+        wstate.t_compute_us += ggml_time_us() - t_compute_start_us;
     }
 
     // cross
     {
-        auto & alloc = wstate.alloc_cross.alloc;
+        whisper_trace_scope trace_scope(wstate, "cross");
+
+        auto & alloc = whisper_state_allocr(wstate, WHISPER_GRAPH_CROSS).alloc;
+
+        const int64_t t_graph_start_us = ggml_time_us();
 
         ggml_cgraph * gf = whisper_build_graph_cross(wctx, wstate);
 
@@ -2262,13 +3229,20 @@ static bool whisper_encode_internal(
             return false;
         }
 
-        if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads)) {
+        wstate.t_graph_us += ggml_time_us() - t_graph_start_us;
+
+        const int64_t t_compute_start_us = ggml_time_us();
+
+        if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads, abort_callback, abort_callback_data, wctx.params.cb_eval, wctx.params.cb_eval_user_data)) {
             return false;
         }
+
+        wstate.t_compute_us += ggml_time_us() - t_compute_start_us;
     }
 
     wstate.t_encode_us += ggml_time_us() - t_start_us;
     wstate.n_encode++;
+    whisper_trace_add(wstate, "encode", t_start_us, ggml_time_us());
 
     return !(abort_callback && abort_callback(abort_callback_data));
 }
@@ -2300,8 +3274,8 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
     //WHISPER_LOG_DEBUG("%s: n_past = %d, n_tokens = %d, n_audio_ctx = %d, n_ctx = %d\n", __func__, n_past, n_tokens, n_audio_ctx, n_ctx);
 
     struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.alloc_decode.meta.size(),
-        /*.mem_buffer =*/ wstate.alloc_decode.meta.data(),
+        /*.mem_size   =*/ whisper_state_allocr(wstate, WHISPER_GRAPH_DECODE).meta_size,
+        /*.mem_buffer =*/ whisper_state_allocr(wstate, WHISPER_GRAPH_DECODE).meta.get(),
         /*.no_alloc   =*/ true,
     };
 
@@ -2678,7 +3652,9 @@ static bool whisper_decode_internal(
 
     // decoder
     {
-        auto & alloc = wstate.alloc_decode.alloc;
+        auto & alloc = whisper_state_allocr(wstate, WHISPER_GRAPH_DECODE).alloc;
+
+        const int64_t t_graph_start_us = ggml_time_us();
 
         ggml_cgraph * gf = whisper_build_graph_decoder(wctx, wstate, batch, save_alignment_heads_QKs, false);
 
@@ -2687,6 +3663,8 @@ static bool whisper_decode_internal(
             return false;
         }
 
+        wstate.t_graph_us += ggml_time_us() - t_graph_start_us;
+
         // set the inputs
         {
             struct ggml_tensor * embd = ggml_graph_get_tensor(gf, "embd");
@@ -2730,9 +3708,13 @@ static bool whisper_decode_internal(
 
         logits = gf->nodes[gf->n_nodes - 1];
 
-        if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads)) {
+        const int64_t t_compute_start_us = ggml_time_us();
+
+        if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads, abort_callback, abort_callback_data, wctx.params.cb_eval, wctx.params.cb_eval_user_data)) {
             return false;
         }
+
+        wstate.t_compute_us += ggml_time_us() - t_compute_start_us;
     }
 
     logits_out.resize(n_tokens*n_vocab);
@@ -2755,12 +3737,15 @@ static bool whisper_decode_internal(
     if (batch.n_tokens == 1) {
         wstate.t_decode_us += ggml_time_us() - t_start_us;
         wstate.n_decode++;
+        whisper_trace_add(wstate, "decode", t_start_us, ggml_time_us());
     } else if (batch.n_tokens < 16) {
         wstate.t_batchd_us += ggml_time_us() - t_start_us;
         wstate.n_batchd += n_tokens;
+        whisper_trace_add(wstate, "batchd", t_start_us, ggml_time_us());
     } else {
         wstate.t_prompt_us += ggml_time_us() - t_start_us;
         wstate.n_prompt += n_tokens;
+        whisper_trace_add(wstate, "prompt", t_start_us, ggml_time_us());
     }
 
     return !(abort_callback && abort_callback(abort_callback_data));
@@ -3043,6 +4028,7 @@ static bool log_mel_spectrogram(
     }
 
     wstate.t_mel_us += ggml_time_us() - t_start_us;
+    whisper_trace_add(wstate, "mel", t_start_us, ggml_time_us());
 
     // Dump log_mel_spectrogram
     if (debug) {
@@ -3068,47 +4054,97 @@ static bool log_mel_spectrogram(
 // Regex (C++):
 // R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)"
 //
-static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
-    std::vector<std::string> words;
+// the character classes of the regex, in the "C" locale used by std::regex
+enum whisper_char_class {
+    WHISPER_CHAR_ALPHA,
+    WHISPER_CHAR_DIGIT,
+    WHISPER_CHAR_SPACE,
+    WHISPER_CHAR_OTHER,
+};
 
-    // first split the text into words
-    {
-        std::string str = text;
-        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
+static whisper_char_class whisper_char_class_of(char c) {
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
+        return WHISPER_CHAR_ALPHA;
+    }
+    if (c >= '0' && c <= '9') {
+        return WHISPER_CHAR_DIGIT;
+    }
+    if (c == ' ' || (c >= '\t' && c <= '\r')) {
+        return WHISPER_CHAR_SPACE;
+    }
+    return WHISPER_CHAR_OTHER;
+}
+
+// splits the text into the same words as the regex above, without the cost of std::regex
+// returns the offset and length of each word
+static void whisper_split_words(const std::string & text, std::vector<std::pair<size_t, size_t>> & words) {
+    static const char * contractions[] = { "s", "t", "re", "ve", "m", "ll", "d", };
+
+    const size_t n = text.size();
+
+    size_t p = 0;
+    while (p < n) {
+        size_t q = p;
+
+        // 's|'t|'re|'ve|'m|'ll|'d
+        if (text[p] == '\'') {
+            for (const char * c : contractions) {
+                const size_t len = strlen(c);
+                if (text.compare(p + 1, len, c) == 0) {
+                    q = p + 1 + len;
+                    break;
+                }
+            }
+        }
 
-        std::regex re(pat);
-        std::smatch m;
+        if (q == p) {
+            // ' ?' followed by a run of letters, digits or other characters
+            size_t r = p;
+            if (text[r] == ' ' && r + 1 < n && whisper_char_class_of(text[r + 1]) != WHISPER_CHAR_SPACE) {
+                r++;
+            }
 
-        while (std::regex_search(str, m, re)) {
-            for (auto x : m) {
-                words.push_back(x);
+            const auto cls = whisper_char_class_of(text[r]);
+            if (cls != WHISPER_CHAR_SPACE) {
+                q = r;
+                while (q < n && whisper_char_class_of(text[q]) == cls) {
+                    q++;
+                }
+            } else {
+                // \s+(?!\S)|\s+ - the last space before a word is left to that word
+                while (q < n && whisper_char_class_of(text[q]) == WHISPER_CHAR_SPACE) {
+                    q++;
+                }
+                if (q < n && q - p > 1) {
+                    q--;
+                }
             }
-            str = m.suffix();
         }
+
+        words.emplace_back(p, q - p);
+        p = q;
     }
+}
+
+static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
+    // first split the text into words
+    std::vector<std::pair<size_t, size_t>> words;
+    whisper_split_words(text, words);
 
     // find the longest tokens that form the words:
     std::vector<whisper_vocab::id> tokens;
     for (const auto & word : words) {
-        if (word.empty()) continue;
-
-        int i = 0;
-        int n = word.size();
-        while (i < n) {
-            int j = n;
-            bool found = false;
-            while (j > i) {
-                auto sub = word.substr(i, j-i);
-                auto it = vocab.token_to_id.find(sub);
-                if (it != vocab.token_to_id.end()) {
-                    tokens.push_back(it->second);
-                    i = j;
-                    found = true;
-                    break;
-                }
-                --j;
-            }
-            if (!found) {
+        const char * str = text.data() + word.first;
+
+        size_t i = 0;
+        while (i < word.second) {
+            whisper_vocab::id id = -1;
+
+            const size_t len = vocab.find_longest(str + i, word.second - i, id);
+            if (len > 0) {
+                tokens.push_back(id);
+                i += len;
+            } else {
                 WHISPER_LOG_ERROR("unknown token\n");
                 ++i;
             }
@@ -3251,58 +4287,39 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
 
     state->decoders[0].rng = std::mt19937(0);
 
-    // conv allocator
-    {
-        bool ok = whisper_allocr_graph_init(state->alloc_conv, ctx->backend,
-                [&]() {
-                    return whisper_build_graph_conv(*ctx, *state);
-                });
-
-        if (!ok) {
-            WHISPER_LOG_ERROR("%s: failed to init conv allocator\n", __func__);
-            whisper_free_state(state);
-            return nullptr;
-        }
+    // the graphs only depend on the model, the backend and the encoder type, so they are measured once per context
+    whisper_compute_sizes & sizes_ctx = ctx->compute_sizes[whisper_encode_external(*state) ? 1 : 0];
 
-        WHISPER_LOG_INFO("%s: compute buffer (conv)   = %7.2f MB\n", __func__, whisper_allocr_size(state->alloc_conv) / 1e6);
+    whisper_compute_sizes sizes;
+    {
+        std::lock_guard<std::mutex> lock(ctx->compute_mutex);
+        sizes = sizes_ctx;
     }
 
-    // encoder allocator
-    if (!whisper_encode_external(*state)) {
-        bool ok = whisper_allocr_graph_init(state->alloc_encode, ctx->backend,
-                [&]() {
-                    return whisper_build_graph_encoder(*ctx, *state);
-                });
+    // measure the graphs in the order they run, so that the input of each graph is allocated
+    const whisper_graph_type types[] = {
+        WHISPER_GRAPH_CONV,
+        WHISPER_GRAPH_ENCODE,
+        WHISPER_GRAPH_CROSS,
+        WHISPER_GRAPH_DECODE,
+    };
 
-        if (!ok) {
-            WHISPER_LOG_ERROR("%s: failed to init encoder allocator\n", __func__);
-            whisper_free_state(state);
-            return nullptr;
+    for (const auto type : types) {
+        if (type == WHISPER_GRAPH_ENCODE && whisper_encode_external(*state)) {
+            continue;
         }
 
-        WHISPER_LOG_INFO("%s: compute buffer (encode) = %7.2f MB\n", __func__, whisper_allocr_size(state->alloc_encode) / 1e6);
-    }
+        const int id = whisper_state_allocr_id(*state, type);
 
-    // cross allocator
-    {
-        bool ok = whisper_allocr_graph_init(state->alloc_cross, ctx->backend,
+        bool ok = whisper_allocr_graph_init(state->alloc[id], ctx->backend, sizes.alloc[id],
                 [&]() {
-                    return whisper_build_graph_cross(*ctx, *state);
-                });
-
-        if (!ok) {
-            WHISPER_LOG_ERROR("%s: failed to init cross allocator\n", __func__);
-            whisper_free_state(state);
-            return nullptr;
-        }
-
-        WHISPER_LOG_INFO("%s: compute buffer (cross)  = %7.2f MB\n", __func__, whisper_allocr_size(state->alloc_cross) / 1e6);
-    }
+                    switch (type) {
+                        case WHISPER_GRAPH_CONV:   return whisper_build_graph_conv   (*ctx, *state);
+                        case WHISPER_GRAPH_ENCODE: return whisper_build_graph_encoder(*ctx, *state);
+                        case WHISPER_GRAPH_CROSS:  return whisper_build_graph_cross  (*ctx, *state);
+                        case WHISPER_GRAPH_DECODE: break;
+                    }
 
-    // decoder allocator
-    {
-        bool ok = whisper_allocr_graph_init(state->alloc_decode, ctx->backend,
-                [&]() {
                     const auto & hparams = ctx->model.hparams;
 
                     // TODO: make sure this is the worst-case scenario
@@ -3315,12 +4332,19 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
                 });
 
         if (!ok) {
-            WHISPER_LOG_ERROR("%s: failed to init decoder allocator\n", __func__);
+            WHISPER_LOG_ERROR("%s: failed to init the compute allocator of graph %d\n", __func__, (int) type);
             whisper_free_state(state);
             return nullptr;
         }
+    }
+
+    WHISPER_LOG_INFO("%s: compute buffers = %7.2f MB + %7.2f MB\n", __func__, whisper_allocr_size(state->alloc[0]) / 1e6, whisper_allocr_size(state->alloc[1]) / 1e6);
 
-        WHISPER_LOG_INFO("%s: compute buffer (decode) = %7.2f MB\n", __func__, whisper_allocr_size(state->alloc_decode) / 1e6);
+    if (sizes.alloc[0] == 0) {
+        std::lock_guard<std::mutex> lock(ctx->compute_mutex);
+
+        sizes_ctx.alloc[0] = ggml_gallocr_get_buffer_size(state->alloc[0].alloc, 0);
+        sizes_ctx.alloc[1] = ggml_gallocr_get_buffer_size(state->alloc[1].alloc, 0);
     }
 
     return state;
@@ -3331,8 +4355,18 @@ int whisper_ctx_init_openvino_encoder(
                     const char * model_path,
                     const char * device,
                     const char * cache_dir) {
+    return whisper_ctx_init_openvino_encoder_with_state(ctx, ctx->state, model_path, device, cache_dir);
+}
+
+int whisper_ctx_init_openvino_encoder_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                    const char * model_path,
+                    const char * device,
+                    const char * cache_dir) {
 #ifndef WHISPER_USE_OPENVINO
     (void)(ctx);
+    (void)(state);
     (void)(model_path);
     (void)(device);
     (void)(cache_dir);
@@ -3363,8 +4397,8 @@ int whisper_ctx_init_openvino_encoder(
     WHISPER_LOG_INFO("%s: loading OpenVINO model from '%s'\n", __func__, path_encoder.c_str());
     WHISPER_LOG_INFO("%s: first run on a device may take a while ...\n", __func__);
 
-    ctx->state->ctx_openvino = whisper_openvino_init(path_encoder.c_str(), device, path_cache.c_str());
-    if (!ctx->state->ctx_openvino) {
+    state->ctx_openvino = whisper_openvino_init(path_encoder.c_str(), device, path_cache.c_str());
+    if (!state->ctx_openvino) {
         WHISPER_LOG_ERROR("%s: failed to init OpenVINO encoder from '%s'\n", __func__, path_encoder.c_str());
         return 1;
     } else {
@@ -3375,10 +4409,38 @@ int whisper_ctx_init_openvino_encoder(
 #endif
 }
 
+static struct whisper_context * whisper_init_with_params_no_state_impl(
+        struct whisper_model_loader * loader,
+        struct whisper_context_params params,
+        const char * path_model,
+        std::unique_ptr<whisper_file> file) {
+    ggml_time_init();
+
+    whisper_context * ctx = new whisper_context;
+    ctx->params  = params;
+    ctx->file    = std::move(file);
+
+    if (path_model) {
+        ctx->path_model = path_model;
+    }
+
+    if (!whisper_model_load(loader, *ctx)) {
+        loader->close(loader->context);
+        WHISPER_LOG_ERROR("%s: failed to load model\n", __func__);
+        delete ctx;
+        return nullptr;
+    }
+
+    loader->close(loader->context);
+
+    return ctx;
+}
+
 struct whisper_context_params whisper_context_default_params() {
     struct whisper_context_params result = {
         /*.use_gpu              =*/ true,
         /*.gpu_device           =*/ 0,
+        /*.use_mmap             =*/ true,
 
         /*.dtw_token_timestamps =*/ false,
         /*.dtw_aheads_preset    =*/ WHISPER_AHEADS_NONE,
@@ -3388,6 +4450,9 @@ struct whisper_context_params whisper_context_default_params() {
             /*.heads            =*/ NULL,
         },
         /*.dtw_mem_size         =*/ 1024*1024*128,
+
+        /*.cb_eval              =*/ nullptr,
+        /*.cb_eval_user_data    =*/ nullptr,
     };
     return result;
 }
@@ -3395,6 +4460,30 @@ struct whisper_context_params whisper_context_default_params() {
 struct whisper_context * whisper_init_from_file_with_params_no_state(const char * path_model, struct whisper_context_params params) {
     WHISPER_LOG_INFO("%s: loading model from '%s'\n", __func__, path_model);
 
+    {
+        std::unique_ptr<whisper_file> file(new whisper_file);
+
+        if (file->open(path_model, params.use_mmap)) {
+            whisper_model_loader loader = {};
+
+            loader.context = file.get();
+
+            loader.read = [](void * ctx, void * output, size_t read_size) {
+                whisper_file * file = (whisper_file *) ctx;
+                return file->read(output, read_size);
+            };
+
+            loader.eof = [](void * ctx) {
+                whisper_file * file = (whisper_file *) ctx;
+                return file->offs >= file->size;
+            };
+
+            loader.close = [](void * /*ctx*/) { };
+
+            return whisper_init_with_params_no_state_impl(&loader, params, path_model, std::move(file));
+        }
+    }
+
     auto fin = std::ifstream(path_model, std::ios::binary);
     if (!fin) {
         WHISPER_LOG_ERROR("%s: failed to open '%s'\n", __func__, path_model);
@@ -3421,13 +4510,7 @@ struct whisper_context * whisper_init_from_file_with_params_no_state(const char
         fin->close();
     };
 
-    auto ctx = whisper_init_with_params_no_state(&loader, params);
-
-    if (ctx) {
-        ctx->path_model = path_model;
-    }
-
-    return ctx;
+    return whisper_init_with_params_no_state_impl(&loader, params, path_model, nullptr);
 }
 
 struct whisper_context * whisper_init_from_buffer_with_params_no_state(void * buffer, size_t buffer_size, struct whisper_context_params params) {
@@ -3468,21 +4551,7 @@ struct whisper_context * whisper_init_from_buffer_with_params_no_state(void * bu
 }
 
 struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_loader * loader, struct whisper_context_params params) {
-    ggml_time_init();
-
-    whisper_context * ctx = new whisper_context;
-    ctx->params = params;
-
-    if (!whisper_model_load(loader, *ctx)) {
-        loader->close(loader->context);
-        WHISPER_LOG_ERROR("%s: failed to load model\n", __func__);
-        delete ctx;
-        return nullptr;
-    }
-
-    loader->close(loader->context);
-
-    return ctx;
+    return whisper_init_with_params_no_state_impl(loader, params, nullptr, nullptr);
 }
 
 struct whisper_context * whisper_init_from_file_with_params(const char * path_model, struct whisper_context_params params) {
@@ -3575,10 +4644,8 @@ void whisper_free_state(struct whisper_state * state) {
 
         whisper_batch_free(state->batch);
 
-        ggml_gallocr_free(state->alloc_conv.alloc);
-        ggml_gallocr_free(state->alloc_encode.alloc);
-        ggml_gallocr_free(state->alloc_cross.alloc);
-        ggml_gallocr_free(state->alloc_decode.alloc);
+        ggml_gallocr_free(state->alloc[0].alloc);
+        ggml_gallocr_free(state->alloc[1].alloc);
 
         ggml_backend_free(state->backend);
 
@@ -3966,7 +5033,7 @@ float * whisper_get_logits_from_state(struct whisper_state * state) {
 }
 
 const char * whisper_token_to_str(struct whisper_context * ctx, whisper_token token) {
-    return ctx->vocab.id_to_token.at(token).c_str();
+    return ctx->vocab.str(token);
 }
 
 whisper_token whisper_token_eot(struct whisper_context * ctx) {
@@ -4009,28 +5076,104 @@ whisper_token whisper_token_transcribe(struct whisper_context * ctx) {
     return ctx->vocab.token_transcribe;
 }
 
-void whisper_print_timings(struct whisper_context * ctx) {
-    const int64_t t_end_us = ggml_time_us();
+void whisper_print_timings(struct whisper_context * ctx) {
+    const int64_t t_end_us = ggml_time_us();
+
+    WHISPER_LOG_INFO("\n");
+    WHISPER_LOG_INFO("%s:     load time = %8.2f ms\n", __func__, ctx->t_load_us / 1000.0f);
+    if (ctx->state != nullptr) {
+        const whisper_timings t = whisper_get_timings_from_state(ctx->state);
+
+        const int32_t n_sample = std::max(1, t.n_sample);
+        const int32_t n_encode = std::max(1, t.n_encode);
+        const int32_t n_decode = std::max(1, t.n_decode);
+        const int32_t n_batchd = std::max(1, t.n_batchd);
+        const int32_t n_prompt = std::max(1, t.n_prompt);
+
+        WHISPER_LOG_INFO("%s:     fallbacks = %3d p / %3d h\n", __func__, t.n_fail_p, t.n_fail_h);
+        WHISPER_LOG_INFO("%s:    rep. loops = %3d (%5d decode steps saved)\n", __func__, t.n_fail_r, t.n_skip_r);
+        WHISPER_LOG_INFO("%s:     no speech = %3d windows skipped\n", __func__, t.n_skip_s);
+        if (t.n_dl_fallback + t.n_dl_decoders + t.n_dl_tokens + t.n_dl_missed > 0) {
+            WHISPER_LOG_INFO("%s:      deadline = %3d no fallback / %3d single decoder / %3d max tokens / %3d missed\n", __func__,
+                    t.n_dl_fallback, t.n_dl_decoders, t.n_dl_tokens, t.n_dl_missed);
+        }
+        WHISPER_LOG_INFO("%s:       windows = %3d (%5d tokens)\n", __func__, t.n_windows, t.n_tokens);
+        if (t.n_windows > t.n_temp[0]) {
+            std::string temps;
+            for (int i = 0; i < WHISPER_MAX_TEMPERATURES; ++i) {
+                temps += (i > 0 ? " / " : "") + std::to_string(t.n_temp[i]);
+            }
+            WHISPER_LOG_INFO("%s:  temperatures = %s\n", __func__, temps.c_str());
+        }
+        WHISPER_LOG_INFO("%s:      mel time = %8.2f ms\n", __func__, t.t_mel_us / 1000.0f);
+        WHISPER_LOG_INFO("%s:   sample time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * t.t_sample_us, n_sample, 1e-3f * t.t_sample_us / n_sample);
+        WHISPER_LOG_INFO("%s:   encode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * t.t_encode_us, n_encode, 1e-3f * t.t_encode_us / n_encode);
+        WHISPER_LOG_INFO("%s:   decode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * t.t_decode_us, n_decode, 1e-3f * t.t_decode_us / n_decode);
+        WHISPER_LOG_INFO("%s:   batchd time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * t.t_batchd_us, n_batchd, 1e-3f * t.t_batchd_us / n_batchd);
+        WHISPER_LOG_INFO("%s:   prompt time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * t.t_prompt_us, n_prompt, 1e-3f * t.t_prompt_us / n_prompt);
+        WHISPER_LOG_INFO("%s:    graph time = %8.2f ms (build and alloc) / %8.2f ms (compute)\n", __func__, 1e-3f * t.t_graph_us, 1e-3f * t.t_compute_us);
+        WHISPER_LOG_INFO("%s: compute bufs. = %8.2f MB\n", __func__, t.mem_compute / 1e6);
+    }
+    WHISPER_LOG_INFO("%s:    total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0f);
+}
+
+struct whisper_timings whisper_get_timings_from_state(struct whisper_state * state) {
+    struct whisper_timings timings = {};
+
+    timings.t_mel_us    = state->t_mel_us;
+    timings.t_sample_us = state->t_sample_us;
+    timings.t_encode_us = state->t_encode_us;
+    timings.t_decode_us = state->t_decode_us;
+    timings.t_batchd_us = state->t_batchd_us;
+    timings.t_prompt_us = state->t_prompt_us;
+
+    timings.n_sample = state->n_sample;
+    timings.n_encode = state->n_encode;
+    timings.n_decode = state->n_decode;
+    timings.n_batchd = state->n_batchd;
+    timings.n_prompt = state->n_prompt;
+
+    timings.n_fail_p = state->n_fail_p;
+    timings.n_fail_h = state->n_fail_h;
+    timings.n_fail_r = state->n_fail_r;
+    timings.n_skip_r = state->n_skip_r;
+    timings.n_skip_s = state->n_skip_s;
+
+    timings.n_dl_fallback = state->n_dl_fallback;
+    timings.n_dl_decoders = state->n_dl_decoders;
+    timings.n_dl_tokens   = state->n_dl_tokens;
+    timings.n_dl_missed   = state->n_dl_missed;
+
+    timings.t_graph_us   = state->t_graph_us;
+    timings.t_compute_us = state->t_compute_us;
+
+    timings.n_windows = state->n_windows;
+    timings.n_tokens  = state->n_tokens;
+
+    for (int i = 0; i < WHISPER_MAX_TEMPERATURES; ++i) {
+        timings.n_temp[i] = state->n_temp[i];
+    }
+
+    // the compute buffers only grow, so their current size is the peak
+    timings.mem_compute = whisper_allocr_size(state->alloc[0])
+                        + whisper_allocr_size(state->alloc[1]);
 
-    WHISPER_LOG_INFO("\n");
-    WHISPER_LOG_INFO("%s:     load time = %8.2f ms\n", __func__, ctx->t_load_us / 1000.0f);
-    if (ctx->state != nullptr) {
+    timings.mem_kv = 0;
+    for (const auto * kv : { &state->kv_self, &state->kv_cross }) {
+        if (kv->buffer) {
+            timings.mem_kv += ggml_backend_buffer_get_size(kv->buffer);
+        }
+    }
 
-        const int32_t n_sample = std::max(1, ctx->state->n_sample);
-        const int32_t n_encode = std::max(1, ctx->state->n_encode);
-        const int32_t n_decode = std::max(1, ctx->state->n_decode);
-        const int32_t n_batchd = std::max(1, ctx->state->n_batchd);
-        const int32_t n_prompt = std::max(1, ctx->state->n_prompt);
+    return timings;
+}
 
-        WHISPER_LOG_INFO("%s:     fallbacks = %3d p / %3d h\n", __func__, ctx->state->n_fail_p, ctx->state->n_fail_h);
-        WHISPER_LOG_INFO("%s:      mel time = %8.2f ms\n", __func__, ctx->state->t_mel_us / 1000.0f);
-        WHISPER_LOG_INFO("%s:   sample time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_sample_us, n_sample, 1e-3f * ctx->state->t_sample_us / n_sample);
-        WHISPER_LOG_INFO("%s:   encode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_encode_us, n_encode, 1e-3f * ctx->state->t_encode_us / n_encode);
-        WHISPER_LOG_INFO("%s:   decode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_decode_us, n_decode, 1e-3f * ctx->state->t_decode_us / n_decode);
-        WHISPER_LOG_INFO("%s:   batchd time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_batchd_us, n_batchd, 1e-3f * ctx->state->t_batchd_us / n_batchd);
-        WHISPER_LOG_INFO("%s:   prompt time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_prompt_us, n_prompt, 1e-3f * ctx->state->t_prompt_us / n_prompt);
+struct whisper_timings whisper_get_timings(struct whisper_context * ctx) {
+    if (ctx->state == nullptr) {
+        return whisper_timings {};
     }
-    WHISPER_LOG_INFO("%s:    total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0f);
+
+    return whisper_get_timings_from_state(ctx->state);
 }
 
 void whisper_reset_timings(struct whisper_context * ctx) {
@@ -4047,7 +5190,112 @@ void whisper_reset_timings(struct whisper_context * ctx) {
         ctx->state->n_decode = 0;
         ctx->state->n_batchd = 0;
         ctx->state->n_prompt = 0;
+        ctx->state->n_fail_p = 0;
+        ctx->state->n_fail_h = 0;
+        ctx->state->n_fail_r = 0;
+        ctx->state->n_skip_r = 0;
+        ctx->state->n_skip_s = 0;
+        ctx->state->t_graph_us   = 0;
+        ctx->state->t_compute_us = 0;
+        ctx->state->n_windows = 0;
+        ctx->state->n_tokens  = 0;
+        for (int i = 0; i < WHISPER_MAX_TEMPERATURES; ++i) {
+            ctx->state->n_temp[i] = 0;
+        }
+        ctx->state->n_dl_fallback = 0;
+        ctx->state->n_dl_decoders = 0;
+        ctx->state->n_dl_tokens   = 0;
+        ctx->state->n_dl_missed   = 0;
+    }
+}
+
+void whisper_trace_enable_with_state(struct whisper_state * state, bool enable) {
+    std::lock_guard<std::mutex> lock(state->trace.mutex);
+
+    state->trace.enabled = enable;
+
+    if (ggml_backend_is_cpu(state->backend)) {
+        ggml_backend_cpu_set_trace_callback(state->backend, enable ? whisper_trace_node : nullptr, state);
+    }
+}
+
+void whisper_trace_enable(struct whisper_context * ctx, bool enable) {
+    if (ctx->state == nullptr) {
+        return;
+    }
+
+    whisper_trace_enable_with_state(ctx->state, enable);
+}
+
+// tensor names are set by the graph builders, but do not trust them to be valid JSON
+static void whisper_trace_write_str(FILE * f, const char * str) {
+    for (const char * c = str; *c; ++c) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', f);
+        }
+        if ((unsigned char) *c >= 0x20) {
+            fputc(*c, f);
+        }
+    }
+}
+
+int whisper_trace_write_with_state(struct whisper_state * state, const char * fname) {
+    std::vector<whisper_trace_event> events;
+    {
+        std::lock_guard<std::mutex> lock(state->trace.mutex);
+        events.swap(state->trace.events);
+    }
+
+    FILE * f = fopen(fname, "w");
+    if (f == nullptr) {
+        WHISPER_LOG_ERROR("%s: failed to open '%s' for writing\n", __func__, fname);
+        return -1;
+    }
+
+    int tid_max = 0;
+
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (const auto & event : events) {
+        fprintf(f, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%" PRId64 ",\"dur\":%" PRId64,
+                event.name, event.cat, event.tid, event.t_start_us, event.t_end_us - event.t_start_us);
+
+        if (strcmp(event.cat, "ggml") == 0) {
+            fprintf(f, ",\"args\":{\"tensor\":\"");
+            whisper_trace_write_str(f, event.tensor);
+            fprintf(f, "\",\"shape\":[%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 "],\"type\":\"%s\"}",
+                    event.ne[0], event.ne[1], event.ne[2], event.ne[3], ggml_type_name(event.type));
+        }
+
+        fprintf(f, "},\n");
+
+        tid_max = std::max(tid_max, event.tid);
+    }
+
+    // name the threads, this also terminates the list of events
+    for (int tid = 0; tid <= tid_max; ++tid) {
+        fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}%s\n",
+                tid, tid == 0 ? "main / ggml thread" : "ggml thread", tid, tid == tid_max ? "" : ",");
+    }
+    fprintf(f, "],\"displayTimeUnit\":\"ms\"}\n");
+
+    const bool ok = !ferror(f);
+    fclose(f);
+
+    if (!ok) {
+        WHISPER_LOG_ERROR("%s: failed to write '%s'\n", __func__, fname);
+        return -2;
+    }
+
+    return 0;
+}
+
+int whisper_trace_write(struct whisper_context * ctx, const char * fname) {
+    if (ctx->state == nullptr) {
+        WHISPER_LOG_ERROR("%s: no state\n", __func__);
+        return -1;
     }
+
+    return whisper_trace_write_with_state(ctx->state, fname);
 }
 
 static int whisper_has_coreml(void) {
@@ -4461,9 +5709,9 @@ static void whisper_suppress_invalid_grammar(
     std::vector<whisper_grammar_candidate>                              candidates_grammar;
 
     for (whisper_token id = 0; id < eot; ++id) {
-        const std::string & text = ctx.vocab.id_to_token[id];
-        if (!text.empty()) {
-            candidates_decoded.push_back(decode_utf8(text.c_str(), grammar.partial_utf8));
+        const char * text = ctx.vocab.str(id);
+        if (*text) {
+            candidates_decoded.push_back(decode_utf8(text, grammar.partial_utf8));
             candidates_grammar.push_back({ id, candidates_decoded.back().first.data(), candidates_decoded.back().second });
         }
     }
@@ -4486,18 +5734,18 @@ static void whisper_grammar_accept_token(whisper_context & ctx, whisper_grammar
         return;
     }
 
-    //fprintf(stderr, "Accept: '%s'\n", ctx.vocab.id_to_token[token].c_str());
+    //fprintf(stderr, "Accept: '%s'\n", ctx.vocab.str(token));
 
-    const std::string & text = ctx.vocab.id_to_token[token];
+    const char * text = ctx.vocab.str(token);
 
-    if (text.rfind("[_", 0) == 0) {
+    if (strncmp(text, "[_", 2) == 0) {
         // fprintf(stderr, " (skipped)\n");
         return;
     }
     // fprintf(stderr, "\n");
 
     // Note terminating 0 in decoded string
-    const auto   decoded     = decode_utf8(text.c_str(), grammar.partial_utf8);
+    const auto   decoded     = decode_utf8(text, grammar.partial_utf8);
     const auto & code_points = decoded.first;
     for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
         grammar.stacks = whisper_grammar_accept(grammar.rules, grammar.stacks, *it);
@@ -4535,6 +5783,7 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
         /*.n_max_text_ctx    =*/ 16384,
         /*.offset_ms         =*/ 0,
         /*.duration_ms       =*/ 0,
+        /*.deadline_ms       =*/ 0,
 
         /*.translate         =*/ false,
         /*.no_context        =*/ true,
@@ -4732,7 +5981,7 @@ static void whisper_process_logits(
     const auto & tokens_cur = decoder.sequence.tokens;
 
     const bool is_initial = tokens_cur.size() == 0;
-    const int  n_logits   = vocab.id_to_token.size();
+    const int  n_logits   = vocab.size();
 
     WHISPER_ASSERT(n_logits == ctx.vocab.n_vocab);
 
@@ -4763,8 +6012,10 @@ static void whisper_process_logits(
         // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L388-L390
         if (params.suppress_blank) {
             if (is_initial) {
-                logits[vocab.token_eot]           = -INFINITY;
-                logits[vocab.token_to_id.at(" ")] = -INFINITY;
+                logits[vocab.token_eot] = -INFINITY;
+                if (vocab.find(" ") >= 0) {
+                    logits[vocab.find(" ")] = -INFINITY;
+                }
             }
         }
 
@@ -4807,9 +6058,9 @@ static void whisper_process_logits(
         // ref: https://github.com/openai/whisper/discussions/1041
         if (params.suppress_regex != nullptr) {
             std::regex re(params.suppress_regex);
-            for (std::pair<whisper_vocab::token, whisper_vocab::id> token_id : vocab.token_to_id) {
-                if (std::regex_match(token_id.first, re)) {
-                    logits[token_id.second] = -INFINITY;
+            for (whisper_vocab::id id = 0; id < vocab.size(); ++id) {
+                if (std::regex_match(vocab.str(id), vocab.str(id) + vocab.text_len[id], re)) {
+                    logits[id] = -INFINITY;
                 }
             }
         }
@@ -4820,18 +6071,19 @@ static void whisper_process_logits(
             for (const std::string & token : non_speech_tokens) {
                 const std::string suppress_tokens[] = {token, " " + token};
                 for (const std::string & suppress_token : suppress_tokens) {
-                    if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
-                        logits[vocab.token_to_id.at(suppress_token)] = -INFINITY;
+                    const auto id = vocab.find(suppress_token);
+                    if (id >= 0) {
+                        logits[id] = -INFINITY;
                     }
                 }
             }
 
             // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
-            if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" -")] = -INFINITY;
+            if (vocab.find(" -") >= 0) {
+                logits[vocab.find(" -")] = -INFINITY;
             }
-            if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" '")] = -INFINITY;
+            if (vocab.find(" '") >= 0) {
+                logits[vocab.find(" '")] = -INFINITY;
             }
         }
 
@@ -4986,11 +6238,11 @@ static void whisper_process_logits(
         });
 
         for (int i = 0; i < 10; i++) {
-            const auto token   = vocab.id_to_token.at(pairs[i].second);
+            const auto token   = vocab.str(pairs[i].second);
             const auto prob    = pairs[i].first;
             const auto logit   = logits[pairs[i].second];
             const auto logprob = logprobs[pairs[i].second];
-            printf("%16s : id=%6d prob=%9.5f logit=%9.5f logprob=%9.5f '%s'\n", token.c_str(), pairs[i].second, prob, logit, logprob, token.c_str());
+            printf("%16s : id=%6d prob=%9.5f logit=%9.5f logprob=%9.5f '%s'\n", token, pairs[i].second, prob, logit, logprob, token);
         }
 
         printf("----------------\n");
@@ -5164,6 +6416,29 @@ static std::vector<whisper_token_data> whisper_sample_token_topk(
     return result;
 }
 
+// compute the entropy of the sequence of the last 32 tokens before n_tokens
+static double whisper_sequence_entropy(const whisper_sequence & sequence, int n_tokens) {
+    const int n = 32;
+
+    int cnt = 0;
+    double entropy = 0.0f;
+
+    std::map<whisper_token, int> token_counts;
+    for (int i = std::max(0, n_tokens - n); i < n_tokens; ++i) {
+        token_counts[sequence.tokens[i].id]++;
+        cnt++;
+    }
+
+    for (const auto & kv : token_counts) {
+        const auto p = kv.second/(double)cnt;
+        entropy -= p*log(p);
+
+        //WHISPER_LOG_DEBUG("entropy: %d %f %f, count %d\n", kv.first, p, log(p), kv.second);
+    }
+
+    return entropy;
+}
+
 // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L178-L192
 static void whisper_sequence_score(
         const struct whisper_full_params & params,
@@ -5189,28 +6464,243 @@ static void whisper_sequence_score(
 
     sequence.score = result/penalty;
 
-    // compute the entropy of the sequence of the last 32 tokens
-    {
-        const int n = 32;
+    sequence.entropy = whisper_sequence_entropy(sequence, sequence.result_len);
+}
+
+static const uint64_t WHISPER_SEQUENCE_HASH_BASE = 0x100000001b3ULL;
+
+// hash of the tokens in the range [i0, i1) - requires sequence.hashes to be up to date
+static uint64_t whisper_sequence_hash(const whisper_sequence & sequence, int i0, int i1) {
+    uint64_t pw = 1;
+    for (int i = i0; i < i1; ++i) {
+        pw *= WHISPER_SEQUENCE_HASH_BASE;
+    }
+
+    return sequence.hashes[i1] - sequence.hashes[i0]*pw;
+}
+
+// check if the last tokens of the sequence are stuck in a loop repeating a short n-gram without timestamps
+//
+// a window of tokens is periodic with period p iff it is equal to itself shifted by p tokens, so with the
+// prefix hashes each candidate period costs a single comparison. only periods p with log(p) < entropy_thold
+// are considered - a window made of at most p distinct tokens has entropy <= log(p), so any 32 tokens of the
+// loop fail the entropy check of whisper_sequence_score
+static bool whisper_sequence_is_looping(whisper_sequence & sequence, float entropy_thold, whisper_token token_beg) {
+    const int n = 32;
+
+    auto & tokens = sequence.tokens;
+    auto & hashes = sequence.hashes;
+
+    // update the rolling hashes with the newly sampled tokens
+    if (hashes.empty()) {
+        hashes.push_back(0);
+    }
+    hashes.resize(std::min(hashes.size(), tokens.size() + 1));
+    while (hashes.size() < tokens.size() + 1) {
+        hashes.push_back(hashes.back()*WHISPER_SEQUENCE_HASH_BASE + (uint64_t) tokens[hashes.size() - 1].id + 1);
+    }
+
+    const int n_tokens = tokens.size();
+    if (n_tokens < n) {
+        return false;
+    }
+
+    const int i0 = n_tokens - n;
+
+    for (int p = 1; p <= n/2 && log((double) p) < entropy_thold; ++p) {
+        if (whisper_sequence_hash(sequence, i0, n_tokens - p) != whisper_sequence_hash(sequence, i0 + p, n_tokens)) {
+            continue;
+        }
+
+        // rule out hash collisions
+        bool match = true;
+        for (int i = i0; i < n_tokens - p; ++i) {
+            if (tokens[i].id != tokens[i + p].id) {
+                match = false;
+                break;
+            }
+        }
+
+        if (match) {
+            // timestamp tokens move result_len and seek_delta
+            for (int i = i0; i < n_tokens; ++i) {
+                if (tokens[i].id > token_beg) {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// check if a decoder stuck in a repetition loop fails, without decoding the rest of the window
+//
+// while the decoder repeats tokens without timestamps, result_len and seek_delta do not change. if the loop goes on
+// until the decoder ends at n_max or max_tokens, the checks done there and the entropy check after decoding (the last
+// 32 tokens before result_len, only if result_len > 32) are already decided, so the decoder is failed now only if
+// they would fail it. a decoder that breaks out of the loop later is not predicted - its loop must not pass these checks
+// returns the number of decoding steps saved by failing the decoder after token i, or 0 if it continues
+static int whisper_sequence_check_loop(
+        const struct whisper_full_params & params,
+                        whisper_sequence & sequence,
+                           whisper_token   token_beg,
+                                     int   i,
+                                     int   n_max,
+                                     int   max_tokens,
+                                     int   seek_delta) {
+    if (!whisper_sequence_is_looping(sequence, params.entropy_thold, token_beg)) {
+        return 0;
+    }
+
+    const int result_len = sequence.result_len;
+
+    // the decoder completes after max_tokens tokens, otherwise it is stopped after token n_max - 1
+    const bool at_max_tokens = max_tokens > 0 && max_tokens <= n_max - 1;
+
+    const int i_end = at_max_tokens ? max_tokens : n_max - 1;
+    if (i >= i_end) {
+        return 0;
+    }
+
+    bool failed = result_len > 32 && whisper_sequence_entropy(sequence, result_len) < params.entropy_thold;
+
+    if (at_max_tokens) {
+        // result_len becomes i_end + 1 > 32, so the entropy check is done on the loop
+        failed |= result_len == 0 || params.single_segment || params.no_timestamps;
+    } else {
+        failed |= result_len == 0 || seek_delta < 100*WHISPER_CHUNK_SIZE/2;
+    }
+
+    return failed ? i_end - i : 0;
+}
+
+// appends the segments of the tokens decoded in a window to the results of the state - the text between two timestamp
+// tokens is a segment, and the text after the last one ends at seek + seek_delta
+// returns the number of tokens written to the segments
+static int whisper_full_add_segments(
+                  struct whisper_context * ctx,
+                    struct whisper_state * state,
+        const struct whisper_full_params & params,
+   const std::vector<whisper_token_data> & tokens_cur,
+                                     int   seek,
+                                     int   seek_delta) {
+    auto & result_all = state->result_all;
+
+    int n_tokens = 0;
+
+    if (tokens_cur.empty()) {
+        return 0;
+    }
+
+    int  i0 = 0;
+    auto t0 = seek + 2*(tokens_cur.front().tid - whisper_token_beg(ctx));
+
+    std::string text;
+    bool speaker_turn_next = false;
+
+    for (int i = 0; i < (int) tokens_cur.size(); i++) {
+        //printf("%s: %18s %6.3f %18s %6.3f\n", __func__,
+        //        ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].p,
+        //        ctx->vocab.id_to_token[tokens_cur[i].tid].c_str(), tokens_cur[i].pt);
+
+        if (params.print_special || tokens_cur[i].id < whisper_token_eot(ctx)) {
+            text += whisper_token_to_str(ctx, tokens_cur[i].id);
+        }
 
-        int cnt = 0;
-        double entropy = 0.0f;
+        // [TDRZ] record if speaker turn was predicted after current segment
+        if (params.tdrz_enable && tokens_cur[i].id == whisper_token_solm(ctx)) {
+            speaker_turn_next = true;
+        }
+
+        if (tokens_cur[i].id > whisper_token_beg(ctx) && !params.single_segment) {
+            const auto t1 = seek + 2*(tokens_cur[i].tid - whisper_token_beg(ctx));
+
+            if (!text.empty()) {
+                const auto tt0 = params.speed_up ? 2*t0 : t0;
+                const auto tt1 = params.speed_up ? 2*t1 : t1;
+
+                if (params.print_realtime) {
+                    if (params.print_timestamps) {
+                        printf("[%s --> %s]  %s\n", to_timestamp(tt0).c_str(), to_timestamp(tt1).c_str(), text.c_str());
+                    } else {
+                        printf("%s", text.c_str());
+                        fflush(stdout);
+                    }
+                }
+
+                //printf("tt0 = %d, tt1 = %d, text = %s, token = %s, token_id = %d, tid = %d\n", tt0, tt1, text.c_str(), ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].id, tokens_cur[i].tid);
 
-        std::map<whisper_token, int> token_counts;
-        for (int i = std::max(0, sequence.result_len - n); i < sequence.result_len; ++i) {
-            token_counts[sequence.tokens[i].id]++;
-            cnt++;
+                result_all.push_back({ tt0, tt1, text, {}, speaker_turn_next, state->no_speech_prob });
+                for (int j = i0; j <= i; j++) {
+                    result_all.back().tokens.push_back(tokens_cur[j]);
+                    n_tokens++;
+                }
+
+                int n_new = 1;
+
+                if (params.token_timestamps) {
+                    whisper_exp_compute_token_level_timestamps(
+                            *ctx, *state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
+
+                    if (params.max_len > 0) {
+                        n_new = whisper_wrap_segment(*ctx, *state, params.max_len, params.split_on_word);
+                    }
+                }
+                if (params.new_segment_callback) {
+                    params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
+                }
+            }
+            text = "";
+            while (i < (int) tokens_cur.size() && tokens_cur[i].id > whisper_token_beg(ctx)) {
+                i++;
+            }
+            i--;
+            t0 = t1;
+            i0 = i + 1;
+            speaker_turn_next = false;
         }
+    }
+
+    if (!text.empty()) {
+        const auto t1 = seek + seek_delta;
 
-        for (const auto & kv : token_counts) {
-            const auto p = kv.second/(double)cnt;
-            entropy -= p*log(p);
+        const auto tt0 = params.speed_up ? 2*t0 : t0;
+        const auto tt1 = params.speed_up ? 2*t1 : t1;
+
+        if (params.print_realtime) {
+            if (params.print_timestamps) {
+                printf("[%s --> %s]  %s\n", to_timestamp(tt0).c_str(), to_timestamp(tt1).c_str(), text.c_str());
+            } else {
+                printf("%s", text.c_str());
+                fflush(stdout);
+            }
+        }
 
-            //WHISPER_LOG_DEBUG("entropy: %d %f %f, count %d\n", kv.first, p, log(p), kv.second);
+        result_all.push_back({ tt0, tt1, text, {} , speaker_turn_next, state->no_speech_prob });
+        for (int j = i0; j < (int) tokens_cur.size(); j++) {
+            result_all.back().tokens.push_back(tokens_cur[j]);
+            n_tokens++;
         }
 
-        sequence.entropy = entropy;
+        int n_new = 1;
+
+        if (params.token_timestamps) {
+            whisper_exp_compute_token_level_timestamps(
+                    *ctx, *state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
+
+            if (params.max_len > 0) {
+                n_new = whisper_wrap_segment(*ctx, *state, params.max_len, params.split_on_word);
+            }
+        }
+        if (params.new_segment_callback) {
+            params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
+        }
     }
+
+    return n_tokens;
 }
 
 int whisper_full_with_state(
@@ -5219,6 +6709,10 @@ int whisper_full_with_state(
     struct whisper_full_params   params,
                    const float * samples,
                            int   n_samples) {
+    const int64_t t_start_us = ggml_time_us();
+
+    whisper_trace_scope trace_scope(*state, "whisper_full");
+
     // clear old results
     auto & result_all = state->result_all;
 
@@ -5407,6 +6901,10 @@ int whisper_full_with_state(
     std::vector<std::vector<beam_candidate>> bc_per_dec(n_decoders);
     std::vector<beam_candidate> beam_candidates;
 
+    // used to estimate the cost of a window when decoding with a deadline
+    const int64_t t_loop_start_us = ggml_time_us();
+    int n_windows = 0;
+
     // main loop
     while (true) {
         if (params.progress_callback) {
@@ -5421,6 +6919,13 @@ int whisper_full_with_state(
             break;
         }
 
+        whisper_trace_scope trace_scope_window(*state, "window");
+
+        const int64_t t_window_start_us = ggml_time_us();
+
+        n_windows++;
+        state->n_windows++;
+
         if (params.encoder_begin_callback) {
             if (params.encoder_begin_callback(ctx, state, params.encoder_begin_callback_user_data) == false) {
                 WHISPER_LOG_ERROR("%s: encoder_begin_callback returned false - aborting\n", __func__);
@@ -5434,6 +6939,58 @@ int whisper_full_with_state(
             return -6;
         }
 
+        int n_temperatures = temperatures.size();
+        int n_decoders_max = n_decoders;
+        int max_tokens     = params.max_tokens;
+
+        // degrade the decoding of this window if it does not fit in the remaining time budget
+        // the budget of the window is the time left when it started split evenly across the remaining windows and it is
+        // compared to the average cost of the previous windows. for the first window, it is compared to twice the time of
+        // its encoder - roughly the cost of the encoder and one decoding pass:
+        //
+        //   - budget < 1.50 x cost : no temperature fallback (each fallback costs about as much as the window itself)
+        //   - budget < 1.00 x cost : use a single decoder instead of beam search / best-of
+        //   - budget < 0.75 x cost : reduce the max number of tokens in proportion to the budget
+        //
+        // note: audio_ctx is left unchanged - a smaller encoder context also shortens the window, so the remaining
+        //       audio needs more windows and the total encoder time barely changes
+        if (params.deadline_ms > 0) {
+            const int64_t t_left_us = t_start_us + 1000ll*params.deadline_ms - t_window_start_us;
+
+            const int n_windows_left = (seek_end - seek + 100*WHISPER_CHUNK_SIZE - 1)/(100*WHISPER_CHUNK_SIZE);
+
+            const double t_window_us = n_windows > 1 ? double(t_window_start_us - t_loop_start_us)/(n_windows - 1)
+                                                     : 2.0*std::max<int64_t>(1, ggml_time_us() - t_window_start_us);
+            const double ratio       = double(t_left_us)/n_windows_left/t_window_us;
+
+            if (t_left_us <= 0) {
+                state->n_dl_missed++;
+            }
+
+            if (ratio < 1.5 && n_temperatures > 1) {
+                n_temperatures = 1;
+                state->n_dl_fallback++;
+            }
+
+            if (ratio < 1.0 && n_decoders_max > 1) {
+                n_decoders_max = 1;
+                state->n_dl_decoders++;
+            }
+
+            if (ratio < 0.75) {
+                const int n_max = whisper_n_text_ctx(ctx)/2 - 4;
+                const int max_tokens_dl = std::max(32, int(std::max(0.0, ratio)*n_max));
+
+                if (max_tokens == 0 || max_tokens > max_tokens_dl) {
+                    max_tokens = max_tokens_dl;
+                    state->n_dl_tokens++;
+                }
+            }
+
+            WHISPER_LOG_DEBUG("%s: deadline: %.1f ms left, %d windows left, %.1f ms per window, ratio = %.2f\n",
+                    __func__, t_left_us/1000.0, n_windows_left, t_window_us/1000.0, ratio);
+        }
+
         // if there is a very short audio segment left to process, we remove any past prompt since it tends
         // to confuse the decoder and often make it repeat or hallucinate stuff
         if (seek > seek_start && seek + 500 >= seek_end) {
@@ -5441,10 +6998,13 @@ int whisper_full_with_state(
         }
 
         int best_decoder_id = 0;
+        int best_temp_id    = 0;
 
-        for (int it = 0; it < (int) temperatures.size(); ++it) {
+        for (int it = 0; it < n_temperatures; ++it) {
             const float t_cur = temperatures[it];
 
+            best_temp_id = it;
+
             int n_decoders_cur = 1;
 
             switch (params.strategy) {
@@ -5464,7 +7024,7 @@ int whisper_full_with_state(
                     } break;
             };
 
-            n_decoders_cur = std::max(1, n_decoders_cur);
+            n_decoders_cur = std::max(1, std::min(n_decoders_max, n_decoders_cur));
 
             WHISPER_LOG_DEBUG("\n%s: strategy = %d, decoding with %d decoders, temperature = %.2f\n", __func__, params.strategy, n_decoders_cur, t_cur);
 
@@ -5473,6 +7033,7 @@ int whisper_full_with_state(
                 auto & decoder = state->decoders[j];
 
                 decoder.sequence.tokens.clear();
+                decoder.sequence.hashes.clear();
                 decoder.sequence.result_len       = 0;
                 decoder.sequence.sum_logprobs_all = 0.0;
                 decoder.sequence.sum_logprobs     = -INFINITY;
@@ -5512,19 +7073,47 @@ int whisper_full_with_state(
                 // print the prompt
                 WHISPER_LOG_DEBUG("\n\n");
                 for (int i = 0; i < (int) prompt.size(); i++) {
-                    WHISPER_LOG_DEBUG("%s: prompt[%d] = %s\n", __func__, i, ctx->vocab.id_to_token.at(prompt[i]).c_str());
+                    WHISPER_LOG_DEBUG("%s: prompt[%d] = %s\n", __func__, i, ctx->vocab.str(prompt[i]));
                 }
                 WHISPER_LOG_DEBUG("\n\n");
 
                 whisper_kv_cache_clear(state->kv_self);
 
+                // the SOT token is the first token of prompt_init
+                const int i_sot = prompt.size() - prompt_init.size();
+
                 whisper_batch_prep_legacy(state->batch, prompt.data(), prompt.size(), 0, 0);
 
+                // we also need the logits at the SOT position for the no-speech probability
+                state->batch.logits[i_sot] = 1;
+
                 if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
                     WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
                     return -7;
                 }
 
+                // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/decoding.py
+                // the no-speech probability does not depend on the temperature, so compute it only for the first one
+                if (it == 0) {
+                    const int n_vocab = ctx->vocab.n_vocab;
+
+                    const float * logits_sot = state->logits.data() + i_sot*n_vocab;
+
+                    float logit_max = -INFINITY;
+                    for (int k = 0; k < n_vocab; ++k) {
+                        logit_max = std::max(logit_max, logits_sot[k]);
+                    }
+
+                    double sum = 0.0;
+                    for (int k = 0; k < n_vocab; ++k) {
+                        sum += exp(logits_sot[k] - logit_max);
+                    }
+
+                    state->no_speech_prob = exp(logits_sot[whisper_token_nosp(ctx)] - logit_max)/sum;
+
+                    WHISPER_LOG_DEBUG("%s: no_speech_prob = %8.5f\n", __func__, state->no_speech_prob);
+                }
+
                 {
                     const int64_t t_start_sample_us = ggml_time_us();
 
@@ -5543,6 +7132,7 @@ int whisper_full_with_state(
                     }
 
                     state->t_sample_us += ggml_time_us() - t_start_sample_us;
+                    whisper_trace_add(*state, "sample", t_start_sample_us, ggml_time_us());
                 }
             }
 
@@ -5666,7 +7256,7 @@ int whisper_full_with_state(
                         whisper_kv_cache_seq_cp(state->kv_self, cur.decoder_idx, WHISPER_MAX_DECODERS + j, -1, -1);
 
                         WHISPER_LOG_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
-                                __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(decoder.sequence.tokens.back().id).c_str(), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
+                                __func__, j, cur.decoder_idx, ctx->vocab.str(decoder.sequence.tokens.back().id), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
                     }
 
                     for (int j = 0; j < n_decoders_cur; ++j) {
@@ -5722,15 +7312,15 @@ int whisper_full_with_state(
 
 #ifdef WHISPER_DEBUG
                         {
-                            const auto tt = token.pt > 0.10 ? ctx->vocab.id_to_token.at(token.tid) : "[?]";
+                            const auto tt = token.pt > 0.10 ? ctx->vocab.str(token.tid) : "[?]";
                             WHISPER_LOG_DEBUG("%s: id = %3d, decoder = %d, token = %6d, p = %6.3f, ts = %10s, %6.3f, result_len = %4d '%s'\n",
-                                    __func__, i, j, token.id, token.p, tt.c_str(), token.pt, result_len, ctx->vocab.id_to_token.at(token.id).c_str());
+                                    __func__, i, j, token.id, token.p, tt, token.pt, result_len, ctx->vocab.str(token.id));
                         }
 #endif
 
                         // end of segment
                         if (token.id == whisper_token_eot(ctx) ||               // end of text token
-                           (params.max_tokens > 0 && i >= params.max_tokens) || // max tokens per segment reached
+                           (max_tokens > 0 && i >= max_tokens) ||               // max tokens per segment reached
                            (has_ts && seek + seek_delta + 100 >= seek_end)      // end of audio reached
                            ) {
                             if (result_len == 0 && !params.no_timestamps) {
@@ -5762,6 +7352,15 @@ int whisper_full_with_state(
                     }
 
                     // sometimes, the decoding can get stuck in a repetition loop
+                    // detect it as soon as the last tokens keep repeating the same short n-gram, instead of decoding until n_max
+                    if (const int n_skip = whisper_sequence_check_loop(params, decoder.sequence, whisper_token_beg(ctx), i, n_max, max_tokens, seek_delta)) {
+                        WHISPER_LOG_DEBUG("%s: decoder %d: failed due to repetition loop at token %d\n", __func__, j, i);
+                        failed = true;
+                        state->n_fail_r++;
+                        state->n_skip_r += n_skip;
+                        continue;
+                    }
+
                     // this is an attempt to mitigate such cases - we flag the decoding as failed and use a fallback strategy
                     if (i == n_max - 1 && (result_len == 0 || seek_delta < 100*WHISPER_CHUNK_SIZE/2)) {
                         WHISPER_LOG_DEBUG("%s: decoder %d: failed due to repetition loop\n", __func__, j);
@@ -5790,6 +7389,7 @@ int whisper_full_with_state(
                 }
 
                 state->t_sample_us += ggml_time_us() - t_start_sample_us;
+                whisper_trace_add(*state, "sample", t_start_sample_us, ggml_time_us());
 
                 // obtain logits for the next token
                 {
@@ -5869,6 +7469,7 @@ int whisper_full_with_state(
                     }
 
                     state->t_sample_us += ggml_time_us() - t_start_sample_us;
+                    whisper_trace_add(*state, "sample", t_start_sample_us, ggml_time_us());
                 }
             }
 
@@ -5913,13 +7514,18 @@ int whisper_full_with_state(
             // was the decoding successful for the current temperature?
             // do fallback only if:
             // - we are not at the last temperature
-            if (it != (int) temperatures.size() - 1) {
+            if (it != n_temperatures - 1) {
                 const auto & decoder = state->decoders[best_decoder_id];
 
                 if (decoder.failed || decoder.sequence.avg_logprobs < params.logprob_thold) {
-                    WHISPER_LOG_DEBUG("%s: failed due to avg_logprobs %8.5f < %8.5f\n", __func__, decoder.sequence.avg_logprobs, params.logprob_thold);
-                    success = false;
-                    state->n_fail_p++;
+                    if (state->no_speech_prob > params.no_speech_thold) {
+                        // this is most likely silence - the window is skipped below, so there is no point in a fallback
+                        WHISPER_LOG_DEBUG("%s: no fallback due to no_speech_prob %8.5f > %8.5f\n", __func__, state->no_speech_prob, params.no_speech_thold);
+                    } else {
+                        WHISPER_LOG_DEBUG("%s: failed due to avg_logprobs %8.5f < %8.5f\n", __func__, decoder.sequence.avg_logprobs, params.logprob_thold);
+                        success = false;
+                        state->n_fail_p++;
+                    }
                 }
             }
 
@@ -5934,6 +7540,25 @@ int whisper_full_with_state(
             WHISPER_LOG_DEBUG("\n%s: failed to decode with temperature = %.2f\n", __func__, t_cur);
         }
 
+        state->n_temp[std::min(best_temp_id, WHISPER_MAX_TEMPERATURES - 1)]++;
+
+        // skip the whole window if it most likely contains no speech
+        // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/transcribe.py
+        {
+            const auto & best_decoder = state->decoders[best_decoder_id];
+
+            if (state->no_speech_prob > params.no_speech_thold &&
+                (best_decoder.failed || best_decoder.sequence.avg_logprobs < params.logprob_thold)) {
+                WHISPER_LOG_DEBUG("%s: skipping window due to no_speech_prob %8.5f > %8.5f\n", __func__, state->no_speech_prob, params.no_speech_thold);
+
+                state->n_skip_s++;
+
+                seek += std::min(100*WHISPER_CHUNK_SIZE, seek_end - seek);
+                continue;
+            }
+
+        }
+
         // output results through a user-provided callback
         {
             const auto & best_decoder = state->decoders[best_decoder_id];
@@ -5958,109 +7583,8 @@ int whisper_full_with_state(
                 prompt_past.push_back(tokens_cur[i].id);
             }
 
-            if (!tokens_cur.empty() && ctx->model.n_loaded > 0) {
-                int  i0 = 0;
-                auto t0 = seek + 2*(tokens_cur.front().tid - whisper_token_beg(ctx));
-
-                std::string text;
-                bool speaker_turn_next = false;
-
-                for (int i = 0; i < (int) tokens_cur.size(); i++) {
-                    //printf("%s: %18s %6.3f %18s %6.3f\n", __func__,
-                    //        ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].p,
-                    //        ctx->vocab.id_to_token[tokens_cur[i].tid].c_str(), tokens_cur[i].pt);
-
-                    if (params.print_special || tokens_cur[i].id < whisper_token_eot(ctx)) {
-                        text += whisper_token_to_str(ctx, tokens_cur[i].id);
-                    }
-
-                    // [TDRZ] record if speaker turn was predicted after current segment
-                    if (params.tdrz_enable && tokens_cur[i].id == whisper_token_solm(ctx)) {
-                        speaker_turn_next = true;
-                    }
-
-                    if (tokens_cur[i].id > whisper_token_beg(ctx) && !params.single_segment) {
-                        const auto t1 = seek + 2*(tokens_cur[i].tid - whisper_token_beg(ctx));
-
-                        if (!text.empty()) {
-                            const auto tt0 = params.speed_up ? 2*t0 : t0;
-                            const auto tt1 = params.speed_up ? 2*t1 : t1;
-
-                            if (params.print_realtime) {
-                                if (params.print_timestamps) {
-                                    printf("[%s --> %s]  %s\n", to_timestamp(tt0).c_str(), to_timestamp(tt1).c_str(), text.c_str());
-                                } else {
-                                    printf("%s", text.c_str());
-                                    fflush(stdout);
-                                }
-                            }
-
-                            //printf("tt0 = %d, tt1 = %d, text = %s, token = %s, token_id = %d, tid = %d\n", tt0, tt1, text.c_str(), ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].id, tokens_cur[i].tid);
-
-                            result_all.push_back({ tt0, tt1, text, {}, speaker_turn_next });
-                            for (int j = i0; j <= i; j++) {
-                                result_all.back().tokens.push_back(tokens_cur[j]);
-                            }
-
-                            int n_new = 1;
-
-                            if (params.token_timestamps) {
-                                whisper_exp_compute_token_level_timestamps(
-                                        *ctx, *state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
-
-                                if (params.max_len > 0) {
-                                    n_new = whisper_wrap_segment(*ctx, *state, params.max_len, params.split_on_word);
-                                }
-                            }
-                            if (params.new_segment_callback) {
-                                params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
-                            }
-                        }
-                        text = "";
-                        while (i < (int) tokens_cur.size() && tokens_cur[i].id > whisper_token_beg(ctx)) {
-                            i++;
-                        }
-                        i--;
-                        t0 = t1;
-                        i0 = i + 1;
-                        speaker_turn_next = false;
-                    }
-                }
-
-                if (!text.empty()) {
-                    const auto t1 = seek + seek_delta;
-
-                    const auto tt0 = params.speed_up ? 2*t0 : t0;
-                    const auto tt1 = params.speed_up ? 2*t1 : t1;
-
-                    if (params.print_realtime) {
-                        if (params.print_timestamps) {
-                            printf("[%s --> %s]  %s\n", to_timestamp(tt0).c_str(), to_timestamp(tt1).c_str(), text.c_str());
-                        } else {
-                            printf("%s", text.c_str());
-                            fflush(stdout);
-                        }
-                    }
-
-                    result_all.push_back({ tt0, tt1, text, {} , speaker_turn_next });
-                    for (int j = i0; j < (int) tokens_cur.size(); j++) {
-                        result_all.back().tokens.push_back(tokens_cur[j]);
-                    }
-
-                    int n_new = 1;
-
-                    if (params.token_timestamps) {
-                        whisper_exp_compute_token_level_timestamps(
-                                *ctx, *state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
-
-                        if (params.max_len > 0) {
-                            n_new = whisper_wrap_segment(*ctx, *state, params.max_len, params.split_on_word);
-                        }
-                    }
-                    if (params.new_segment_callback) {
-                        params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
-                    }
-                }
+            if (ctx->model.n_loaded > 0) {
+                state->n_tokens += whisper_full_add_segments(ctx, state, params, tokens_cur, seek, seek_delta);
             }
 
             // FIXME: will timestamp offsets be correct?
@@ -6187,6 +7711,27 @@ int whisper_full_parallel(
         ctx->state->n_batchd += states[i]->n_batchd;
         ctx->state->n_prompt += states[i]->n_prompt;
 
+        ctx->state->n_fail_p += states[i]->n_fail_p;
+        ctx->state->n_fail_h += states[i]->n_fail_h;
+        ctx->state->n_fail_r += states[i]->n_fail_r;
+        ctx->state->n_skip_r += states[i]->n_skip_r;
+        ctx->state->n_skip_s += states[i]->n_skip_s;
+
+        ctx->state->t_graph_us   += states[i]->t_graph_us;
+        ctx->state->t_compute_us += states[i]->t_compute_us;
+
+        ctx->state->n_windows += states[i]->n_windows;
+        ctx->state->n_tokens  += states[i]->n_tokens;
+
+        for (int j = 0; j < WHISPER_MAX_TEMPERATURES; ++j) {
+            ctx->state->n_temp[j] += states[i]->n_temp[j];
+        }
+
+        ctx->state->n_dl_fallback += states[i]->n_dl_fallback;
+        ctx->state->n_dl_decoders += states[i]->n_dl_decoders;
+        ctx->state->n_dl_tokens   += states[i]->n_dl_tokens;
+        ctx->state->n_dl_missed   += states[i]->n_dl_missed;
+
         whisper_free_state(states[i]);
     }
 
@@ -6247,6 +7792,14 @@ bool whisper_full_get_segment_speaker_turn_next(struct whisper_context * ctx, in
     return ctx->state->result_all[i_segment].speaker_turn_next;
 }
 
+float whisper_full_get_segment_no_speech_prob_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].no_speech_prob;
+}
+
+float whisper_full_get_segment_no_speech_prob(struct whisper_context * ctx, int i_segment) {
+    return ctx->state->result_all[i_segment].no_speech_prob;
+}
+
 const char * whisper_full_get_segment_text_from_state(struct whisper_state * state, int i_segment) {
     return state->result_all[i_segment].text.c_str();
 }
@@ -6264,11 +7817,11 @@ int whisper_full_n_tokens(struct whisper_context * ctx, int i_segment) {
 }
 
 const char * whisper_full_get_token_text_from_state(struct whisper_context * ctx, struct whisper_state * state, int i_segment, int i_token) {
-    return ctx->vocab.id_to_token[state->result_all[i_segment].tokens[i_token].id].c_str();
+    return ctx->vocab.str(state->result_all[i_segment].tokens[i_token].id);
 }
 
 const char* whisper_full_get_token_text(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->vocab.id_to_token[ctx->state->result_all[i_segment].tokens[i_token].id].c_str();
+    return ctx->vocab.str(ctx->state->result_all[i_segment].tokens[i_token].id);
 }
 
 whisper_token whisper_full_get_token_id_from_state(struct whisper_state * state, int i_segment, int i_token) {
@@ -34,6 +34,8 @@
 #define WHISPER_HOP_LENGTH  160
 #define WHISPER_CHUNK_SIZE  30
 
+#define WHISPER_MAX_TEMPERATURES 8 // size of whisper_timings.n_temp
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -111,9 +113,15 @@ extern "C" {
         const whisper_ahead * heads;
     } whisper_aheads;
 
+    // called for each node of the compute graphs with ask == true - return true to be called again with ask == false
+    // once the node is computed, while its inputs are still intact. returning false then stops the computation
+    // same as ggml_backend_sched_eval_callback. the weights are named as in the model file
+    typedef bool (*whisper_eval_callback)(struct ggml_tensor * t, bool ask, void * user_data);
+
     struct whisper_context_params {
         bool  use_gpu;
         int   gpu_device;  // CUDA device
+        bool  use_mmap;    // map the model file instead of reading it - with the CPU backend, the weights of a GGUF file are not copied
 
         // [EXPERIMENTAL] Token-level timestamps with DTW
         bool dtw_token_timestamps;
@@ -123,6 +131,9 @@ extern "C" {
         struct whisper_aheads dtw_aheads;
 
         size_t dtw_mem_size; // TODO: remove
+
+        whisper_eval_callback cb_eval;
+        void * cb_eval_user_data;
     };
 
     typedef struct whisper_token_data {
@@ -243,6 +254,14 @@ extern "C" {
                     const char * device,
                     const char * cache_dir);
 
+    // Same as above, but for a state created with whisper_init_state()
+    WHISPER_API int whisper_ctx_init_openvino_encoder_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                    const char * model_path,
+                    const char * device,
+                    const char * cache_dir);
+
     // Frees all allocated memory
     WHISPER_API void whisper_free      (struct whisper_context * ctx);
     WHISPER_API void whisper_free_state(struct whisper_state * state);
@@ -433,6 +452,65 @@ extern "C" {
     WHISPER_API void whisper_print_timings(struct whisper_context * ctx);
     WHISPER_API void whisper_reset_timings(struct whisper_context * ctx);
 
+    // Performance counters of a state, accumulated over the whisper_full calls since the state was created
+    // (or since whisper_reset_timings for the default state) - take the difference of two snapshots to measure a call
+    typedef struct whisper_timings {
+        int64_t t_mel_us;
+        int64_t t_sample_us;
+        int64_t t_encode_us;
+        int64_t t_decode_us;
+        int64_t t_batchd_us;
+        int64_t t_prompt_us;
+
+        int32_t n_sample; // number of tokens sampled
+        int32_t n_encode; // number of encoder calls
+        int32_t n_decode; // number of decoder calls with a single token
+        int32_t n_batchd; // number of decoder calls with a batch of tokens
+        int32_t n_prompt; // number of decoder calls for the prompt
+
+        int32_t n_fail_p; // number of logprob threshold failures
+        int32_t n_fail_h; // number of entropy threshold failures
+        int32_t n_fail_r; // number of decoders stopped early due to a repetition loop
+        int32_t n_skip_r; // number of decoding steps saved by stopping repetition loops early
+        int32_t n_skip_s; // number of windows skipped as no speech
+
+        // decoding degraded to meet whisper_full_params.deadline_ms
+        int32_t n_dl_fallback; // number of windows decoded without temperature fallback
+        int32_t n_dl_decoders; // number of windows decoded with a single decoder
+        int32_t n_dl_tokens;   // number of windows decoded with a reduced max_tokens
+        int32_t n_dl_missed;   // number of windows started after the deadline has passed
+
+        // time of the encoder and decoder calls split into building/allocating the graphs and computing them
+        int64_t t_graph_us;
+        int64_t t_compute_us;
+
+        int32_t n_windows; // number of windows processed
+        int32_t n_tokens;  // number of tokens generated in the results
+
+        // number of windows decoded at the i-th temperature of the fallback (0 - no fallback)
+        // the last element also counts the windows decoded at higher temperatures
+        int32_t n_temp[WHISPER_MAX_TEMPERATURES];
+
+        size_t mem_compute; // peak size of the compute buffers in bytes
+        size_t mem_kv;      // size of the self-attention and cross-attention KV caches in bytes
+    } whisper_timings;
+
+    WHISPER_API struct whisper_timings whisper_get_timings           (struct whisper_context * ctx);
+    WHISPER_API struct whisper_timings whisper_get_timings_from_state(struct whisper_state * state);
+
+    // [EXPERIMENTAL] Tracing
+    // Records a timeline of the processing: the stages of whisper_full() (mel, window, encode, prompt, decode, sample, ...)
+    // and, with the CPU backend, each graph node computed by each ggml thread (op, tensor, shape, type)
+    // Off by default - when disabled, the only cost is a branch per stage and per node
+    WHISPER_API void whisper_trace_enable           (struct whisper_context * ctx,   bool enable);
+    WHISPER_API void whisper_trace_enable_with_state(struct whisper_state   * state, bool enable);
+
+    // Writes the events recorded since the previous call to fname in the Chrome trace event format
+    // (open with chrome://tracing or https://ui.perfetto.dev) and clears them
+    // Returns 0 on success
+    WHISPER_API int whisper_trace_write           (struct whisper_context * ctx,   const char * fname);
+    WHISPER_API int whisper_trace_write_with_state(struct whisper_state   * state, const char * fname);
+
     // Print system information
     WHISPER_API const char * whisper_print_system_info(void);
 
@@ -478,6 +556,7 @@ extern "C" {
         int n_max_text_ctx;     // max tokens to use from past text as prompt for the decoder
         int offset_ms;          // start offset in ms
         int duration_ms;        // audio duration to process in ms
+        int deadline_ms;        // time budget for processing in ms (0 = no limit), decoding is degraded to meet it
 
         bool translate;
         bool no_context;        // do not use past transcription (if any) as initial prompt for the decoder
@@ -533,7 +612,7 @@ extern "C" {
         float temperature_inc;
         float entropy_thold;    // similar to OpenAI's "compression_ratio_threshold"
         float logprob_thold;
-        float no_speech_thold;  // TODO: not implemented
+        float no_speech_thold;  // skip the window if the no-speech probability is above this and the avg logprob is below logprob_thold
 
         struct {
             int best_of;    // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/transcribe.py#L264
@@ -557,7 +636,8 @@ extern "C" {
         whisper_encoder_begin_callback encoder_begin_callback;
         void * encoder_begin_callback_user_data;
 
-        // called each time before ggml computation starts
+        // called each time before ggml computation starts - on the CPU backend also before each graph node, by the
+        // compute thread that starts it
         ggml_abort_callback abort_callback;
         void * abort_callback_user_data;
 
@@ -627,6 +707,10 @@ extern "C" {
     WHISPER_API bool whisper_full_get_segment_speaker_turn_next(struct whisper_context * ctx, int i_segment);
     WHISPER_API bool whisper_full_get_segment_speaker_turn_next_from_state(struct whisper_state * state, int i_segment);
 
+    // Get the no-speech probability of the window that produced the specified segment
+    WHISPER_API float whisper_full_get_segment_no_speech_prob           (struct whisper_context * ctx, int i_segment);
+    WHISPER_API float whisper_full_get_segment_no_speech_prob_from_state(struct whisper_state * state, int i_segment);
+
     // Get the text of the specified segment
     WHISPER_API const char * whisper_full_get_segment_text           (struct whisper_context * ctx, int i_segment);
     WHISPER_API const char * whisper_full_get_segment_text_from_state(struct whisper_state * state, int i_segment);